@@ -49,3 +49,32 @@ LOCAL_SRC_FILES := gps_qemu.c
 LOCAL_MODULE := gps.ranchu
 
 include $(BUILD_SHARED_LIBRARY)
+
+
+# Fix batching for the gps module in the same process, stored in
+# hw/<FUSED_LOCATION_HARDWARE_MODULE_ID>.<ro.hardware>.so
+include $(CLEAR_VARS)
+
+LOCAL_VENDOR_MODULE := true
+LOCAL_MODULE_RELATIVE_PATH := hw
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware
+LOCAL_SRC_FILES := flp_qemu.c
+ifeq ($(TARGET_PRODUCT),vbox_x86)
+LOCAL_MODULE := flp.vbox_x86
+else
+LOCAL_MODULE := flp.goldfish
+endif
+include $(BUILD_SHARED_LIBRARY)
+
+
+include $(CLEAR_VARS)
+
+LOCAL_VENDOR_MODULE := true
+LOCAL_MODULE_RELATIVE_PATH := hw
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware
+LOCAL_SRC_FILES := flp_qemu.c
+LOCAL_MODULE := flp.ranchu
+
+include $(BUILD_SHARED_LIBRARY)
+
+include $(LOCAL_PATH)/tests.mk
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* this implements a fused location hardware library for the Android
+ * emulator, placed into /vendor/lib/hw/flp.goldfish.so. It only batches
+ * GNSS fixes, and the batching itself is done by the gps module, see
+ * qemu_gps.h.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define  LOG_TAG  "flp_qemu"
+#include <cutils/log.h>
+#include <hardware/gps.h>
+#include "qemu_gps.h"
+
+static const FlpLocationInterface*  qemu_flp_interface;
+
+static const FlpLocationInterface*
+flp__get_flp_interface(struct flp_device_t* __unused dev)
+{
+    return qemu_flp_interface;
+}
+
+static int close_flp(struct hw_device_t* dev)
+{
+    free(dev);
+    return 0;
+}
+
+static int open_flp(const struct hw_module_t* module,
+                    char const* __unused name,
+                    struct hw_device_t** device)
+{
+    const struct hw_module_t*  gps;
+    struct flp_device_t*       dev;
+
+    if (hw_get_module(GPS_HARDWARE_MODULE_ID, &gps) != 0 ||
+        strcmp(gps->name, QEMU_GPS_MODULE_NAME) != 0) {
+        ALOGE("%s: no emulator gps module to batch fixes from", __FUNCTION__);
+        return -ENODEV;
+    }
+    qemu_flp_interface = ((const QemuGpsModule*)gps)->flp_interface;
+
+    dev = malloc(sizeof(*dev));
+    if (dev == NULL)
+        return -ENOMEM;
+    memset(dev, 0, sizeof(*dev));
+
+    dev->common.tag = HARDWARE_DEVICE_TAG;
+    dev->common.version = 0;
+    dev->common.module = (struct hw_module_t*)module;
+    dev->common.close = close_flp;
+    dev->get_flp_interface = flp__get_flp_interface;
+
+    *device = (struct hw_device_t*)dev;
+    return 0;
+}
+
+
+static struct hw_module_methods_t flp_module_methods = {
+    .open = open_flp
+};
+
+struct hw_module_t HAL_MODULE_INFO_SYM = {
+    .tag = HARDWARE_MODULE_TAG,
+    .version_major = 1,
+    .version_minor = 0,
+    .id = FUSED_LOCATION_HARDWARE_MODULE_ID,
+    .name = "Goldfish FLP Module",
+    .author = "The Android Open Source Project",
+    .methods = &flp_module_methods,
+};
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* libFuzzer target for the NMEA tokenizer, the field helpers and the
+ * reader.
+ *
+ * Each input line is checked with the tokenizer and helpers directly,
+ * then fed to the reader. When the first byte is odd, lines are given
+ * a valid checksum first so that the parsers behind it are reached.
+ */
+#include "gps_qemu.c"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+static void on_location(GpsLocation* location)
+{
+    if (location->flags & GPS_LOCATION_HAS_LAT_LONG) {
+        if (!(location->latitude >= -90. && location->latitude <= 90.) ||
+            !(location->longitude >= -180. && location->longitude <= 180.))
+            abort();
+    }
+}
+
+static void on_sv_status(GpsSvStatus* sv_status)
+{
+    if (sv_status->num_svs < 0 || sv_status->num_svs > GPS_MAX_SVS)
+        abort();
+}
+
+static void check_line(const char* p, const char* end)
+{
+    NmeaTokenizer  tzer[1];
+    int            n;
+
+    nmea_tokenizer_init(tzer, p, end);
+    if (tzer->count < 0 || tzer->count > MAX_NMEA_TOKENS)
+        abort();
+
+    for (n = 0; n < tzer->count; n++) {
+        Token   tok = nmea_tokenizer_get(tzer, n);
+        double  coord;
+
+        if (tok.p < p || tok.end > end || tok.p > tok.end)
+            abort();
+
+        if (str2int(tok.p, tok.end) < -1)
+            abort();
+
+        str2float(tok.p, tok.end);
+
+        coord = convert_from_hhmm(tok);
+        if (!isnan(coord) && !(coord >= 0. && coord < 182.))
+            abort();
+    }
+}
+
+static void put_line(NmeaReader* r, const char* p, const char* end, int fix_checksum)
+{
+    int  len = end - p;
+
+    if (fix_checksum) {
+        const char*  star = memchr(p, '*', len);
+        int          sum = 0;
+        const char*  q;
+
+        if (star != NULL)
+            end = star;
+        if (p < end && *p == '$')
+            p++;
+        for (q = p; q < end; q++)
+            sum ^= (unsigned char)*q;
+
+        len = end - p;
+        if (len > (int)sizeof(r->buf) - r->tail - 6)
+            len = sizeof(r->buf) - r->tail - 6;
+        if (len < 0)
+            return;
+        r->buf[r->tail++] = '$';
+        memcpy(r->buf + r->tail, p, len);
+        r->tail += len;
+        r->tail += snprintf(r->buf + r->tail, sizeof(r->buf) - r->tail,
+                            "*%02X\n", sum);
+    } else {
+        if (len > (int)sizeof(r->buf) - r->tail)
+            len = sizeof(r->buf) - r->tail;
+        memcpy(r->buf + r->tail, p, len);
+        r->tail += len;
+    }
+    nmea_reader_parse_buffer(r);
+
+    if (r->head > 0) {
+        memmove(r->buf, r->buf + r->head, r->tail - r->head);
+        r->tail -= r->head;
+        r->head  = 0;
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static NmeaReader  reader[1];
+    const char*  p   = (const char*) data;
+    const char*  end = p + size;
+    int          fix_checksum;
+
+    if (size == 0)
+        return 0;
+
+    fix_checksum = data[0] & 1;
+    p++;
+
+    nmea_reader_init(reader);
+    nmea_reader_set_callback(reader, on_location);
+    nmea_reader_set_sv_callback(reader, on_sv_status);
+
+    while (p < end) {
+        const char*  q = memchr(p, '\n', end - p);
+
+        q = (q != NULL) ? q + 1 : end;
+        check_line(p, q);
+        put_line(reader, p, q, fix_checksum);
+        p = q;
+    }
+    return 0;
+}
@@ -27,14 +27,17 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <math.h>
 #include <time.h>
+#include <limits.h>
 
 #define  LOG_TAG  "gps_qemu"
 #include <cutils/log.h>
 #include <cutils/sockets.h>
 #include <hardware/gps.h>
 #include "qemu_pipe.h"
+#include "qemu_gps.h"
 
 /* the name of the qemu-controlled pipe */
 #define  QEMU_CHANNEL_NAME  "qemud:gps"
@@ -61,7 +64,8 @@ typedef struct {
     const char*  end;
 } Token;
 
-#define  MAX_NMEA_TOKENS  16
+// enough for a GSV sentence with four satellites
+#define  MAX_NMEA_TOKENS  24
 
 typedef struct {
     int     count;
@@ -143,6 +147,9 @@ str2int( const char*  p, const char*  end )
         if ((unsigned)c >= 10)
             goto Fail;
 
+        if (result > (INT_MAX - c) / 10)
+            goto Fail;
+
         result = result*10 + c;
     }
     return  result;
@@ -173,73 +180,219 @@ str2float( const char*  p, const char*  end )
 /*****************************************************************/
 /*****************************************************************/
 
-#define  NMEA_MAX_SIZE  83
+#define  NMEA_MAX_SIZE     83
+#define  NMEA_BUFFER_SIZE  4096
+
+/* a fix this early for its interval is reported rather than held back,
+ * so that fixes at the host's own rate aren't delayed by jitter. Short
+ * intervals only get a tenth of themselves.
+ */
+#define  FIX_INTERVAL_SLACK_MS  100
+
+static long long
+fix_interval_slack( long long  interval )
+{
+    return interval / 10 < FIX_INTERVAL_SLACK_MS ? interval / 10 : FIX_INTERVAL_SLACK_MS;
+}
 
+/* input is read straight into |buf| and parsed in place. Complete
+ * sentences are consumed from |head|, so at most one partial sentence
+ * is left to move back to the start of the buffer before the next read.
+ */
+/* satellites are collected from the GSV sentences of an epoch into
+ * |sv_pending|, and |sv_used_mask| from its GSA sentences. At the next
+ * GGA or RMC sentence, or when the first talker starts over, the table
+ * replaces |sv_status| if all GSV sets that were started are complete,
+ * and is reported if it differs from the last one.
+ */
 typedef struct {
-    int     pos;
+    int     head;
+    int     tail;
     int     overflow;
+    int     bad_checksums;
     int     utc_year;
     int     utc_mon;
     int     utc_day;
-    int     utc_diff;
+    long long  day_base;       /* ms from the epoch to 00:00 UTC of the fix date */
+    long long  time_of_day;    /* ms since midnight of the last fix, -1 if none */
     GpsLocation  fix;
     gps_location_callback  callback;
-    char    in[ NMEA_MAX_SIZE+1 ];
+    int          min_interval;    /* ms between reported fixes, 0 for every fix */
+    int          single_shot;     /* report one fix per session */
+    int          fix_pending;     /* a fix is held until the interval passes */
+    int          fix_reported;    /* a fix was reported this session */
+    long long    last_report;     /* CLOCK_MONOTONIC ms of the last reported fix */
+    GpsSvStatus  sv_pending;
+    GpsSvStatus  sv_status;
+    uint32_t     sv_used_mask;
+    int          sv_valid;        /* sv_status came from GSV sentences */
+    int          gsv_next;        /* next message of the current GSV set, 0 if none */
+    int          gsv_complete;    /* a GSV set completed since the last report */
+    char         gsv_talker[2];   /* talker of the first GSV set of the epoch */
+    gps_sv_status_callback  sv_callback;
+    gps_location_callback   batch_callback;  /* every fix, with or without a session */
+    char    buf[ NMEA_BUFFER_SIZE ];
 } NmeaReader;
 
 
 static void
-nmea_reader_update_utc_diff( NmeaReader*  r )
+nmea_reader_init( NmeaReader*  r )
 {
-    time_t         now = time(NULL);
-    struct tm      tm_local;
-    struct tm      tm_utc;
-    long           time_local, time_utc;
+    memset( r, 0, sizeof(*r) );
 
-    gmtime_r( &now, &tm_utc );
-    localtime_r( &now, &tm_local );
+    r->head     = 0;
+    r->tail     = 0;
+    r->overflow = 0;
+    r->utc_year = -1;
+    r->utc_mon  = -1;
+    r->utc_day  = -1;
+    r->time_of_day = -1;
+    r->callback = NULL;
+    r->fix.size = sizeof(r->fix);
+    r->sv_pending.size = sizeof(r->sv_pending);
+    r->sv_status.size  = sizeof(r->sv_status);
+}
 
-    time_local = tm_local.tm_sec +
-                 60*(tm_local.tm_min +
-                 60*(tm_local.tm_hour +
-                 24*(tm_local.tm_yday +
-                 365*tm_local.tm_year)));
 
-    time_utc = tm_utc.tm_sec +
-               60*(tm_utc.tm_min +
-               60*(tm_utc.tm_hour +
-               24*(tm_utc.tm_yday +
-               365*tm_utc.tm_year)));
+static long long
+now_ms( void )
+{
+    struct timespec  ts;
 
-    r->utc_diff = time_utc - time_local;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
 
 static void
-nmea_reader_init( NmeaReader*  r )
+nmea_reader_send_fix( NmeaReader*  r )
 {
-    memset( r, 0, sizeof(*r) );
+    r->fix_pending  = 0;
+    r->fix_reported = 1;
+    r->last_report  = now_ms();
+    r->callback( &r->fix );
+}
 
-    r->pos      = 0;
-    r->overflow = 0;
-    r->utc_year = -1;
-    r->utc_mon  = -1;
-    r->utc_day  = -1;
-    r->callback = NULL;
-    r->fix.size = sizeof(r->fix);
 
-    nmea_reader_update_utc_diff( r );
+/* called for every new fix, sends it unless the client wants fewer */
+static void
+nmea_reader_report_fix( NmeaReader*  r )
+{
+    if (r->batch_callback) {
+        r->batch_callback( &r->fix );
+    }
+
+    if (!r->callback) {
+        D("no callback, keeping data until needed !");
+        return;
+    }
+
+    if (r->single_shot && r->fix_reported) {
+        return;
+    }
+
+    if (r->fix_reported && r->min_interval > 0 &&
+        now_ms() - r->last_report < r->min_interval - fix_interval_slack( r->min_interval )) {
+        // only the latest fix of the interval is sent
+        r->fix_pending = 1;
+        return;
+    }
+
+    nmea_reader_send_fix( r );
+}
+
+
+/* returns the CLOCK_MONOTONIC ms when a held fix is due, or -1 if none is held */
+static long long
+nmea_reader_fix_due( NmeaReader*  r )
+{
+    if (!r->fix_pending || !r->callback)
+        return -1;
+
+    return r->last_report + r->min_interval;
+}
+
+
+static void
+nmea_reader_flush_fix( NmeaReader*  r )
+{
+    long long  due = nmea_reader_fix_due( r );
+
+    if (due >= 0 && due <= now_ms())
+        nmea_reader_send_fix( r );
 }
 
 
+static void
+nmea_reader_set_mode( NmeaReader*  r, int  min_interval, int  single_shot )
+{
+    r->min_interval = min_interval;
+    r->single_shot  = single_shot;
+}
+
+
+/* the last fix isn't sent to a new callback: it belongs to the previous
+ * session, and would pass for this one's first fix */
 static void
 nmea_reader_set_callback( NmeaReader*  r, gps_location_callback  cb )
 {
-    r->callback = cb;
-    if (cb != NULL && r->fix.flags != 0) {
-        D("%s: sending latest fix to new callback", __FUNCTION__);
-        r->callback( &r->fix );
+    r->callback     = cb;
+    r->fix_pending  = 0;
+    r->fix_reported = 0;
+}
+
+
+static void
+nmea_reader_set_batch_callback( NmeaReader*  r, gps_location_callback  cb )
+{
+    r->batch_callback = cb;
+}
+
+
+static void
+nmea_reader_set_sv_callback( NmeaReader*  r, gps_sv_status_callback  cb )
+{
+    r->sv_callback = cb;
+    if (cb != NULL && r->sv_valid) {
+        D("%s: sending latest satellites to new callback", __FUNCTION__);
+        r->sv_callback( &r->sv_status );
+    }
+}
+
+
+#define  MS_PER_DAY  (24 * 3600 * 1000LL)
+
+/* days from 1970-01-01 to a date of the proleptic Gregorian calendar,
+ * see http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+ */
+static long
+days_from_civil( int  year, int  mon, int  day )
+{
+    int       era;
+    unsigned  yoe, doy, doe;
+
+    year -= (mon <= 2);
+    era   = (year >= 0 ? year : year - 399) / 400;
+    yoe   = (unsigned)(year - era * 400);
+    doy   = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe   = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097L + (long)doe - 719468;
+}
+
+
+static void
+nmea_reader_set_date( NmeaReader*  r, int  year, int  mon, int  day )
+{
+    if (year != r->utc_year || mon != r->utc_mon || day != r->utc_day) {
+        r->utc_year = year;
+        r->utc_mon  = mon;
+        r->utc_day  = day;
+        r->day_base = days_from_civil(year, mon, day) * MS_PER_DAY;
     }
+
+    // the date is known again, don't guess at midnight
+    r->time_of_day = -1;
 }
 
 
@@ -248,42 +401,41 @@ nmea_reader_update_time( NmeaReader*  r, Token  tok )
 {
     int        hour, minute;
     double     seconds;
-    struct tm  tm;
-    time_t     fix_time;
+    long long  time_of_day;
 
     if (tok.p + 6 > tok.end)
         return -1;
 
     if (r->utc_year < 0) {
         // no date yet, get current one
-        time_t  now = time(NULL);
+        time_t     now = time(NULL);
+        struct tm  tm;
+
         gmtime_r( &now, &tm );
-        r->utc_year = tm.tm_year + 1900;
-        r->utc_mon  = tm.tm_mon + 1;
-        r->utc_day  = tm.tm_mday;
+        nmea_reader_set_date( r, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday );
     }
 
     hour    = str2int(tok.p,   tok.p+2);
     minute  = str2int(tok.p+2, tok.p+4);
     seconds = str2float(tok.p+4, tok.end);
 
-    tm.tm_hour  = hour;
-    tm.tm_min   = minute;
-    tm.tm_sec   = (int) seconds;
-    tm.tm_year  = r->utc_year - 1900;
-    tm.tm_mon   = r->utc_mon - 1;
-    tm.tm_mday  = r->utc_day;
-    tm.tm_isdst = -1;
-
-    // This is a little confusing, let's use an example:
-    // Suppose now it's 1970-1-1 01:00 GMT, local time is 1970-1-1 00:00 GMT-1
-    // Then the utc_diff is 3600.
-    // The time string from GPS is 01:00:00, mktime assumes it's a local
-    // time. So we are doing mktime for 1970-1-1 01:00 GMT-1. The result of
-    // mktime is 7200 (1970-1-1 02:00 GMT) actually. To get the correct
-    // timestamp, we have to subtract utc_diff here.
-    fix_time = mktime( &tm ) - r->utc_diff;
-    r->fix.timestamp = (long long)fix_time * 1000;
+    // also rejects NaN, and values that would overflow below
+    if ((hour|minute) < 0 || hour > 23 || minute > 59 ||
+        !(seconds >= 0 && seconds < 61))
+        return -1;
+
+    time_of_day = (hour * 3600 + minute * 60) * 1000LL
+                + (long long)(seconds * 1000. + .5);
+
+    // only RMC carries the date. A fix from any other sentence that is
+    // much earlier in the day than the last one comes after midnight.
+    if (r->time_of_day >= 0 && time_of_day < r->time_of_day - MS_PER_DAY / 2) {
+        D("date rolled over at midnight");
+        r->day_base += MS_PER_DAY;
+    }
+
+    r->time_of_day   = time_of_day;
+    r->fix.timestamp = r->day_base + time_of_day;
     return 0;
 }
 
@@ -301,24 +453,28 @@ nmea_reader_update_date( NmeaReader*  r, Token  date, Token  time )
     mon  = str2int(tok.p+2, tok.p+4);
     year = str2int(tok.p+4, tok.p+6) + 2000;
 
-    if ((day|mon|year) < 0) {
+    if (day < 1 || day > 31 || mon < 1 || mon > 12 || year < 2000) {
         D("date not properly formatted: '%.*s'", tok.end-tok.p, tok.p);
         return -1;
     }
 
-    r->utc_year  = year;
-    r->utc_mon   = mon;
-    r->utc_day   = day;
+    nmea_reader_set_date( r, year, mon, day );
 
     return nmea_reader_update_time( r, time );
 }
 
 
+/* returns NaN if |tok| isn't a valid dddmm.mmmm coordinate */
 static double
 convert_from_hhmm( Token  tok )
 {
     double  val     = str2float(tok.p, tok.end);
-    int     degrees = (int)(floor(val) / 100);
+    int     degrees;
+
+    if (!(val >= 0 && val < 18100.))
+        return NAN;
+
+    degrees = (int)(floor(val) / 100);
     double  minutes = val - degrees*100.;
     double  dcoord  = degrees + minutes / 60.0;
     return dcoord;
@@ -343,6 +499,10 @@ nmea_reader_update_latlong( NmeaReader*  r,
         return -1;
     }
     lat = convert_from_hhmm(tok);
+    if (!(lat <= 90.)) {
+        D("invalid latitude: '%.*s'", tok.end-tok.p, tok.p);
+        return -1;
+    }
     if (latitudeHemi == 'S')
         lat = -lat;
 
@@ -352,6 +512,10 @@ nmea_reader_update_latlong( NmeaReader*  r,
         return -1;
     }
     lon = convert_from_hhmm(tok);
+    if (!(lon <= 180.)) {
+        D("invalid longitude: '%.*s'", tok.end-tok.p, tok.p);
+        return -1;
+    }
     if (longitudeHemi == 'W')
         lon = -lon;
 
@@ -424,8 +588,155 @@ nmea_reader_update_accuracy( NmeaReader*  r )
 }
 
 
+/* reports the satellites of an epoch once all of its GSV sets are complete */
 static void
-nmea_reader_parse( NmeaReader*  r )
+nmea_reader_flush_sv( NmeaReader*  r )
+{
+    GpsSvStatus*  sv = &r->sv_pending;
+
+    if (!r->gsv_complete || r->gsv_next != 0)
+        return;
+
+    sv->used_in_fix_mask = r->sv_used_mask;
+    memset( sv->sv_list + sv->num_svs, 0,
+            (GPS_MAX_SVS - sv->num_svs) * sizeof(sv->sv_list[0]) );
+
+    r->gsv_complete = 0;
+    r->sv_used_mask = 0;
+
+    if (r->sv_valid && !memcmp(sv, &r->sv_status, sizeof(*sv))) {
+        D("satellites unchanged");
+        return;
+    }
+
+    r->sv_status = *sv;
+    r->sv_valid  = 1;
+
+    if (r->sv_callback)
+        r->sv_callback( &r->sv_status );
+}
+
+
+/* GSV: <total msgs>,<msg number>,<total svs>,{<prn>,<elevation>,<azimuth>,<snr>}* */
+static void
+nmea_reader_update_gsv( NmeaReader*  r, NmeaTokenizer*  tzer )
+{
+    Token  tok_total  = nmea_tokenizer_get(tzer, 1);
+    Token  tok_number = nmea_tokenizer_get(tzer, 2);
+    int    total  = str2int(tok_total.p, tok_total.end);
+    int    number = str2int(tok_number.p, tok_number.end);
+    int    n;
+
+    if (total <= 0 || number <= 0 || number > total) {
+        D("GSV message %d of %d ignored", number, total);
+        return;
+    }
+
+    if (number == 1) {
+        // a talker starting over begins a new epoch
+        if (r->gsv_complete && !memcmp(tzer->tokens[0].p, r->gsv_talker, 2))
+            nmea_reader_flush_sv( r );
+        if (r->gsv_next == 0 && !r->gsv_complete) {
+            r->sv_pending.num_svs = 0;
+            memcpy( r->gsv_talker, tzer->tokens[0].p, 2 );
+        }
+    } else if (number != r->gsv_next) {
+        D("GSV message %d out of sequence, expected %d", number, r->gsv_next);
+        r->gsv_next = 0;
+        return;
+    }
+
+    for (n = 4; n < tzer->count; n += 4) {
+        Token       tok_prn = nmea_tokenizer_get(tzer, n);
+        Token       tok_elevation = nmea_tokenizer_get(tzer, n+1);
+        Token       tok_azimuth = nmea_tokenizer_get(tzer, n+2);
+        Token       tok_snr = nmea_tokenizer_get(tzer, n+3);
+        GpsSvInfo*  sv;
+        int         prn = str2int(tok_prn.p, tok_prn.end);
+
+        if (prn <= 0)
+            continue;
+        if (r->sv_pending.num_svs == GPS_MAX_SVS)
+            break;
+
+        sv = &r->sv_pending.sv_list[r->sv_pending.num_svs++];
+        sv->size      = sizeof(*sv);
+        sv->prn       = prn;
+        sv->elevation = str2float(tok_elevation.p, tok_elevation.end);
+        sv->azimuth   = str2float(tok_azimuth.p, tok_azimuth.end);
+        // an empty SNR means the satellite isn't tracked
+        sv->snr       = str2float(tok_snr.p, tok_snr.end);
+    }
+
+    if (number == total) {
+        r->gsv_next     = 0;
+        r->gsv_complete = 1;
+    } else {
+        r->gsv_next = number + 1;
+    }
+}
+
+
+/* GSA: <mode>,<fix type>,<prn used>*12,<pdop>,<hdop>,<vdop> */
+static void
+nmea_reader_update_gsa( NmeaReader*  r, NmeaTokenizer*  tzer )
+{
+    int  n;
+
+    // receivers tracking several constellations send one GSA for each
+    for (n = 3; n < 15; n++) {
+        Token  tok_prn = nmea_tokenizer_get(tzer, n);
+        int    prn = str2int(tok_prn.p, tok_prn.end);
+
+        if (prn >= 1 && prn <= 32)
+            r->sv_used_mask |= 1u << (prn - 1);
+    }
+}
+
+
+static int
+hex2int( char  c )
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+
+/* returns 1 if the sentence in [p,end) has a valid checksum or none at all */
+static int
+nmea_checksum_ok( const char*  p, const char*  end )
+{
+    int  sum = 0;
+    int  hi, lo;
+
+    while (end > p && (end[-1] == '\n' || end[-1] == '\r'))
+        end -= 1;
+
+    if (end - p < 4 || end[-3] != '*')
+        return 1;
+
+    hi = hex2int(end[-2]);
+    lo = hex2int(end[-1]);
+    if ((hi|lo) < 0)
+        return 0;
+
+    if (p[0] == '$')
+        p += 1;
+
+    for (end -= 3; p < end; p++)
+        sum ^= (unsigned char) *p;
+
+    return sum == (hi << 4 | lo);
+}
+
+
+static void
+nmea_reader_parse( NmeaReader*  r, const char*  p, const char*  end )
 {
    /* we received a complete sentence, now parse it to generate
     * a new GPS fix...
@@ -433,13 +744,19 @@ nmea_reader_parse( NmeaReader*  r )
     NmeaTokenizer  tzer[1];
     Token          tok;
 
-    D("Received: '%.*s'", r->pos, r->in);
-    if (r->pos < 9) {
+    D("Received: '%.*s'", (int)(end-p), p);
+    if (end - p < 9) {
         D("Too short. discarded.");
         return;
     }
 
-    nmea_tokenizer_init(tzer, r->in, r->in + r->pos);
+    if (!nmea_checksum_ok(p, end)) {
+        D("Bad checksum. discarded.");
+        r->bad_checksums += 1;
+        return;
+    }
+
+    nmea_tokenizer_init(tzer, p, end);
 #if GPS_DEBUG
     {
         int  n;
@@ -459,6 +776,11 @@ nmea_reader_parse( NmeaReader*  r )
 
     // ignore first two characters.
     tok.p += 2;
+    if ( !memcmp(tok.p, "GGA", 3) || !memcmp(tok.p, "RMC", 3) ) {
+        // satellites come before or after the fix, never in between
+        nmea_reader_flush_sv( r );
+    }
+
     if ( !memcmp(tok.p, "GGA", 3) ) {
         // GPS fix
         Token  tok_time          = nmea_tokenizer_get(tzer,1);
@@ -477,7 +799,11 @@ nmea_reader_parse( NmeaReader*  r )
         nmea_reader_update_altitude(r, tok_altitude, tok_altitudeUnits);
 
     } else if ( !memcmp(tok.p, "GSA", 3) ) {
-        // do something ?
+        nmea_reader_update_gsa( r, tzer );
+        return;
+    } else if ( !memcmp(tok.p, "GSV", 3) ) {
+        nmea_reader_update_gsv( r, tzer );
+        return;
     } else if ( !memcmp(tok.p, "RMC", 3) ) {
         Token  tok_time          = nmea_tokenizer_get(tzer,1);
         Token  tok_fixStatus     = nmea_tokenizer_get(tzer,2);
@@ -537,36 +863,249 @@ nmea_reader_parse( NmeaReader*  r )
         p += snprintf(p, end-p, " time=%s", asctime( &utc ) );
         D(temp);
 #endif
-        if (r->callback) {
-            r->callback( &r->fix );
+        nmea_reader_report_fix( r );
+    }
+}
+
+
+/* parses every complete sentence between head and tail */
+static void
+nmea_reader_parse_buffer( NmeaReader*  r )
+{
+    const char*  p   = r->buf + r->head;
+    const char*  end = r->buf + r->tail;
+
+    for (;;) {
+        const char*  eol = memchr(p, '\n', end - p);
+
+        if (eol == NULL)
+            break;
+        eol += 1;
+
+        if (r->overflow) {
+            // the end of a sentence that was too long
+            r->overflow = 0;
+        } else if (eol - p > NMEA_MAX_SIZE) {
+            D("Too long. discarded.");
+        } else {
+            nmea_reader_parse( r, p, eol );
         }
-        else {
-            D("no callback, keeping data until needed !");
+        p = eol;
+    }
+
+    r->head = p - r->buf;
+
+    if (r->tail - r->head >= NMEA_MAX_SIZE) {
+        // no sentence is this long, skip to the next newline
+        r->overflow = 1;
+        r->head     = r->tail;
+    }
+
+    if (r->head == r->tail) {
+        r->head = 0;
+        r->tail = 0;
+    }
+}
+
+
+/* drains the non-blocking |fd|, parsing sentences as they complete.
+ * returns the number of bytes read before the fd would block or
+ * reached end of file, or -1 on error.
+ */
+static int
+nmea_reader_read( NmeaReader*  r, int  fd )
+{
+    int  total = 0;
+
+    for (;;) {
+        int  ret;
+
+        if (r->head > 0) {
+            // only a partial sentence is left, move it to the front
+            memmove( r->buf, r->buf + r->head, r->tail - r->head );
+            r->tail -= r->head;
+            r->head  = 0;
         }
+
+        ret = read( fd, r->buf + r->tail, sizeof(r->buf) - r->tail );
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+                return total;
+            return -1;
+        }
+        if (ret == 0)
+            return total;
+
+        D("received %d bytes: %.*s", ret, ret, r->buf + r->tail);
+        r->tail += ret;
+        total   += ret;
+        nmea_reader_parse_buffer( r );
+    }
+}
+
+
+/* drains the non-blocking |fd| without parsing anything, along with the
+ * partial sentence left in the buffer. The end of a sentence cut by the
+ * last read is skipped like one that was too long. returns the number
+ * of bytes dropped, or -1 on error.
+ */
+static int
+nmea_reader_discard( NmeaReader*  r, int  fd )
+{
+    int  total = 0;
+    int  cut   = r->overflow || r->tail > r->head;
+    int  ret;
+
+    for (;;) {
+        ret = read( fd, r->buf, sizeof(r->buf) );
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        total += ret;
+        cut    = (r->buf[ret - 1] != '\n');
+    }
+
+    r->head     = 0;
+    r->tail     = 0;
+    r->overflow = cut;
+
+    if (ret < 0 && errno != EWOULDBLOCK && errno != EAGAIN)
+        return -1;
+    return total;
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       B A T C H I N G                                 *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+#define  GPS_BATCH_SIZE          256
+#define  GPS_BATCH_MAX_SESSIONS  4
+
+/* fixes are kept in a ring of GPS_BATCH_SIZE locations while at least
+ * one batching session is active, at the shortest period the sessions
+ * asked for. They are delivered together on flush, or when the ring is
+ * full if a session asked to be woken up for it; otherwise the oldest
+ * ones are dropped. Only used on the gps thread.
+ */
+typedef struct {
+    FlpLocation   locations[ GPS_BATCH_SIZE ];
+    int           first;
+    int           count;
+    int           active;       /* a session is batching */
+    uint32_t      flags;        /* FLP_BATCH_* of all sessions */
+    long long     period;       /* ms between batched fixes */
+    long long     last_added;   /* CLOCK_MONOTONIC ms of the newest fix */
+    FlpCallbacks  callbacks;
+} GpsBatch;
+
+typedef struct {
+    int              id;
+    int              used;
+    FlpBatchOptions  options;
+} GpsBatchSession;
+
+
+/* sends the newest |count| locations, oldest first */
+static void
+gps_batch_deliver( GpsBatch*  b, int  count )
+{
+    FlpLocation*  locations[ GPS_BATCH_SIZE ];
+    int           n;
+
+    if (!b->callbacks.location_cb)
+        return;
+
+    if (count > b->count)
+        count = b->count;
+
+    for (n = 0; n < count; n++) {
+        int  index = (b->first + b->count - count + n) % GPS_BATCH_SIZE;
+        locations[n] = &b->locations[index];
     }
+
+    D("%s: delivering %d of %d locations", __FUNCTION__, count, b->count);
+    if (b->callbacks.acquire_wakelock_cb)
+        b->callbacks.acquire_wakelock_cb();
+    b->callbacks.location_cb( count, locations );
+    if (b->callbacks.release_wakelock_cb)
+        b->callbacks.release_wakelock_cb();
+}
+
+
+static void
+gps_batch_flush( GpsBatch*  b )
+{
+    gps_batch_deliver( b, b->count );
+    b->first = 0;
+    b->count = 0;
 }
 
 
 static void
-nmea_reader_addc( NmeaReader*  r, int  c )
+gps_batch_add( GpsBatch*  b, const GpsLocation*  fix )
 {
-    if (r->overflow) {
-        r->overflow = (c != '\n');
+    FlpLocation*  location;
+    long long     now   = now_ms();
+    int           added = 0;
+
+    if (!b->active)
         return;
+
+    if (b->count > 0) {
+        location = &b->locations[ (b->first + b->count - 1) % GPS_BATCH_SIZE ];
+        if (location->timestamp == fix->timestamp) {
+            // another sentence of the same fix, complete it in place
+            goto Update;
+        }
     }
 
-    if (r->pos >= (int) sizeof(r->in)-1 ) {
-        r->overflow = 1;
-        r->pos      = 0;
+    if (now - b->last_added < b->period - fix_interval_slack( b->period ))
         return;
+
+    if (b->count == GPS_BATCH_SIZE) {
+        // only happens when nobody wants to be woken up for it
+        b->first  = (b->first + 1) % GPS_BATCH_SIZE;
+        b->count -= 1;
     }
 
-    r->in[r->pos] = (char)c;
-    r->pos       += 1;
+    location = &b->locations[ (b->first + b->count) % GPS_BATCH_SIZE ];
+    b->count     += 1;
+    b->last_added = now;
+    added         = 1;
+
+Update:
+    location->size         = sizeof(*location);
+    location->flags        = fix->flags & (FLP_LOCATION_HAS_LAT_LONG |
+                                           FLP_LOCATION_HAS_ALTITUDE |
+                                           FLP_LOCATION_HAS_SPEED    |
+                                           FLP_LOCATION_HAS_BEARING  |
+                                           FLP_LOCATION_HAS_ACCURACY);
+    location->latitude     = fix->latitude;
+    location->longitude    = fix->longitude;
+    location->altitude     = fix->altitude;
+    location->speed        = fix->speed;
+    location->bearing      = fix->bearing;
+    location->accuracy     = fix->accuracy;
+    location->timestamp    = fix->timestamp;
+    location->sources_used = FLP_TECH_MASK_GNSS;
+
+    if (!added)
+        return;
+
+    if (b->flags & FLP_BATCH_CALLBACK_ON_LOCATION_FIX) {
+        gps_batch_deliver( b, 1 );
+    }
 
-    if (c == '\n') {
-        nmea_reader_parse( r );
-        r->pos = 0;
+    if (b->count == GPS_BATCH_SIZE && (b->flags & FLP_BATCH_WAKEUP_ON_FIFO_FULL)) {
+        gps_batch_flush( b );
     }
 }
 
@@ -583,10 +1122,56 @@ nmea_reader_addc( NmeaReader*  r, int  c )
 enum {
     CMD_QUIT  = 0,
     CMD_START = 1,
-    CMD_STOP  = 2
+    CMD_STOP  = 2,
+    CMD_MODE  = 3,
+    CMD_BATCH = 4
 };
 
 
+/* what a real receiver would know when a session starts, and so how
+ * long its first fix would take. Ephemeris comes from real fixes and
+ * expires; time and position can also be injected by the framework.
+ */
+enum {
+    AIDING_TIME      = 1 << 0,
+    AIDING_POSITION  = 1 << 1,
+    AIDING_ALMANAC   = 1 << 2,
+    AIDING_EPHEMERIS = 1 << 3
+};
+
+typedef enum {
+    START_HOT  = 0,
+    START_WARM = 1,
+    START_COLD = 2,
+    START_MODES
+} GpsStartMode;
+
+#define  EPHEMERIS_VALID_MS  (4 * 3600 * 1000LL)
+#define  INJECTED_LOCATION_VALID_MS  (10 * 60 * 1000LL)
+
+typedef struct {
+    int          aiding;           /* AIDING_* */
+    long long    ephemeris_time;   /* CLOCK_MONOTONIC ms of the last real fix */
+    GpsUtcTime   injected_time;
+    long long    injected_time_reference;  /* elapsedRealtime ms of |injected_time| */
+    GpsLocation  injected_location;        /* flags are 0 if none */
+    long long    injected_location_time;   /* CLOCK_MONOTONIC ms of |injected_location| */
+} GpsReceiver;
+
+typedef struct {
+    int        count;
+    long long  total;
+    long long  min;
+    long long  max;
+} GpsTtffStats;
+
+typedef struct {
+    GpsStartMode  start_mode;
+    long long     start;            /* CLOCK_MONOTONIC ms */
+    int           first_fix_pending;
+    GpsTtffStats  ttff[ START_MODES ];
+} GpsSession;
+
 /* this is the state of our connection to the qemu_gpsd daemon */
 typedef struct {
     int                     init;
@@ -594,9 +1179,21 @@ typedef struct {
     GpsCallbacks            callbacks;
     pthread_t               thread;
     int                     control[2];
+    pthread_mutex_t         lock;
+    uint32_t                min_interval;   /* protected by |lock| */
+    GpsPositionRecurrence   recurrence;     /* protected by |lock| */
+    FlpCallbacks            flp_callbacks;  /* protected by |lock| */
+    GpsBatchSession         batch_sessions[ GPS_BATCH_MAX_SESSIONS ]; /* protected by |lock| */
+    int                     batch_flush;    /* protected by |lock| */
+    int                     batch_last_n;   /* protected by |lock|, 0 if not asked */
+    GpsBatch                batch;          /* only used on the gps thread */
+    GpsReceiver             receiver;       /* protected by |lock| */
+    GpsSession              session;        /* only used on the gps thread */
 } GpsState;
 
-static GpsState  _gps_state[1];
+static GpsState  _gps_state[1] = {
+    { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
 
 
 static void
@@ -648,6 +1245,222 @@ gps_state_stop( GpsState*  s )
 }
 
 
+static void
+gps_state_set_mode( GpsState*  s, GpsPositionRecurrence  recurrence,
+                    uint32_t  min_interval )
+{
+    char  cmd = CMD_MODE;
+    int   ret;
+
+    pthread_mutex_lock( &s->lock );
+    s->recurrence   = recurrence;
+    s->min_interval = min_interval;
+    pthread_mutex_unlock( &s->lock );
+
+    do { ret=write( s->control[0], &cmd, 1 ); }
+    while (ret < 0 && errno == EINTR);
+
+    if (ret != 1)
+        D("%s: could not send CMD_MODE command: ret=%d: %s",
+          __FUNCTION__, ret, strerror(errno));
+}
+
+
+/* called on the gps thread when the mode changes */
+static void
+gps_state_update_mode( GpsState*  s, NmeaReader*  reader )
+{
+    pthread_mutex_lock( &s->lock );
+    nmea_reader_set_mode( reader,
+                          s->min_interval > INT_MAX ? INT_MAX : (int) s->min_interval,
+                          s->recurrence == GPS_POSITION_RECURRENCE_SINGLE );
+    pthread_mutex_unlock( &s->lock );
+}
+
+
+static void
+gps_state_batch_changed( GpsState*  s )
+{
+    char  cmd = CMD_BATCH;
+    int   ret;
+
+    do { ret=write( s->control[0], &cmd, 1 ); }
+    while (ret < 0 && errno == EINTR);
+
+    if (ret != 1)
+        D("%s: could not send CMD_BATCH command: ret=%d: %s",
+          __FUNCTION__, ret, strerror(errno));
+}
+
+
+static void
+gps_state_batch_fix( GpsLocation*  fix )
+{
+    gps_batch_add( &_gps_state->batch, fix );
+}
+
+
+/* called on the gps thread when batching sessions or requests change */
+static void
+gps_state_update_batch( GpsState*  s, NmeaReader*  reader )
+{
+    GpsBatch*  b = &s->batch;
+    int        flush, last_n, n;
+
+    pthread_mutex_lock( &s->lock );
+    b->callbacks = s->flp_callbacks;
+    b->active    = 0;
+    b->flags     = 0;
+    b->period    = LLONG_MAX;
+    for (n = 0; n < GPS_BATCH_MAX_SESSIONS; n++) {
+        const GpsBatchSession*  session = &s->batch_sessions[n];
+        long long  period;
+
+        if (!session->used)
+            continue;
+
+        period = session->options.period_ns / 1000000;
+        if (period < b->period)
+            b->period = period;
+        b->flags |= session->options.flags;
+        b->active = 1;
+    }
+    flush  = s->batch_flush;
+    last_n = s->batch_last_n;
+    s->batch_flush  = 0;
+    s->batch_last_n = 0;
+    pthread_mutex_unlock( &s->lock );
+
+    D("%s: active=%d flags=%x period=%lld", __FUNCTION__,
+      b->active, b->flags, b->active ? b->period : 0);
+
+    if (!b->callbacks.location_cb) {
+        // cleaned up, nobody wants these
+        b->first = 0;
+        b->count = 0;
+    }
+    if (last_n > 0)
+        gps_batch_deliver( b, last_n );
+    if (flush)
+        gps_batch_flush( b );
+
+    nmea_reader_set_batch_callback( reader, b->active ? gps_state_batch_fix : NULL );
+}
+
+
+static long long
+elapsed_realtime_ms( void )
+{
+    struct timespec  ts;
+
+    clock_gettime( CLOCK_BOOTTIME, &ts );
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+static const char*
+start_mode_name( GpsStartMode  mode )
+{
+    switch (mode) {
+        case START_HOT:  return "hot";
+        case START_WARM: return "warm";
+        default:         return "cold";
+    }
+}
+
+
+/* the reader's location callback while started */
+static void
+gps_state_location( GpsLocation*  fix )
+{
+    GpsState*    s       = _gps_state;
+    GpsSession*  session = &s->session;
+    long long    now     = now_ms();
+
+    if (session->first_fix_pending) {
+        GpsTtffStats*  stats = &session->ttff[ session->start_mode ];
+        long long      ttff  = now - session->start;
+
+        session->first_fix_pending = 0;
+        if (stats->count == 0 || ttff < stats->min)
+            stats->min = ttff;
+        if (ttff > stats->max)
+            stats->max = ttff;
+        stats->count += 1;
+        stats->total += ttff;
+        ALOGI("TTFF %lld ms, %s start (%d %s starts: min %lld, mean %lld, max %lld ms)",
+              ttff, start_mode_name( session->start_mode ),
+              stats->count, start_mode_name( session->start_mode ),
+              stats->min, stats->total / stats->count, stats->max);
+    }
+
+    pthread_mutex_lock( &s->lock );
+    s->receiver.aiding |= AIDING_TIME | AIDING_POSITION | AIDING_ALMANAC | AIDING_EPHEMERIS;
+    s->receiver.ephemeris_time = now;
+    pthread_mutex_unlock( &s->lock );
+
+    if (s->callbacks.location_cb)
+        s->callbacks.location_cb( fix );
+}
+
+
+/* called on the gps thread when a session starts. Forgets the last fix
+ * if its position was deleted, and returns an immediate coarse fix from
+ * the injected location in |coarse| if there is a recent one. A hot start
+ * has its first fix soon enough without it, and a single-shot session
+ * would take it for its only fix.
+ */
+static int
+gps_state_begin_session( GpsState*  s, NmeaReader*  reader, GpsLocation*  coarse )
+{
+    GpsReceiver*  receiver = &s->receiver;
+    GpsSession*   session  = &s->session;
+    long long     now      = now_ms();
+    int           has_coarse = 0;
+
+    pthread_mutex_lock( &s->lock );
+    if ((receiver->aiding & AIDING_EPHEMERIS) &&
+        now - receiver->ephemeris_time > EPHEMERIS_VALID_MS) {
+        receiver->aiding &= ~AIDING_EPHEMERIS;
+    }
+
+    if ((receiver->aiding & (AIDING_TIME | AIDING_POSITION | AIDING_EPHEMERIS)) ==
+            (AIDING_TIME | AIDING_POSITION | AIDING_EPHEMERIS)) {
+        session->start_mode = START_HOT;
+    } else if ((receiver->aiding & (AIDING_TIME | AIDING_POSITION)) ==
+            (AIDING_TIME | AIDING_POSITION)) {
+        session->start_mode = START_WARM;
+    } else {
+        session->start_mode = START_COLD;
+    }
+
+    if (!(receiver->aiding & AIDING_POSITION))
+        reader->fix.flags = 0;
+
+    if (receiver->injected_location.flags != 0 &&
+        now - receiver->injected_location_time <= INJECTED_LOCATION_VALID_MS &&
+        session->start_mode != START_HOT && !reader->single_shot) {
+        *coarse = receiver->injected_location;
+        if (receiver->injected_time != 0) {
+            coarse->timestamp = receiver->injected_time +
+                    (elapsed_realtime_ms() - receiver->injected_time_reference);
+        } else {
+            struct timespec  ts;
+            clock_gettime( CLOCK_REALTIME, &ts );
+            coarse->timestamp = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+        }
+        has_coarse = 1;
+    }
+    pthread_mutex_unlock( &s->lock );
+
+    D("%s: %s start, aiding=%x", __FUNCTION__,
+      start_mode_name( session->start_mode ), receiver->aiding);
+    session->start = now;
+    session->first_fix_pending = 1;
+    return has_coarse;
+}
+
+
 static int
 epoll_register( int  epoll_fd, int  fd )
 {
@@ -667,15 +1480,69 @@ epoll_register( int  epoll_fd, int  fd )
 }
 
 
-// static int
-// epoll_deregister( int  epoll_fd, int  fd )
-// {
-//     int  ret;
-//     do {
-//         ret = epoll_ctl( epoll_fd, EPOLL_CTL_DEL, fd, NULL );
-//     } while (ret < 0 && errno == EINTR);
-//     return ret;
-// }
+static int
+epoll_deregister( int  epoll_fd, int  fd )
+{
+    int  ret;
+    do {
+        ret = epoll_ctl( epoll_fd, EPOLL_CTL_DEL, fd, NULL );
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+
+/* the daemon's fd is only polled while a session or batching needs
+ * fixes, so an idle thread never wakes up. Whatever the daemon sent in
+ * the meantime waits in the pipe, and is dropped when polling resumes:
+ * its fixes are stale, and a new session doesn't report an old fix.
+ */
+static void
+gps_state_watch( GpsState*  s, NmeaReader*  reader, int  epoll_fd,
+                 int*  watching, int  wanted )
+{
+    if (wanted == *watching)
+        return;
+
+    if (wanted) {
+        if (epoll_register( epoll_fd, s->fd ) < 0) {
+            ALOGE("could not poll gps daemon socket: %s", strerror(errno));
+            return;
+        }
+        int  dropped = nmea_reader_discard( reader, s->fd );
+        if (dropped < 0)
+            ALOGE("error while reading from gps daemon socket: %s:", strerror(errno));
+        else if (dropped > 0)
+            D("%s: dropped %d bytes sent while idle", __FUNCTION__, dropped);
+    } else {
+        epoll_deregister( epoll_fd, s->fd );
+    }
+    D("%s: %s gps daemon socket", __FUNCTION__, wanted ? "polling" : "ignoring");
+    *watching = wanted;
+}
+
+
+/* arms |timer_fd| for when a held fix is due, only when that changes */
+static void
+gps_state_arm_timer( int  timer_fd, long long*  armed, long long  due )
+{
+    struct itimerspec  its;
+
+    if (due == *armed)
+        return;
+
+    memset( &its, 0, sizeof(its) );
+    if (due >= 0) {
+        its.it_value.tv_sec  = due / 1000;
+        its.it_value.tv_nsec = (due % 1000) * 1000000;
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+            its.it_value.tv_nsec = 1;   // all zeroes would disarm it
+    }
+    if (timerfd_settime( timer_fd, TFD_TIMER_ABSTIME, &its, NULL ) < 0) {
+        ALOGE("could not arm fix timer: %s", strerror(errno));
+        return;
+    }
+    *armed = due;
+}
 
 /* this is the main thread, it waits for commands from gps_state_start/stop and,
  * when started, messages from the QEMU GPS daemon. these are simple NMEA sentences
@@ -686,12 +1553,16 @@ gps_state_thread( void*  arg )
 {
     GpsState*   state = (GpsState*) arg;
     NmeaReader  reader[1];
-    int         epoll_fd   = epoll_create(2);
+    int         epoll_fd   = epoll_create(3);
     int         started    = 0;
+    int         watching   = 0;
     int         gps_fd     = state->fd;
     int         control_fd = state->control[1];
+    int         timer_fd   = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    long long   timer_due  = -1;
     GpsStatus gps_status;
     gps_status.size = sizeof(gps_status);
+    // reported once per session when the host sends no GSV sentences
     GpsSvStatus  gps_sv_status;
     memset(&gps_sv_status, 0, sizeof(gps_sv_status));
     gps_sv_status.size = sizeof(gps_sv_status);
@@ -703,27 +1574,24 @@ gps_state_thread( void*  arg )
     gps_sv_status.sv_list[0].azimuth = 30.0;
 
     nmea_reader_init( reader );
+    gps_state_update_mode( state, reader );
 
-    // register control file descriptors for polling
+    // register control file descriptors for polling, the gps fd is
+    // only added once something needs fixes
     epoll_register( epoll_fd, control_fd );
-    epoll_register( epoll_fd, gps_fd );
+    epoll_register( epoll_fd, timer_fd );
 
     D("gps thread running");
 
     // now loop
     for (;;) {
-        struct epoll_event   events[2];
+        struct epoll_event   events[3];
         int                  ne, nevents;
 
-        int timeout = -1;
-        if (gps_status.status == GPS_STATUS_SESSION_BEGIN) {
-            timeout = 10 * 1000; // 10 seconds
-        }
-        nevents = epoll_wait( epoll_fd, events, 2, timeout );
-        if (state->callbacks.sv_status_cb) {
-            state->callbacks.sv_status_cb(&gps_sv_status);
-        }
-        // update satilite info
+        // the timer only fires to send a fix held back by the fix interval
+        gps_state_arm_timer( timer_fd, &timer_due, nmea_reader_fix_due( reader ) );
+
+        nevents = epoll_wait( epoll_fd, events, 3, -1 );
         if (nevents < 0) {
             if (errno != EINTR)
                 ALOGE("epoll_wait() unexpected error: %s", strerror(errno));
@@ -742,6 +1610,8 @@ gps_state_thread( void*  arg )
                 {
                     char  cmd = 0xFF;
                     int   ret;
+                    int          has_coarse;
+                    GpsLocation  coarse;
                     D("gps control fd event");
                     do {
                         ret = read( fd, &cmd, 1 );
@@ -755,46 +1625,61 @@ gps_state_thread( void*  arg )
                         if (!started) {
                             D("gps thread starting  location_cb=%p", state->callbacks.location_cb);
                             started = 1;
-                            nmea_reader_set_callback( reader, state->callbacks.location_cb );
+                            has_coarse = gps_state_begin_session( state, reader, &coarse );
+                            gps_state_watch( state, reader, epoll_fd, &watching, 1 );
+                            nmea_reader_set_callback( reader, gps_state_location );
                             gps_status.status = GPS_STATUS_SESSION_BEGIN;
                             if (state->callbacks.status_cb) {
                                 state->callbacks.status_cb(&gps_status);
                             }
+                            if (has_coarse && state->callbacks.location_cb) {
+                                // until the first fix, report where we were told we are
+                                state->callbacks.location_cb(&coarse);
+                            }
+                            nmea_reader_set_sv_callback( reader, state->callbacks.sv_status_cb );
+                            if (!reader->sv_valid && state->callbacks.sv_status_cb) {
+                                state->callbacks.sv_status_cb(&gps_sv_status);
+                            }
                         }
                     }
+                    else if (cmd == CMD_MODE) {
+                        gps_state_update_mode( state, reader );
+                    }
+                    else if (cmd == CMD_BATCH) {
+                        gps_state_update_batch( state, reader );
+                        gps_state_watch( state, reader, epoll_fd, &watching,
+                                         started || state->batch.active );
+                    }
                     else if (cmd == CMD_STOP) {
                         if (started) {
                             D("gps thread stopping");
                             started = 0;
                             nmea_reader_set_callback( reader, NULL );
+                            nmea_reader_set_sv_callback( reader, NULL );
                             gps_status.status = GPS_STATUS_SESSION_END;
                             if (state->callbacks.status_cb) {
                                 state->callbacks.status_cb(&gps_status);
                             }
+                            gps_state_watch( state, reader, epoll_fd, &watching,
+                                             state->batch.active );
                         }
                     }
                 }
                 else if (fd == gps_fd)
                 {
-                    char  buff[32];
                     D("gps fd event");
-                    for (;;) {
-                        int  nn, ret;
-
-                        ret = read( fd, buff, sizeof(buff) );
-                        if (ret < 0) {
-                            if (errno == EINTR)
-                                continue;
-                            if (errno != EWOULDBLOCK)
-                                ALOGE("error while reading from gps daemon socket: %s:", strerror(errno));
-                            break;
-                        }
-                        D("received %d bytes: %.*s", ret, ret, buff);
-                        for (nn = 0; nn < ret; nn++)
-                            nmea_reader_addc( reader, buff[nn] );
-                    }
+                    if (nmea_reader_read( reader, fd ) < 0)
+                        ALOGE("error while reading from gps daemon socket: %s:", strerror(errno));
                     D("gps fd event end");
                 }
+                else if (fd == timer_fd)
+                {
+                    uint64_t  expirations;
+
+                    read( fd, &expirations, sizeof(expirations) );
+                    timer_due = -1;
+                    nmea_reader_flush_fix( reader );
+                }
                 else
                 {
                     ALOGE("epoll_wait() returned unkown fd %d ?", fd);
@@ -920,36 +1805,288 @@ qemu_gps_stop()
 
 
 static int
-qemu_gps_inject_time(GpsUtcTime __unused time,
-                     int64_t __unused timeReference,
-                     int __unused uncertainty)
+qemu_gps_inject_time(GpsUtcTime time,
+                     int64_t timeReference,
+                     int uncertainty)
 {
+    GpsState*  s = _gps_state;
+
+    D("%s: time=%lld reference=%lld uncertainty=%d", __FUNCTION__,
+      (long long) time, (long long) timeReference, uncertainty);
+
+    pthread_mutex_lock(&s->lock);
+    s->receiver.injected_time           = time;
+    s->receiver.injected_time_reference = timeReference;
+    s->receiver.aiding |= AIDING_TIME;
+    pthread_mutex_unlock(&s->lock);
     return 0;
 }
 
 static int
-qemu_gps_inject_location(double __unused latitude,
-                         double __unused longitude,
-                         float __unused accuracy)
+qemu_gps_inject_location(double latitude,
+                         double longitude,
+                         float accuracy)
 {
+    GpsState*     s = _gps_state;
+    GpsLocation*  location = &s->receiver.injected_location;
+
+    D("%s: lat=%g lon=%g accuracy=%g", __FUNCTION__, latitude, longitude, accuracy);
+
+    pthread_mutex_lock(&s->lock);
+    memset(location, 0, sizeof(*location));
+    location->size      = sizeof(*location);
+    location->flags     = GPS_LOCATION_HAS_LAT_LONG | GPS_LOCATION_HAS_ACCURACY;
+    location->latitude  = latitude;
+    location->longitude = longitude;
+    location->accuracy  = accuracy;
+    s->receiver.injected_location_time = now_ms();
+    s->receiver.aiding |= AIDING_POSITION;
+    pthread_mutex_unlock(&s->lock);
     return 0;
 }
 
 static void
-qemu_gps_delete_aiding_data(GpsAidingData __unused flags)
+qemu_gps_delete_aiding_data(GpsAidingData flags)
 {
+    GpsState*     s = _gps_state;
+    GpsReceiver*  receiver = &s->receiver;
+
+    D("%s: flags=%x", __FUNCTION__, flags);
+
+    pthread_mutex_lock(&s->lock);
+    if (flags & GPS_DELETE_EPHEMERIS)
+        receiver->aiding &= ~AIDING_EPHEMERIS;
+    if (flags & GPS_DELETE_ALMANAC)
+        receiver->aiding &= ~AIDING_ALMANAC;
+    if (flags & GPS_DELETE_POSITION) {
+        receiver->aiding &= ~AIDING_POSITION;
+        receiver->injected_location.flags = 0;
+    }
+    if (flags & GPS_DELETE_TIME) {
+        receiver->aiding &= ~AIDING_TIME;
+        receiver->injected_time = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
 }
 
 static int qemu_gps_set_position_mode(GpsPositionMode __unused mode,
-                                      GpsPositionRecurrence __unused recurrence,
-                                      uint32_t __unused min_interval,
+                                      GpsPositionRecurrence recurrence,
+                                      uint32_t min_interval,
                                       uint32_t __unused preferred_accuracy,
                                       uint32_t __unused preferred_time)
 {
-    // FIXME - support fix_frequency
+    GpsState*  s = _gps_state;
+
+    if (!s->init) {
+        D("%s: called with uninitialized state !!", __FUNCTION__);
+        return -1;
+    }
+
+    D("%s: recurrence=%d min_interval=%u", __FUNCTION__, recurrence, min_interval);
+    gps_state_set_mode(s, recurrence, min_interval);
     return 0;
 }
 
+/* fix batching, for the flp module in flp_qemu.c */
+
+static GpsBatchSession*
+qemu_flp_find_session(GpsState*  s, int  id)
+{
+    int  n;
+
+    for (n = 0; n < GPS_BATCH_MAX_SESSIONS; n++) {
+        if (s->batch_sessions[n].used && s->batch_sessions[n].id == id)
+            return &s->batch_sessions[n];
+    }
+    return NULL;
+}
+
+static int
+qemu_flp_init(FlpCallbacks* callbacks)
+{
+    GpsState*  s = _gps_state;
+
+    // fixes come from the gps thread, which qemu_gps_init() creates
+    if (!s->init || s->fd < 0) {
+        D("%s: called with uninitialized state !!", __FUNCTION__);
+        return FLP_RESULT_ERROR;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    memset(&s->flp_callbacks, 0, sizeof(s->flp_callbacks));
+    memcpy(&s->flp_callbacks, callbacks,
+           callbacks->size < sizeof(s->flp_callbacks) ? callbacks->size
+                                                      : sizeof(s->flp_callbacks));
+    pthread_mutex_unlock(&s->lock);
+
+    if (callbacks->flp_capabilities_cb)
+        callbacks->flp_capabilities_cb(CAPABILITY_GNSS);
+
+    gps_state_batch_changed(s);
+    return FLP_RESULT_SUCCESS;
+}
+
+static int
+qemu_flp_get_batch_size()
+{
+    return GPS_BATCH_SIZE;
+}
+
+static int
+qemu_flp_start_batching(int id, FlpBatchOptions* options)
+{
+    GpsState*         s = _gps_state;
+    GpsBatchSession*  session = NULL;
+    int               n;
+
+    if (!s->init || options == NULL)
+        return FLP_RESULT_ERROR;
+
+    pthread_mutex_lock(&s->lock);
+    if (qemu_flp_find_session(s, id) != NULL) {
+        pthread_mutex_unlock(&s->lock);
+        return FLP_RESULT_ID_EXISTS;
+    }
+    for (n = 0; n < GPS_BATCH_MAX_SESSIONS; n++) {
+        if (!s->batch_sessions[n].used) {
+            session = &s->batch_sessions[n];
+            break;
+        }
+    }
+    if (session == NULL) {
+        pthread_mutex_unlock(&s->lock);
+        return FLP_RESULT_INSUFFICIENT_MEMORY;
+    }
+    session->used    = 1;
+    session->id      = id;
+    session->options = *options;
+    pthread_mutex_unlock(&s->lock);
+
+    D("%s: id=%d period_ns=%lld flags=%x", __FUNCTION__, id,
+      (long long) options->period_ns, options->flags);
+    gps_state_batch_changed(s);
+    return FLP_RESULT_SUCCESS;
+}
+
+static int
+qemu_flp_update_batching_options(int id, FlpBatchOptions* new_options)
+{
+    GpsState*         s = _gps_state;
+    GpsBatchSession*  session;
+
+    if (!s->init || new_options == NULL)
+        return FLP_RESULT_ERROR;
+
+    pthread_mutex_lock(&s->lock);
+    session = qemu_flp_find_session(s, id);
+    if (session != NULL)
+        session->options = *new_options;
+    pthread_mutex_unlock(&s->lock);
+
+    if (session == NULL)
+        return FLP_RESULT_ID_UNKNOWN;
+
+    gps_state_batch_changed(s);
+    return FLP_RESULT_SUCCESS;
+}
+
+static int
+qemu_flp_stop_batching(int id)
+{
+    GpsState*         s = _gps_state;
+    GpsBatchSession*  session;
+
+    if (!s->init)
+        return FLP_RESULT_ERROR;
+
+    pthread_mutex_lock(&s->lock);
+    session = qemu_flp_find_session(s, id);
+    if (session != NULL)
+        session->used = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    if (session == NULL)
+        return FLP_RESULT_ID_UNKNOWN;
+
+    // what was batched so far stays until flushed
+    gps_state_batch_changed(s);
+    return FLP_RESULT_SUCCESS;
+}
+
+static void
+qemu_flp_cleanup()
+{
+    GpsState*  s = _gps_state;
+
+    if (!s->init)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    memset(s->batch_sessions, 0, sizeof(s->batch_sessions));
+    memset(&s->flp_callbacks, 0, sizeof(s->flp_callbacks));
+    s->batch_flush  = 0;
+    s->batch_last_n = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    gps_state_batch_changed(s);
+}
+
+static void
+qemu_flp_get_batched_location(int last_n_locations)
+{
+    GpsState*  s = _gps_state;
+
+    if (!s->init || last_n_locations <= 0)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    s->batch_last_n = last_n_locations;
+    pthread_mutex_unlock(&s->lock);
+
+    gps_state_batch_changed(s);
+}
+
+static int
+qemu_flp_inject_location(FlpLocation* __unused location)
+{
+    return FLP_RESULT_SUCCESS;
+}
+
+static const void*
+qemu_flp_get_extension(const char* __unused name)
+{
+    return NULL;
+}
+
+static void
+qemu_flp_flush_batched_locations()
+{
+    GpsState*  s = _gps_state;
+
+    if (!s->init)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    s->batch_flush = 1;
+    pthread_mutex_unlock(&s->lock);
+
+    gps_state_batch_changed(s);
+}
+
+static const FlpLocationInterface  qemuFlpInterface = {
+    sizeof(FlpLocationInterface),
+    qemu_flp_init,
+    qemu_flp_get_batch_size,
+    qemu_flp_start_batching,
+    qemu_flp_update_batching_options,
+    qemu_flp_stop_batching,
+    qemu_flp_cleanup,
+    qemu_flp_get_batched_location,
+    qemu_flp_inject_location,
+    qemu_flp_get_extension,
+    qemu_flp_flush_batched_locations,
+};
+
 static const void*
 qemu_gps_get_extension(const char* __unused name)
 {
@@ -997,12 +2134,15 @@ static struct hw_module_methods_t gps_module_methods = {
     .open = open_gps
 };
 
-struct hw_module_t HAL_MODULE_INFO_SYM = {
-    .tag = HARDWARE_MODULE_TAG,
-    .version_major = 1,
-    .version_minor = 0,
-    .id = GPS_HARDWARE_MODULE_ID,
-    .name = "Goldfish GPS Module",
-    .author = "The Android Open Source Project",
-    .methods = &gps_module_methods,
+QemuGpsModule HAL_MODULE_INFO_SYM = {
+    .common = {
+        .tag = HARDWARE_MODULE_TAG,
+        .version_major = 1,
+        .version_minor = 0,
+        .id = GPS_HARDWARE_MODULE_ID,
+        .name = QEMU_GPS_MODULE_NAME,
+        .author = "The Android Open Source Project",
+        .methods = &gps_module_methods,
+    },
+    .flp_interface = &qemuFlpInterface,
 };
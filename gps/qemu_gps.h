@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QEMU_GPS_H
+#define QEMU_GPS_H
+
+#include <hardware/hardware.h>
+#include <hardware/fused_location.h>
+
+/* the name of the gps module in gps_qemu.c, which is how the flp module
+ * in flp_qemu.c knows it can use the module's extra fields */
+#define  QEMU_GPS_MODULE_NAME  "Goldfish GPS Module"
+
+/* the gps module. The emulator's gps channel only has room for one
+ * client, so the flp module, loaded in the same process, batches the
+ * fixes read by the gps thread of this module through |flp_interface|
+ * instead of opening the channel a second time.
+ */
+typedef struct {
+    struct hw_module_t           common;
+    const FlpLocationInterface*  flp_interface;
+} QemuGpsModule;
+
+#endif /* QEMU_GPS_H */
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* This program replays an NMEA log through the real gps thread, on a
+ * Linux host, with a socketpair standing in for the qemud gps pipe.
+ *
+ * The log is split into epochs at each new GGA or RMC time, and the
+ * epochs are sent one second apart divided by the speedup, or as fast
+ * as possible with a speedup of 0. It reports the sentence rate, the
+ * rate of callbacks to the framework and the gps thread's CPU time.
+ *
+ * Usage: test-gps-replay [-s speedup] [-i fix-interval-ms] [nmea-log]
+ */
+#include "gps_qemu.c"
+#include "test_nmea_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define  DEFAULT_SPEEDUP  100
+#define  GENERATED_FIXES  3600
+
+typedef struct {
+    char*  lines;
+    int    size;
+    int*   epochs;      /* offset of each epoch in |lines| */
+    int    num_epochs;
+    int    sentences;
+} ReplayLog;
+
+static int s_fixes;
+static int s_sv_reports;
+static volatile int s_status_reports;
+
+static void on_location(GpsLocation* location)
+{
+    (void)location;
+    s_fixes++;
+}
+
+static void on_status(GpsStatus* status)
+{
+    (void)status;
+    s_status_reports++;
+}
+
+static void on_sv_status(GpsSvStatus* sv_status)
+{
+    (void)sv_status;
+    s_sv_reports++;
+}
+
+/* returns the time field of a GGA or RMC sentence, or NULL */
+static const char* fix_time(const char* line, int* len)
+{
+    const char*  comma;
+
+    if (line[0] == '$')
+        line++;
+    if (strncmp(line + 2, "GGA,", 4) && strncmp(line + 2, "RMC,", 4))
+        return NULL;
+
+    line += 6;
+    comma = strchr(line, ',');
+    if (comma == NULL)
+        return NULL;
+    *len = comma - line;
+    return line;
+}
+
+static int load_log(FILE* f, ReplayLog* log)
+{
+    char         line[256];
+    const char*  epoch_time = NULL;
+    int          epoch_len = 0;
+    int          capacity = 0;
+    long         size;
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+
+    log->lines = malloc(size + 1);
+    log->size  = 0;
+    log->epochs = NULL;
+    log->num_epochs = 0;
+    log->sentences  = 0;
+    if (log->lines == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char*        dst = log->lines + log->size;
+        const char*  time;
+        int          len = strlen(line), time_len;
+
+        memcpy(dst, line, len);
+        time = fix_time(dst, &time_len);
+        if (log->num_epochs == 0 ||
+            (time != NULL && (epoch_time == NULL || time_len != epoch_len ||
+                              memcmp(time, epoch_time, time_len)))) {
+            if (log->num_epochs == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                log->epochs = realloc(log->epochs, capacity * sizeof(int));
+                if (log->epochs == NULL)
+                    return -1;
+            }
+            log->epochs[log->num_epochs++] = log->size;
+        }
+        if (time != NULL) {
+            epoch_time = time;
+            epoch_len  = time_len;
+        }
+        log->size += len;
+        log->sentences++;
+    }
+    return 0;
+}
+
+static long long now_nsecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long thread_cpu_nsecs(pthread_t thread)
+{
+    clockid_t        clock;
+    struct timespec  ts;
+
+    if (pthread_getcpuclockid(thread, &clock) != 0 ||
+        clock_gettime(clock, &ts) < 0)
+        return 0;
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+typedef struct {
+    void  (*start)(void*);
+    void*   arg;
+} ThreadStart;
+
+static void* thread_main(void* arg)
+{
+    ThreadStart*  ts = arg;
+
+    ts->start(ts->arg);
+    return NULL;
+}
+
+static pthread_t create_thread(const char* name, void (*start)(void*), void* arg)
+{
+    static ThreadStart  ts;
+    pthread_t           thread;
+
+    (void)name;
+    ts.start = start;
+    ts.arg   = arg;
+    if (pthread_create(&thread, NULL, thread_main, &ts) != 0)
+        return 0;
+    return thread;
+}
+
+static int write_all(int fd, const char* p, int len)
+{
+    while (len > 0) {
+        int  ret = write(fd, p, len);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p   += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    GpsState*   s = _gps_state;
+    ReplayLog   log;
+    FILE*       f;
+    int         speedup = DEFAULT_SPEEDUP;
+    int         interval = 0;
+    int         daemon[2];
+    long long   start, elapsed, cpu_start, cpu;
+    int         c, n, pending;
+
+    while ((c = getopt(argc, argv, "s:i:")) != -1) {
+        switch (c) {
+            case 's': speedup  = atoi(optarg); break;
+            case 'i': interval = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s speedup] [-i fix-interval-ms] [nmea-log]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+
+    f = (optind < argc) ? fopen(argv[optind], "r") : generate_nmea_log(GENERATED_FIXES);
+    if (f == NULL || speedup < 0 || interval < 0 || load_log(f, &log) < 0) {
+        fprintf(stderr, "usage: %s [-s speedup] [-i fix-interval-ms] [nmea-log]\n",
+                argv[0]);
+        return 1;
+    }
+    fclose(f);
+
+    // what gps_state_init() does, with a socketpair instead of the pipe
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, daemon) < 0 ||
+        socketpair(AF_LOCAL, SOCK_STREAM, 0, s->control) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return 1;
+    }
+    s->init = 1;
+    s->fd   = daemon[0];
+    s->callbacks.size            = sizeof(s->callbacks);
+    s->callbacks.location_cb     = on_location;
+    s->callbacks.status_cb       = on_status;
+    s->callbacks.sv_status_cb    = on_sv_status;
+    s->callbacks.create_thread_cb = create_thread;
+    s->thread = create_thread("gps_state_thread", gps_state_thread, s);
+    if (!s->thread) {
+        fprintf(stderr, "could not create gps thread\n");
+        return 1;
+    }
+
+    gps_state_set_mode(s, GPS_POSITION_RECURRENCE_PERIODIC, interval);
+    gps_state_start(s);
+
+    // fixes sent before the session begins would be coalesced into one
+    while (s_status_reports == 0)
+        usleep(1000);
+
+    cpu_start = thread_cpu_nsecs(s->thread);
+    start = now_nsecs();
+    for (n = 0; n < log.num_epochs; n++) {
+        int  end = (n + 1 < log.num_epochs) ? log.epochs[n + 1] : log.size;
+
+        if (speedup > 0) {
+            long long        due = start + n * (1000000000LL / speedup);
+            struct timespec  ts = { due / 1000000000LL, due % 1000000000LL };
+
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+        if (write_all(daemon[1], log.lines + log.epochs[n], end - log.epochs[n]) < 0) {
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    // wait for the gps thread to drain the socket
+    do {
+        usleep(1000);
+        if (ioctl(daemon[0], FIONREAD, &pending) < 0)
+            pending = 0;
+    } while (pending > 0);
+    usleep(10000);
+
+    elapsed = now_nsecs() - start;
+    cpu     = thread_cpu_nsecs(s->thread) - cpu_start;
+
+    gps_state_stop(s);
+    gps_state_done(s);
+    close(daemon[1]);
+
+    printf("%d sentences in %d epochs, %.3f s at %dx: %.0f sentences/s\n",
+           log.sentences, log.num_epochs, elapsed / 1e9, speedup,
+           log.sentences / (elapsed / 1e9));
+    printf("%d fixes, %d satellite reports, %d status reports: %.1f callbacks/s\n",
+           s_fixes, s_sv_reports, s_status_reports,
+           (s_fixes + s_sv_reports + s_status_reports) / (elapsed / 1e9));
+    printf("gps thread cpu %.3f ms: %.2f us per sentence\n",
+           cpu / 1e6, cpu / 1e3 / log.sentences);
+
+    free(log.lines);
+    free(log.epochs);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* This program measures the throughput of the NMEA reader.
+ *
+ * It replays a recorded NMEA log, or a generated one with GGA, RMC, GSA
+ * and GSV sentences for every fix, through the same read-and-parse path
+ * the gps thread uses, as many times as asked.
+ *
+ * Usage: test-gps-nmea-bench [nmea-log] [passes]
+ */
+#include "gps_qemu.c"
+#include "test_nmea_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define  DEFAULT_PASSES  20
+#define  GENERATED_FIXES 10000
+
+static int s_fixes;
+static int s_sv_reports;
+static int s_last_num_svs;
+
+static void on_location(GpsLocation* location)
+{
+    (void)location;
+    s_fixes++;
+}
+
+static void on_sv_status(GpsSvStatus* sv_status)
+{
+    s_sv_reports++;
+    s_last_num_svs = sv_status->num_svs;
+}
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+    static NmeaReader  reader[1];
+    int     passes = DEFAULT_PASSES;
+    FILE*   f;
+    long    sentences = 0;
+    long    bytes = 0;
+    double  start, elapsed;
+    int     c, n, fd;
+
+    f = (argc > 1) ? fopen(argv[1], "r") : generate_nmea_log(GENERATED_FIXES);
+    if (argc > 2)
+        passes = atoi(argv[2]);
+
+    if (f == NULL || passes <= 0) {
+        fprintf(stderr, "usage: %s [nmea-log] [passes]\n", argv[0]);
+        return 1;
+    }
+
+    rewind(f);
+    while ((c = getc(f)) != EOF) {
+        if (c == '\n')
+            sentences++;
+    }
+    fd = fileno(f);
+
+    nmea_reader_init(reader);
+    nmea_reader_set_callback(reader, on_location);
+    nmea_reader_set_sv_callback(reader, on_sv_status);
+
+    start = now_secs();
+    for (n = 0; n < passes; n++) {
+        int  ret;
+
+        lseek(fd, 0, SEEK_SET);
+        while ((ret = nmea_reader_read(reader, fd)) > 0)
+            bytes += ret;
+        if (ret < 0) {
+            fprintf(stderr, "read error: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    elapsed = now_secs() - start;
+
+    printf("%ld sentences, %ld bytes in %.3f s: %.0f sentences/s, %.1f MB/s\n",
+           sentences * passes, bytes, elapsed,
+           sentences * passes / elapsed, bytes / elapsed / 1e6);
+    printf("%d fixes reported, %d bad checksums\n",
+           s_fixes, reader->bad_checksums);
+    printf("%d satellite reports, last one with %d satellites\n",
+           s_sv_reports, s_last_num_svs);
+
+    fclose(f);
+    return 0;
+}
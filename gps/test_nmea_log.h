@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Generated NMEA logs shared by the gps tests. Include after gps_qemu.c.
+ */
+#ifndef TEST_NMEA_LOG_H
+#define TEST_NMEA_LOG_H
+
+#include <stdio.h>
+
+static void put_sentence(FILE* f, const char* body)
+{
+    int  sum = 0;
+    const char*  p;
+
+    for (p = body; *p; p++)
+        sum ^= (unsigned char)*p;
+    fprintf(f, "$%s*%02X\r\n", body, sum);
+}
+
+/* returns a temporary file with |fixes| one-second epochs of GGA, RMC,
+ * GSA and GSV sentences, or NULL */
+static FILE* generate_nmea_log(int fixes)
+{
+    FILE*  f = tmpfile();
+    char   body[NMEA_MAX_SIZE];
+    int    n;
+
+    if (f == NULL)
+        return NULL;
+
+    for (n = 0; n < fixes; n++) {
+        int  sec = n % 60, min = (n / 60) % 60, hour = (n / 3600) % 24;
+
+        snprintf(body, sizeof(body),
+                 "GPGGA,%02d%02d%02d.00,4807.%03d,N,01131.%03d,E,1,08,0.9,545.4,M,46.9,M,,",
+                 hour, min, sec, n % 1000, (n * 7) % 1000);
+        put_sentence(f, body);
+        snprintf(body, sizeof(body),
+                 "GPRMC,%02d%02d%02d.00,A,4807.%03d,N,01131.%03d,E,022.4,084.4,230319,003.1,W",
+                 hour, min, sec, n % 1000, (n * 7) % 1000);
+        put_sentence(f, body);
+        put_sentence(f, "GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1");
+        put_sentence(f, "GPGSV,2,1,08,01,40,083,46,02,17,308,41,12,07,344,39,14,22,228,45");
+        put_sentence(f, "GPGSV,2,2,08,15,33,051,44,17,51,129,47,24,12,287,40,25,60,010,49");
+    }
+
+    fflush(f);
+    return f;
+}
+
+#endif /* TEST_NMEA_LOG_H */
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* This program checks the UTC timestamps the NMEA reader gives fixes,
+ * in particular around midnight, whatever the local timezone is.
+ *
+ * Usage: test-gps-nmea-time
+ */
+#include "gps_qemu.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int s_failures;
+
+#define  EXPECT_EQ(expected, actual)                                        \
+    do {                                                                    \
+        long long  e = (expected), a = (actual);                            \
+        if (e != a) {                                                       \
+            fprintf(stderr, "%s:%d: expected %lld, got %lld\n",             \
+                    __FILE__, __LINE__, e, a);                              \
+            s_failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+static GpsUtcTime s_timestamp;
+
+static void on_location(GpsLocation* location)
+{
+    s_timestamp = location->timestamp;
+}
+
+static void put_sentence(NmeaReader* r, const char* body)
+{
+    int  sum = 0;
+    const char*  p;
+
+    for (p = body; *p; p++)
+        sum ^= (unsigned char)*p;
+
+    r->tail += snprintf(r->buf + r->tail, sizeof(r->buf) - r->tail,
+                        "$%s*%02X\r\n", body, sum);
+    nmea_reader_parse_buffer(r);
+}
+
+static void put_gga(NmeaReader* r, const char* time)
+{
+    char  body[NMEA_MAX_SIZE];
+
+    snprintf(body, sizeof(body),
+             "GPGGA,%s,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,", time);
+    put_sentence(r, body);
+}
+
+static void put_rmc(NmeaReader* r, const char* time, const char* date)
+{
+    char  body[NMEA_MAX_SIZE];
+
+    snprintf(body, sizeof(body),
+             "GPRMC,%s,A,4807.038,N,01131.000,E,022.4,084.4,%s,003.1,W", time, date);
+    put_sentence(r, body);
+}
+
+static void test_days_from_civil(void)
+{
+    EXPECT_EQ(0, days_from_civil(1970, 1, 1));
+    EXPECT_EQ(-1, days_from_civil(1969, 12, 31));
+    EXPECT_EQ(10957, days_from_civil(2000, 1, 1));
+    EXPECT_EQ(11016, days_from_civil(2000, 2, 29));
+    EXPECT_EQ(11017, days_from_civil(2000, 3, 1));
+    EXPECT_EQ(16860, days_from_civil(2016, 2, 29));
+    EXPECT_EQ(17532, days_from_civil(2018, 1, 1));
+    EXPECT_EQ(47481, days_from_civil(2099, 12, 31));
+}
+
+static void test_rmc(NmeaReader* r)
+{
+    // 2019-03-23 12:35:19.25 UTC, two-digit years are in this century
+    put_rmc(r, "123519.25", "230319");
+    EXPECT_EQ(1553344519250LL, s_timestamp);
+}
+
+static void test_rollover_with_date(NmeaReader* r)
+{
+    // 2018-12-31 23:59:59, then GGA comes before the RMC with the new date
+    put_rmc(r, "235959", "311218");
+    EXPECT_EQ(1546300799000LL, s_timestamp);
+    put_gga(r, "000000");
+    EXPECT_EQ(1546300800000LL, s_timestamp);
+    put_rmc(r, "000000", "010119");
+    EXPECT_EQ(1546300800000LL, s_timestamp);
+    put_gga(r, "000001");
+    EXPECT_EQ(1546300801000LL, s_timestamp);
+}
+
+static void test_rollover_without_date(NmeaReader* r)
+{
+    // 2016-02-28 23:59:59.5, then only GGA across midnight into Feb 29th
+    put_rmc(r, "235959.5", "280216");
+    EXPECT_EQ(1456703999500LL, s_timestamp);
+    put_gga(r, "000000.5");
+    EXPECT_EQ(1456704000500LL, s_timestamp);
+    put_gga(r, "120000");
+    EXPECT_EQ(1456747200000LL, s_timestamp);
+    put_gga(r, "235959");
+    EXPECT_EQ(1456790399000LL, s_timestamp);
+    put_gga(r, "000000");
+    EXPECT_EQ(1456790400000LL, s_timestamp);
+}
+
+static void test_out_of_order(NmeaReader* r)
+{
+    // a fix a little older than the last one stays on the same day
+    put_rmc(r, "000010", "010119");
+    EXPECT_EQ(1546300810000LL, s_timestamp);
+    put_gga(r, "000005");
+    EXPECT_EQ(1546300805000LL, s_timestamp);
+}
+
+int main(void)
+{
+    static NmeaReader  reader[1];
+
+    // the result must not depend on the local timezone
+    setenv("TZ", "America/Los_Angeles", 1);
+    tzset();
+
+    test_days_from_civil();
+
+    nmea_reader_init(reader);
+    nmea_reader_set_callback(reader, on_location);
+
+    test_rmc(reader);
+    test_rollover_with_date(reader);
+    test_rollover_without_date(reader);
+    test_out_of_order(reader);
+
+    if (s_failures) {
+        fprintf(stderr, "%d failures\n", s_failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,49 @@
+# Build gps tests, included from main Android.mk
+
+# Throughput benchmark for the NMEA reader, replaying a recorded or
+# generated NMEA log.
+#
+include $(CLEAR_VARS)
+LOCAL_MODULE := test-gps-nmea-bench
+LOCAL_SRC_FILES := test_nmea_bench.c
+LOCAL_CFLAGS += -DQEMU_HARDWARE
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
+
+# Checks fix timestamps from NMEA times and dates, including across
+# midnight.
+#
+include $(CLEAR_VARS)
+LOCAL_MODULE := test-gps-nmea-time
+LOCAL_SRC_FILES := test_nmea_time.c
+LOCAL_CFLAGS += -DQEMU_HARDWARE
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
+
+# Replays an NMEA log through the gps thread on a Linux host, with a
+# socketpair in place of the qemud pipe.
+#
+include $(CLEAR_VARS)
+LOCAL_MODULE := test-gps-replay
+LOCAL_SRC_FILES := test_gps_replay.c
+LOCAL_CFLAGS += -DQEMU_HARDWARE
+LOCAL_HEADER_LIBRARIES := libhardware_headers
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_HOST_EXECUTABLE)
+
+# libFuzzer target for the NMEA tokenizer, field helpers and reader.
+#
+include $(CLEAR_VARS)
+LOCAL_MODULE := gps_nmea_fuzzer
+LOCAL_SRC_FILES := fuzz_nmea.c
+LOCAL_CFLAGS += -DQEMU_HARDWARE
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
+include $(BUILD_FUZZ_TEST)
@@ -42,3 +42,5 @@ LOCAL_SHARED_LIBRARIES += \
 LOCAL_CFLAGS += -DRIL_SHLIB
 LOCAL_MODULE:= libgoldfish-ril
 include $(BUILD_SHARED_LIBRARY)
+
+include $(LOCAL_PATH)/tests.mk
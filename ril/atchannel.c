@@ -41,15 +41,39 @@
 #define MAX_AT_RESPONSE (8 * 1024)
 #define HANDSHAKE_RETRY_COUNT 8
 #define HANDSHAKE_TIMEOUT_MSEC 250
+/* well above the 40 characters V.250 requires a modem to accept */
+#define AT_BATCH_MAX_LINE 128
+#define AT_BATCH_MAX_ALONE 8
 
 static pthread_t s_tid_reader;
 static int s_fd = -1;    /* fd of the AT channel */
 static ATUnsolHandler s_unsolHandler;
 
-/* for input buffering */
+/* for input buffering
+ *
+ * Input is appended at |s_ATTail| and consumed from |s_ATHead|. Lines are
+ * terminated in place and handed out as pointers into the buffer, so the
+ * only copying happens when a partial line reaches the physical end of the
+ * buffer and has to be moved back to the start. The buffer rewinds for free
+ * whenever it drains, which is the common case between responses.
+ */
+
+#define AT_NO_HOLD ((size_t) -1)
 
 static char s_ATBuffer[MAX_AT_RESPONSE+1];
-static char *s_ATBufferCur = s_ATBuffer;
+static size_t s_ATHead = 0;
+static size_t s_ATTail = 0;
+static size_t s_ATHold = AT_NO_HOLD; /* start of a line the caller still uses */
+
+/* response lines are carved out of per-response arenas of this size */
+#define AT_ARENA_CHUNK 512
+
+struct ATArena {
+    struct ATArena *p_next;
+    size_t used;
+    size_t size;
+    char data[];
+};
 
 #if AT_DEBUG
 void  AT_DUMP(const char*  prefix, const char*  buff, int  len)
@@ -62,21 +86,49 @@ void  AT_DUMP(const char*  prefix, const char*  buff, int  len)
 
 /*
  * There is one reader thread |s_tid_reader| and potentially multiple writer
- * threads. |s_commandmutex| and |s_commandcond| are used to maintain the
- * condition that the writer thread will not read from |sp_response| until the
- * reader thread has signaled itself is finished, etc. |s_writeMutex| is used to
- * prevent multiple writer threads from calling at_send_command_full_nolock
- * function at the same time.
+ * threads. A writer queues an ATCommand at |sp_cmdTail| and writes it to the
+ * channel while holding |s_commandmutex|, then waits on the command's own
+ * condition. The modem answers commands in order, so the reader matches each
+ * line against the command at |sp_cmdHead| and signals it once its final
+ * response arrives. Up to |s_maxOutstanding| commands may be in flight;
+ * |s_commandcond| is signaled whenever a slot in the queue frees up.
+ *
+ * Commands that need the channel to themselves (SMS with its "> " prompt,
+ * the handshake) wait for the queue to drain and hold |s_exclusive| while
+ * they run.
  */
 
+typedef struct ATCommand {
+    struct ATCommand *p_next;
+    ATCommandType type;
+    const char *responsePrefix;
+    const char *smsPDU;
+    int callControl;    /* ATD, ATA or ATH, see isFinalResponseCall() */
+    ATResponse *p_response;
+    pthread_cond_t cond;
+} ATCommand;
+
 static pthread_mutex_t s_commandmutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t s_commandcond = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t s_writeMutex = PTHREAD_MUTEX_INITIALIZER;
 
-static ATCommandType s_type;
-static const char *s_responsePrefix = NULL;
-static const char *s_smsPDU = NULL;
-static ATResponse *sp_response = NULL;
+static ATCommand *sp_cmdHead = NULL;
+static ATCommand *sp_cmdTail = NULL;
+static int s_cmdCount = 0;
+static int s_maxOutstanding = 1;
+static int s_exclusive = 0;
+static int s_exclusiveWaiters = 0;
+
+static int s_batchUnsupported = 0; /* modem rejected a joined command line */
+/* commands that failed on their own, protected by s_commandmutex */
+static char *s_batchAlone[AT_BATCH_MAX_ALONE];
+static int s_batchAloneNext = 0;
+
+#ifdef AT_STATS
+static ATChannelStats s_stats;  /* protected by s_commandmutex */
+#define  AT_COUNT(field)  (s_stats.field++)
+#else
+#define  AT_COUNT(field)  do{}while(0)
+#endif
 
 static void (*s_onTimeout)(void) = NULL;
 static void (*s_onReaderClosed)(void) = NULL;
@@ -117,35 +169,82 @@ static void sleepMsec(long long msec)
 
 
 
-/** add an intermediate response to sp_response*/
-static void addIntermediate(const char *line)
+/**
+ * Allocates |size| bytes that live as long as |p_response|
+ * returns NULL if out of memory
+ */
+static void *arenaAlloc(ATResponse *p_response, size_t size)
+{
+    struct ATArena *p_arena = p_response->p_arena;
+    void *ret;
+
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if (p_arena->size - p_arena->used < size) {
+        size_t chunk = size > AT_ARENA_CHUNK ? size : AT_ARENA_CHUNK;
+
+        p_arena = (struct ATArena *) malloc(sizeof(struct ATArena) + chunk);
+        if (p_arena == NULL) {
+            return NULL;
+        }
+        p_arena->used = 0;
+        p_arena->size = chunk;
+        p_arena->p_next = p_response->p_arena;
+        p_response->p_arena = p_arena;
+    }
+
+    ret = p_arena->data + p_arena->used;
+    p_arena->used += size;
+
+    return ret;
+}
+
+static char *arenaStrdup(ATResponse *p_response, const char *s)
+{
+    size_t len = strlen(s);
+    char *ret;
+
+    ret = (char *) arenaAlloc(p_response, len + 1);
+    if (ret != NULL) {
+        memcpy(ret, s, len + 1);
+    }
+
+    return ret;
+}
+
+/** add an intermediate response to p_response */
+static void addIntermediate(ATResponse *p_response, const char *line)
 {
     ATLine *p_new;
+    size_t len = strlen(line);
+
+    /* the line text is stored right behind its list node */
+    p_new = (ATLine *) arenaAlloc(p_response, sizeof(ATLine) + len + 1);
 
-    p_new = (ATLine  *) malloc(sizeof(ATLine));
+    if (p_new == NULL) {
+        RLOGE("ERROR: out of memory for intermediate response\n");
+        return;
+    }
 
-    p_new->line = strdup(line);
+    p_new->line = (char *) (p_new + 1);
+    memcpy(p_new->line, line, len + 1);
 
     /* note: this adds to the head of the list, so the list
        will be in reverse order of lines received. the order is flipped
        again before passing on to the command issuer */
-    p_new->p_next = sp_response->p_intermediates;
-    sp_response->p_intermediates = p_new;
+    p_new->p_next = p_response->p_intermediates;
+    p_response->p_intermediates = p_new;
 }
 
 
 /**
  * returns 1 if line is a final response indicating error
  * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
  */
 static const char * s_finalResponsesError[] = {
     "ERROR",
     "+CMS ERROR:",
     "+CME ERROR:",
-    "NO CARRIER", /* sometimes! */
-    "NO ANSWER",
-    "NO DIALTONE",
 };
 static int isFinalResponseError(const char *line)
 {
@@ -182,14 +281,61 @@ static int isFinalResponseSuccess(const char *line)
     return 0;
 }
 
+/**
+ * returns 1 if line is a final response indicating that a call
+ * control command failed
+ * See V.250 5.7.1
+ * WARNING: NO CARRIER is also unsolicited when the other end hangs up,
+ * and with several commands outstanding it would complete the wrong one,
+ * so these are final responses of call control commands only
+ */
+static const char * s_finalResponsesCall[] = {
+    "NO CARRIER",
+    "BUSY",
+    "NO ANSWER",
+    "NO DIALTONE",
+};
+static int isFinalResponseCall(const char *line)
+{
+    size_t i;
+
+    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesCall) ; i++) {
+        if (strStartsWith(line, s_finalResponsesCall[i])) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * returns 1 if command dials, answers or hangs up, the commands that
+ * isFinalResponseCall() lines may complete
+ */
+static int isCallControlCommand(const char *command)
+{
+    if (strncasecmp(command, "AT", 2) != 0) {
+        return 0;
+    }
+
+    switch (command[2]) {
+        case 'D': case 'd':
+        case 'A': case 'a':
+        case 'H': case 'h':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
 /**
  * returns 1 if line is a final response, either  error or success
  * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
  */
 static int isFinalResponse(const char *line)
 {
-    return isFinalResponseSuccess(line) || isFinalResponseError(line);
+    return isFinalResponseSuccess(line) || isFinalResponseError(line)
+            || isFinalResponseCall(line);
 }
 
 
@@ -217,15 +363,69 @@ static int isSMSUnsolicited(const char *line)
 
 
 /** assumes s_commandmutex is held */
-static void handleFinalResponse(const char *line)
+static void enqueueCommand(ATCommand *p_cmd)
 {
-    sp_response->finalResponse = strdup(line);
+    p_cmd->p_next = NULL;
 
-    pthread_cond_signal(&s_commandcond);
+    if (sp_cmdTail == NULL) {
+        sp_cmdHead = p_cmd;
+    } else {
+        sp_cmdTail->p_next = p_cmd;
+    }
+    sp_cmdTail = p_cmd;
+    s_cmdCount++;
+}
+
+/**
+ * Removes p_cmd from the queue if it is still there
+ * assumes s_commandmutex is held
+ */
+static void dequeueCommand(ATCommand *p_cmd)
+{
+    ATCommand **pp_cur;
+    ATCommand *p_prev = NULL;
+
+    for (pp_cur = &sp_cmdHead; *pp_cur != NULL; pp_cur = &(*pp_cur)->p_next) {
+        if (*pp_cur == p_cmd) {
+            *pp_cur = p_cmd->p_next;
+            if (sp_cmdTail == p_cmd) {
+                sp_cmdTail = p_prev;
+            }
+            s_cmdCount--;
+            pthread_cond_broadcast(&s_commandcond);
+            return;
+        }
+        p_prev = *pp_cur;
+    }
 }
 
+/** assumes s_commandmutex is held */
+static void wakeAllCommands()
+{
+    ATCommand *p_cmd;
+
+    for (p_cmd = sp_cmdHead; p_cmd != NULL; p_cmd = p_cmd->p_next) {
+        pthread_cond_signal(&p_cmd->cond);
+    }
+
+    pthread_cond_broadcast(&s_commandcond);
+}
+
+/** assumes s_commandmutex is held */
+static void handleFinalResponse(ATCommand *p_cmd, const char *line)
+{
+    p_cmd->p_response->finalResponse = arenaStrdup(p_cmd->p_response, line);
+    AT_COUNT(responses);
+
+    dequeueCommand(p_cmd);
+    pthread_cond_signal(&p_cmd->cond);
+}
+
+/** assumes s_commandmutex is held */
 static void handleUnsolicited(const char *line)
 {
+    AT_COUNT(unsolicited);
+
     if (s_unsolHandler != NULL) {
         s_unsolHandler(line, NULL);
     }
@@ -233,31 +433,39 @@ static void handleUnsolicited(const char *line)
 
 static void processLine(const char *line)
 {
+    ATCommand *p_cmd;
+    ATResponse *p_response;
+
     pthread_mutex_lock(&s_commandmutex);
 
-    if (sp_response == NULL) {
+    /* responses come back in the order the commands were sent */
+    p_cmd = sp_cmdHead;
+    p_response = p_cmd != NULL ? p_cmd->p_response : NULL;
+
+    if (p_cmd == NULL) {
         /* no command pending */
         handleUnsolicited(line);
     } else if (isFinalResponseSuccess(line)) {
-        sp_response->success = 1;
-        handleFinalResponse(line);
-    } else if (isFinalResponseError(line)) {
-        sp_response->success = 0;
-        handleFinalResponse(line);
-    } else if (s_smsPDU != NULL && 0 == strcmp(line, "> ")) {
+        p_response->success = 1;
+        handleFinalResponse(p_cmd, line);
+    } else if (isFinalResponseError(line)
+            || (p_cmd->callControl && isFinalResponseCall(line))) {
+        p_response->success = 0;
+        handleFinalResponse(p_cmd, line);
+    } else if (p_cmd->smsPDU != NULL && 0 == strcmp(line, "> ")) {
         // See eg. TS 27.005 4.3
         // Commands like AT+CMGS have a "> " prompt
-        writeCtrlZ(s_smsPDU);
-        s_smsPDU = NULL;
-    } else switch (s_type) {
+        writeCtrlZ(p_cmd->smsPDU);
+        p_cmd->smsPDU = NULL;
+    } else switch (p_cmd->type) {
         case NO_RESULT:
             handleUnsolicited(line);
             break;
         case NUMERIC:
-            if (sp_response->p_intermediates == NULL
+            if (p_response->p_intermediates == NULL
                 && isdigit(line[0])
             ) {
-                addIntermediate(line);
+                addIntermediate(p_response, line);
             } else {
                 /* either we already have an intermediate response or
                    the line doesn't begin with a digit */
@@ -265,25 +473,25 @@ static void processLine(const char *line)
             }
             break;
         case SINGLELINE:
-            if (sp_response->p_intermediates == NULL
-                && strStartsWith (line, s_responsePrefix)
+            if (p_response->p_intermediates == NULL
+                && strStartsWith (line, p_cmd->responsePrefix)
             ) {
-                addIntermediate(line);
+                addIntermediate(p_response, line);
             } else {
                 /* we already have an intermediate response */
                 handleUnsolicited(line);
             }
             break;
         case MULTILINE:
-            if (strStartsWith (line, s_responsePrefix)) {
-                addIntermediate(line);
+            if (strStartsWith (line, p_cmd->responsePrefix)) {
+                addIntermediate(p_response, line);
             } else {
                 handleUnsolicited(line);
             }
         break;
 
         default: /* this should never be reached */
-            RLOGE("Unsupported AT command type %d\n", s_type);
+            RLOGE("Unsupported AT command type %d\n", p_cmd->type);
             handleUnsolicited(line);
         break;
     }
@@ -293,22 +501,56 @@ static void processLine(const char *line)
 
 
 /**
- * Returns a pointer to the end of the next line
+ * Returns a pointer to the end of the next line in [cur, end)
  * special-cases the "> " SMS prompt
  *
  * returns NULL if there is no complete line
  */
-static char * findNextEOL(char *cur)
+static char * findNextEOL(char *cur, char *end)
 {
-    if (cur[0] == '>' && cur[1] == ' ' && cur[2] == '\0') {
+    if (end - cur == 2 && cur[0] == '>' && cur[1] == ' ') {
         /* SMS prompt character...not \r terminated */
         return cur+2;
     }
 
     // Find next newline
-    while (*cur != '\0' && *cur != '\r' && *cur != '\n') cur++;
+    while (cur < end && *cur != '\r' && *cur != '\n') cur++;
 
-    return *cur == '\0' ? NULL : cur;
+    return cur == end ? NULL : cur;
+}
+
+
+/**
+ * Makes room at the tail of the input buffer for another read.
+ * Only the partial line (and a held line, if any) is preserved.
+ */
+static void compactBuffer()
+{
+    size_t keep = s_ATHold != AT_NO_HOLD ? s_ATHold : s_ATHead;
+
+    if (keep == s_ATTail) {
+        /* nothing left to preserve, rewind */
+        s_ATHead = s_ATTail = 0;
+    } else if (s_ATTail == MAX_AT_RESPONSE) {
+        if (keep == 0) {
+            RLOGE("ERROR: Input line exceeded buffer\n");
+            /* ditch the partial line and start over again */
+            s_ATTail = s_ATHead;
+            if (s_ATTail == MAX_AT_RESPONSE) {
+                s_ATHead = s_ATTail = 0;
+                s_ATHold = AT_NO_HOLD;
+            }
+        } else {
+            memmove(s_ATBuffer, s_ATBuffer + keep, s_ATTail - keep);
+            s_ATHead -= keep;
+            s_ATTail -= keep;
+            if (s_ATHold != AT_NO_HOLD) {
+                s_ATHold = 0;
+            }
+        }
+    }
+
+    s_ATBuffer[s_ATTail] = '\0';
 }
 
 
@@ -316,7 +558,8 @@ static char * findNextEOL(char *cur)
  * Reads a line from the AT channel, returns NULL on timeout.
  * Assumes it has exclusive read access to the FD
  *
- * This line is valid only until the next call to readline
+ * This line is valid only until the next call to readline, unless it
+ * is kept with holdLine()
  *
  * This function exists because as of writing, android libc does not
  * have buffered stdio.
@@ -325,68 +568,54 @@ static char * findNextEOL(char *cur)
 static const char *readline()
 {
     ssize_t count;
+#ifdef AT_STATS
+    struct timespec cpu;
+#endif
 
-    char *p_read = NULL;
     char *p_eol = NULL;
     char *ret;
 
-    /* this is a little odd. I use *s_ATBufferCur == 0 to
-     * mean "buffer consumed completely". If it points to a character, than
-     * the buffer continues until a \0
-     */
-    if (*s_ATBufferCur == '\0') {
-        /* empty buffer */
-        s_ATBufferCur = s_ATBuffer;
-        *s_ATBufferCur = '\0';
-        p_read = s_ATBuffer;
-    } else {   /* *s_ATBufferCur != '\0' */
-        /* there's data in the buffer from the last read */
-
+    for (;;) {
         // skip over leading newlines
-        while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-            s_ATBufferCur++;
+        while (s_ATHead < s_ATTail
+                && (s_ATBuffer[s_ATHead] == '\r' || s_ATBuffer[s_ATHead] == '\n'))
+            s_ATHead++;
 
-        p_eol = findNextEOL(s_ATBufferCur);
+        p_eol = findNextEOL(s_ATBuffer + s_ATHead, s_ATBuffer + s_ATTail);
 
-        if (p_eol == NULL) {
-            /* a partial line. move it up and prepare to read more */
-            size_t len;
+        if (p_eol != NULL) {
+            break;
+        }
 
-            len = strlen(s_ATBufferCur);
+        compactBuffer();
 
-            memmove(s_ATBuffer, s_ATBufferCur, len + 1);
-            p_read = s_ATBuffer + len;
-            s_ATBufferCur = s_ATBuffer;
-        }
-        /* Otherwise, (p_eol !- NULL) there is a complete line  */
-        /* that will be returned the while () loop below        */
-    }
+#ifdef AT_STATS
+        /* everything read so far has been handled, account for it before
+           blocking for more */
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
 
-    while (p_eol == NULL) {
-        if (0 == MAX_AT_RESPONSE - (p_read - s_ATBuffer)) {
-            RLOGE("ERROR: Input line exceeded buffer\n");
-            /* ditch buffer and start over again */
-            s_ATBufferCur = s_ATBuffer;
-            *s_ATBufferCur = '\0';
-            p_read = s_ATBuffer;
-        }
+        pthread_mutex_lock(&s_commandmutex);
+        s_stats.readerCpuUsec = cpu.tv_sec * 1000000LL + cpu.tv_nsec / 1000;
+        pthread_mutex_unlock(&s_commandmutex);
+#endif
 
         do {
-            count = read(s_fd, p_read,
-                            MAX_AT_RESPONSE - (p_read - s_ATBuffer));
+            count = read(s_fd, s_ATBuffer + s_ATTail,
+                            MAX_AT_RESPONSE - s_ATTail);
         } while (count < 0 && errno == EINTR);
 
         if (count > 0) {
-            AT_DUMP( "<< ", p_read, count );
+            AT_DUMP( "<< ", s_ATBuffer + s_ATTail, count );
 
-            p_read[count] = '\0';
-
-            // skip over leading newlines
-            while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-                s_ATBufferCur++;
+#ifdef AT_STATS
+            pthread_mutex_lock(&s_commandmutex);
+            s_stats.reads++;
+            s_stats.bytesRead += count;
+            pthread_mutex_unlock(&s_commandmutex);
+#endif
 
-            p_eol = findNextEOL(s_ATBufferCur);
-            p_read += count;
+            s_ATTail += count;
+            s_ATBuffer[s_ATTail] = '\0';
         } else if (count <= 0) {
             /* read error encountered or EOF reached */
             if(count == 0) {
@@ -400,15 +629,40 @@ static const char *readline()
 
     /* a full line in the buffer. Place a \0 over the \r and return */
 
-    ret = s_ATBufferCur;
+    ret = s_ATBuffer + s_ATHead;
     *p_eol = '\0';
-    s_ATBufferCur = p_eol + 1; /* this will always be <= p_read,    */
-                              /* and there will be a \0 at *p_read */
+    s_ATHead = p_eol - s_ATBuffer + 1;
+    if (s_ATHead > s_ATTail) {
+        /* the "> " prompt ends right at the tail */
+        s_ATHead = s_ATTail;
+    }
 
     RLOGD("AT< %s\n", ret);
     return ret;
 }
 
+/**
+ * Keeps |line|, as returned by the last readline(), in place across the
+ * next call to readline(). The line may move, so get it back with
+ * releaseLine()
+ */
+static void holdLine(const char *line)
+{
+    s_ATHold = line - s_ATBuffer;
+}
+
+static const char *releaseLine()
+{
+    const char *ret;
+
+    /* dropped by compactBuffer() if the buffer overflowed meanwhile */
+    ret = s_ATHold != AT_NO_HOLD ? s_ATBuffer + s_ATHold : "";
+
+    s_ATHold = AT_NO_HOLD;
+
+    return ret;
+}
+
 
 static void onReaderClosed()
 {
@@ -418,7 +672,7 @@ static void onReaderClosed()
 
         s_readerClosed = 1;
 
-        pthread_cond_signal(&s_commandcond);
+        wakeAllCommands();
 
         pthread_mutex_unlock(&s_commandmutex);
 
@@ -439,24 +693,29 @@ static void *readerLoop(void *arg __unused)
         }
 
         if(isSMSUnsolicited(line)) {
-            char *line1;
+            const char *line1;
             const char *line2;
 
             // The scope of string returned by 'readline()' is valid only
-            // till next call to 'readline()' hence making a copy of line
-            // before calling readline again.
-            line1 = strdup(line);
+            // till next call to 'readline()' hence keeping the first line
+            // in the buffer while reading the PDU.
+            holdLine(line);
             line2 = readline();
+            line1 = releaseLine();
 
             if (line2 == NULL) {
-                free(line1);
                 break;
             }
 
+#ifdef AT_STATS
+            pthread_mutex_lock(&s_commandmutex);
+            s_stats.unsolicited++;
+            pthread_mutex_unlock(&s_commandmutex);
+#endif
+
             if (s_unsolHandler != NULL) {
                 s_unsolHandler (line1, line2);
             }
-            free(line1);
         } else {
             processLine(line);
         }
@@ -470,6 +729,7 @@ static void *readerLoop(void *arg __unused)
 /**
  * Sends string s to the radio with a \r appended.
  * Returns AT_ERROR_* on error, 0 on success
+ * assumes s_commandmutex is held
  *
  * This function exists because as of writing, android libc does not
  * have buffered stdio.
@@ -488,6 +748,8 @@ static int writeline (const char *s)
 
     AT_DUMP( ">> ", s, strlen(s) );
 
+    AT_COUNT(commands);
+
     /* the main string */
     while (cur < len) {
         do {
@@ -553,18 +815,6 @@ static int writeCtrlZ (const char *s)
     return 0;
 }
 
-static void clearPendingCommand()
-{
-    if (sp_response != NULL) {
-        at_response_free(sp_response);
-    }
-
-    sp_response = NULL;
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
-}
-
-
 /**
  * Starts AT handler on stream "fd'
  * returns 0 on success, -1 on error
@@ -579,9 +829,12 @@ int at_open(int fd, ATUnsolHandler h)
     s_unsolHandler = h;
     s_readerClosed = 0;
 
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
-    sp_response = NULL;
+    sp_cmdHead = sp_cmdTail = NULL;
+    s_cmdCount = 0;
+    s_exclusive = 0;
+#ifdef AT_STATS
+    memset(&s_stats, 0, sizeof(s_stats));
+#endif
 
     pthread_attr_init (&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -609,37 +862,57 @@ void at_close()
 
     s_readerClosed = 1;
 
-    pthread_cond_signal(&s_commandcond);
+    wakeAllCommands();
 
     pthread_mutex_unlock(&s_commandmutex);
 
     /* the reader thread should eventually die */
 }
 
+/**
+ * The response and the first chunk of its arena share one allocation,
+ * so short responses cost a single malloc
+ */
 static ATResponse * at_response_new()
 {
-    return (ATResponse *) calloc(1, sizeof(ATResponse));
+    ATResponse *p_response;
+    struct ATArena *p_arena;
+
+    p_response = (ATResponse *) malloc(sizeof(ATResponse)
+                    + sizeof(struct ATArena) + AT_ARENA_CHUNK);
+    if (p_response == NULL) {
+        return NULL;
+    }
+
+    memset(p_response, 0, sizeof(ATResponse));
+
+    p_arena = (struct ATArena *) (p_response + 1);
+    p_arena->p_next = NULL;
+    p_arena->used = 0;
+    p_arena->size = AT_ARENA_CHUNK;
+    p_response->p_arena = p_arena;
+
+    return p_response;
 }
 
 void at_response_free(ATResponse *p_response)
 {
-    ATLine *p_line;
+    struct ATArena *p_arena;
 
     if (p_response == NULL) return;
 
-    p_line = p_response->p_intermediates;
+    /* all lines live in the arena; the last chunk is part of p_response */
+    p_arena = p_response->p_arena;
 
-    while (p_line != NULL) {
-        ATLine *p_toFree;
+    while (p_arena != (struct ATArena *) (p_response + 1)) {
+        struct ATArena *p_toFree;
 
-        p_toFree = p_line;
-        p_line = p_line->p_next;
+        p_toFree = p_arena;
+        p_arena = p_arena->p_next;
 
-        free(p_toFree->line);
         free(p_toFree);
     }
 
-    free (p_response->finalResponse);
     free (p_response);
 }
 
@@ -662,9 +935,67 @@ static void reverseIntermediates(ATResponse *p_response)
     }
 }
 
+/**
+ * Returns a copy of p_response that can be freed independently
+ * returns NULL if out of memory
+ */
+ATResponse *at_response_dup(const ATResponse *p_response)
+{
+    ATResponse *p_new;
+    ATLine *p_cur;
+
+    p_new = at_response_new();
+    if (p_new == NULL) {
+        return NULL;
+    }
+
+    p_new->success = p_response->success;
+    if (p_response->finalResponse != NULL) {
+        p_new->finalResponse = arenaStrdup(p_new, p_response->finalResponse);
+    }
+
+    for (p_cur = p_response->p_intermediates ; p_cur != NULL
+            ; p_cur = p_cur->p_next) {
+        addIntermediate(p_new, p_cur->line);
+    }
+
+    reverseIntermediates(p_new);
+
+    return p_new;
+}
+
+/**
+ * Waits until the queue can take another command, or until it is empty
+ * if |exclusive|. Exclusive waiters hold back new commands so that they
+ * can't be starved.
+ *
+ * assumes s_commandmutex is held
+ */
+static int waitForSlot(int exclusive)
+{
+    if (exclusive) {
+        s_exclusiveWaiters++;
+    }
+
+    while (s_readerClosed == 0
+            && (s_exclusive
+                || (exclusive ? s_cmdCount > 0
+                              : (s_cmdCount >= s_maxOutstanding
+                                    || s_exclusiveWaiters > 0)))
+    ) {
+        pthread_cond_wait(&s_commandcond, &s_commandmutex);
+    }
+
+    if (exclusive) {
+        s_exclusiveWaiters--;
+    }
+
+    return s_readerClosed > 0 ? AT_ERROR_CHANNEL_CLOSED : 0;
+}
+
 /**
  * Internal send_command implementation
- * Doesn't lock or call the timeout callback
+ * Doesn't lock, wait for a queue slot or call the timeout callback
  *
  * timeoutMsec == 0 means infinite timeout
  */
@@ -675,32 +1006,39 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
 {
     int err = 0;
     struct timespec ts;
+    ATCommand cmd;
 
-    if(sp_response != NULL) {
-        err = AT_ERROR_COMMAND_PENDING;
-        goto error;
+    cmd.p_response = at_response_new();
+
+    if (cmd.p_response == NULL) {
+        return AT_ERROR_GENERIC;
     }
 
+    cmd.type = type;
+    cmd.responsePrefix = responsePrefix;
+    cmd.smsPDU = smspdu;
+    cmd.callControl = isCallControlCommand(command);
+    pthread_cond_init(&cmd.cond, NULL);
+
+    /* queue first: the reader can't see the response before we're holding
+       s_commandmutex again, but it needs to know whose response it is */
+    enqueueCommand(&cmd);
+
     err = writeline (command);
 
     if (err < 0) {
         goto error;
     }
 
-    s_type = type;
-    s_responsePrefix = responsePrefix;
-    s_smsPDU = smspdu;
-    sp_response = at_response_new();
-
     if (timeoutMsec != 0) {
         setTimespecRelative(&ts, timeoutMsec);
     }
 
-    while (sp_response->finalResponse == NULL && s_readerClosed == 0) {
+    while (cmd.p_response->finalResponse == NULL && s_readerClosed == 0) {
         if (timeoutMsec != 0) {
-            err = pthread_cond_timedwait(&s_commandcond, &s_commandmutex, &ts);
+            err = pthread_cond_timedwait(&cmd.cond, &s_commandmutex, &ts);
         } else {
-            err = pthread_cond_wait(&s_commandcond, &s_commandmutex);
+            err = pthread_cond_wait(&cmd.cond, &s_commandmutex);
         }
 
         if (err == ETIMEDOUT) {
@@ -710,14 +1048,14 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
     }
 
     if (pp_outResponse == NULL) {
-        at_response_free(sp_response);
+        at_response_free(cmd.p_response);
     } else {
         /* line reader stores intermediate responses in reverse order */
-        reverseIntermediates(sp_response);
-        *pp_outResponse = sp_response;
+        reverseIntermediates(cmd.p_response);
+        *pp_outResponse = cmd.p_response;
     }
 
-    sp_response = NULL;
+    cmd.p_response = NULL;
 
     if(s_readerClosed > 0) {
         err = AT_ERROR_CHANNEL_CLOSED;
@@ -726,7 +1064,10 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
 
     err = 0;
 error:
-    clearPendingCommand();
+    /* still queued if the write failed, we timed out or the channel closed */
+    dequeueCommand(&cmd);
+    at_response_free(cmd.p_response);
+    pthread_cond_destroy(&cmd.cond);
 
     return err;
 }
@@ -741,27 +1082,33 @@ static int at_send_command_full (const char *command, ATCommandType type,
                     long long timeoutMsec, ATResponse **pp_outResponse)
 {
     int err;
-    bool inEmulator;
+    /* the "> " prompt can't be told apart from other commands' output */
+    int exclusive = (smspdu != NULL);
 
     if (0 != pthread_equal(s_tid_reader, pthread_self())) {
         /* cannot be called from reader thread */
         return AT_ERROR_INVALID_THREAD;
     }
-    inEmulator = isInEmulator();
-    if (inEmulator) {
-        pthread_mutex_lock(&s_writeMutex);
-    }
+
     pthread_mutex_lock(&s_commandmutex);
 
-    err = at_send_command_full_nolock(command, type,
-                    responsePrefix, smspdu,
-                    timeoutMsec, pp_outResponse);
+    err = waitForSlot(exclusive);
 
-    pthread_mutex_unlock(&s_commandmutex);
-    if (inEmulator) {
-        pthread_mutex_unlock(&s_writeMutex);
+    if (err == 0) {
+        s_exclusive = exclusive;
+
+        err = at_send_command_full_nolock(command, type,
+                        responsePrefix, smspdu,
+                        timeoutMsec, pp_outResponse);
+
+        if (exclusive) {
+            s_exclusive = 0;
+            pthread_cond_broadcast(&s_commandcond);
+        }
     }
 
+    pthread_mutex_unlock(&s_commandmutex);
+
     if (err == AT_ERROR_TIMEOUT && s_onTimeout != NULL) {
         s_onTimeout();
     }
@@ -872,6 +1219,194 @@ int at_send_command_multiline (const char *command,
 }
 
 
+/* Returns whether |cmd| failed when sent on its own by an earlier batch */
+static int isBatchAlone(const char *cmd)
+{
+    int found = 0;
+    int i;
+
+    pthread_mutex_lock(&s_commandmutex);
+    for (i = 0 ; i < AT_BATCH_MAX_ALONE && !found ; i++) {
+        found = s_batchAlone[i] != NULL && strcmp(s_batchAlone[i], cmd) == 0;
+    }
+    pthread_mutex_unlock(&s_commandmutex);
+
+    return found;
+}
+
+/* Sends |cmd| on its own in later batches, forgetting the oldest such
+ * command once there are too many */
+static void setBatchAlone(const char *cmd)
+{
+    char *copy;
+
+    if (isBatchAlone(cmd) || (copy = strdup(cmd)) == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_commandmutex);
+    free(s_batchAlone[s_batchAloneNext]);
+    s_batchAlone[s_batchAloneNext] = copy;
+    s_batchAloneNext = (s_batchAloneNext + 1) % AT_BATCH_MAX_ALONE;
+    pthread_mutex_unlock(&s_commandmutex);
+}
+
+/**
+ * Sends |count| commands that produce no intermediate responses, joining
+ * as many as fit into one command line (see V.250 5.2.1): the "AT" prefix
+ * is sent once, basic commands follow each other directly and extended
+ * commands are terminated with ';'.
+ *
+ * A modem stops at the first command in a line that fails without saying
+ * which one it was, so a line that fails is resent one command at a time.
+ * The commands that fail then are sent on their own in later batches,
+ * which keeps the others joined. If every command succeeds on its own,
+ * the modem doesn't understand joined lines and later batches are sent
+ * one command at a time.
+ *
+ * p_success[i] is set to 1 if commands[i] succeeded and 0 otherwise
+ * returns the number of command lines sent, or AT_ERROR_* if the channel
+ * failed
+ */
+int at_send_command_batch (const char * const *commands, int count,
+                                int *p_success)
+{
+    char line[AT_BATCH_MAX_LINE + 1];
+    ATResponse *p_response = NULL;
+    int roundTrips = 0;
+    int failed;
+    int i, j, k;
+    int err;
+
+    for (i = 0 ; i < count ; i = j) {
+        size_t len = 2;
+        int extended = 0;
+
+        memcpy(line, "AT", 2);
+
+        for (j = i ; j < count ; j++) {
+            const char *cmd = commands[j];
+            size_t cmdLen;
+
+            if (strncasecmp(cmd, "AT", 2) == 0) {
+                cmd += 2;
+            }
+            cmdLen = strlen(cmd);
+
+            if (j > i && s_batchUnsupported) {
+                break;
+            }
+
+            if (isBatchAlone(commands[j])) {
+                if (j == i) {
+                    j++;
+                }
+                break;
+            }
+
+            if (len + extended + cmdLen > AT_BATCH_MAX_LINE) {
+                if (j == i) {
+                    /* too long to share a line with anything */
+                    j++;
+                }
+                break;
+            }
+
+            if (extended) {
+                line[len++] = ';';
+            }
+
+            memcpy(line + len, cmd, cmdLen);
+            len += cmdLen;
+            extended = !isalpha((unsigned char) cmd[0]) && cmd[0] != '&';
+        }
+
+        line[len] = '\0';
+
+        if (j == i + 1) {
+            /* nothing to join with, send it verbatim */
+            err = at_send_command(commands[i], &p_response);
+        } else {
+            err = at_send_command(line, &p_response);
+        }
+        roundTrips++;
+
+        if (err < 0) {
+            at_response_free(p_response);
+            return err;
+        }
+
+        if (p_response->success > 0 || j == i + 1) {
+            for (k = i ; k < j ; k++) {
+                p_success[k] = p_response->success > 0;
+            }
+            at_response_free(p_response);
+            p_response = NULL;
+            continue;
+        }
+
+        at_response_free(p_response);
+        p_response = NULL;
+
+        RLOGD("batched command line failed, resending %d commands one by one",
+                j - i);
+
+        failed = 0;
+        for (k = i ; k < j ; k++) {
+            err = at_send_command(commands[k], &p_response);
+            roundTrips++;
+
+            if (err < 0) {
+                at_response_free(p_response);
+                return err;
+            }
+
+            p_success[k] = p_response->success > 0;
+            if (!p_success[k]) {
+                setBatchAlone(commands[k]);
+                failed++;
+            }
+            at_response_free(p_response);
+            p_response = NULL;
+        }
+
+        if (failed == 0) {
+            RLOGI("modem rejects joined command lines, not batching any more");
+            s_batchUnsupported = 1;
+        }
+    }
+
+    return roundTrips;
+}
+
+
+/**
+ * Sets how many commands may be outstanding on the channel at once
+ * Only raise this above 1 if the modem queues commands that arrive
+ * while it is still answering a previous one
+ */
+void at_set_max_outstanding(int count)
+{
+    pthread_mutex_lock(&s_commandmutex);
+
+    s_maxOutstanding = count > 0 ? count : 1;
+
+    pthread_cond_broadcast(&s_commandcond);
+
+    pthread_mutex_unlock(&s_commandmutex);
+}
+
+
+#ifdef AT_STATS
+void at_get_stats(ATChannelStats *p_stats)
+{
+    pthread_mutex_lock(&s_commandmutex);
+    *p_stats = s_stats;
+    pthread_mutex_unlock(&s_commandmutex);
+}
+#endif
+
+
 /** This callback is invoked on the command thread */
 void at_set_on_timeout(void (*onTimeout)(void))
 {
@@ -900,18 +1435,23 @@ int at_handshake()
 {
     int i;
     int err = 0;
-    bool inEmulator;
 
     if (0 != pthread_equal(s_tid_reader, pthread_self())) {
         /* cannot be called from reader thread */
         return AT_ERROR_INVALID_THREAD;
     }
-    inEmulator = isInEmulator();
-    if (inEmulator) {
-        pthread_mutex_lock(&s_writeMutex);
-    }
+
     pthread_mutex_lock(&s_commandmutex);
 
+    err = waitForSlot(1);
+
+    if (err < 0) {
+        pthread_mutex_unlock(&s_commandmutex);
+        return err;
+    }
+
+    s_exclusive = 1;
+
     for (i = 0 ; i < HANDSHAKE_RETRY_COUNT ; i++) {
         /* some stacks start with verbose off */
         err = at_send_command_full_nolock ("ATE0Q0V1", NO_RESULT,
@@ -929,10 +1469,10 @@ int at_handshake()
         sleepMsec(HANDSHAKE_TIMEOUT_MSEC);
     }
 
+    s_exclusive = 0;
+    pthread_cond_broadcast(&s_commandcond);
+
     pthread_mutex_unlock(&s_commandmutex);
-    if (inEmulator) {
-        pthread_mutex_unlock(&s_writeMutex);
-    }
 
     return err;
 }
@@ -57,12 +57,15 @@ typedef struct ATLine  {
     char *line;
 } ATLine;
 
+struct ATArena;
+
 /** Free this with at_response_free() */
 typedef struct {
     int success;              /* true if final response indicates
                                     success (eg "OK") */
     char *finalResponse;      /* eg OK, ERROR */
     ATLine  *p_intermediates; /* any intermediate responses */
+    struct ATArena *p_arena;  /* backing store for the lines above */
 } ATResponse;
 
 /**
@@ -87,6 +90,28 @@ void at_set_on_timeout(void (*onTimeout)(void));
    channel is already closed */
 void at_set_on_reader_closed(void (*onClose)(void));
 
+/* Number of commands that may be awaiting a response at the same time.
+   Defaults to 1; commands from other threads are written to the channel
+   while earlier ones are still outstanding and their responses are
+   matched in order. SMS commands and the handshake always run alone. */
+void at_set_max_outstanding(int count);
+
+/* define AT_STATS to count AT channel traffic, for benchmarks. It costs
+   the reader thread a lock and a clock read per read() */
+#ifdef AT_STATS
+typedef struct {
+    unsigned long commands;     /* command lines written */
+    unsigned long responses;    /* final responses matched to a command */
+    unsigned long unsolicited;  /* lines passed to the unsolicited handler */
+    unsigned long reads;        /* read() calls that returned data */
+    unsigned long long bytesRead;
+    long long readerCpuUsec;    /* reader thread CPU time, as of its last read */
+} ATChannelStats;
+
+/* Counters since at_open() */
+void at_get_stats(ATChannelStats *p_stats);
+#endif /* AT_STATS */
+
 int at_send_command_singleline (const char *command,
                                 const char *responsePrefix,
                                  ATResponse **pp_outResponse);
@@ -107,8 +132,17 @@ int at_send_command_sms (const char *command, const char *pdu,
                             const char *responsePrefix,
                             ATResponse **pp_outResponse);
 
+/* Sends commands without intermediate responses, several per command line
+   where possible. p_success[i] is set to whether commands[i] succeeded.
+   Returns the number of command lines sent or AT_ERROR_* */
+int at_send_command_batch (const char * const *commands, int count,
+                                int *p_success);
+
 void at_response_free(ATResponse *p_response);
 
+/* Deep copy of p_response. Free with at_response_free() */
+ATResponse *at_response_dup(const ATResponse *p_response);
+
 typedef enum {
     CME_ERROR_NON_CME = -1,
     CME_SUCCESS = 0,
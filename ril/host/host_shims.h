@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2006 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Included ahead of every source file of test-ril-bench on the host,
+ * where libc has neither __unused nor strlcpy(), see host_shims.c.
+ */
+#ifndef HOST_SHIMS_H
+#define HOST_SHIMS_H
+
+#include <stddef.h>
+
+#ifndef __unused
+#define __unused  __attribute__((__unused__))
+#endif
+
+size_t strlcpy(char *dst, const char *src, size_t size);
+size_t strlcat(char *dst, const char *src, size_t size);
+
+#endif /* HOST_SHIMS_H */
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2006 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for libqemu_pipe, for test-ril-bench. There is no
+ * emulator to open a pipe to.
+ */
+#ifndef HOST_QEMU_PIPE_H
+#define HOST_QEMU_PIPE_H
+
+#include <errno.h>
+
+static inline int qemu_pipe_open(const char *pipeName __attribute__((unused)))
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* HOST_QEMU_PIPE_H */
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2006 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for bionic's system properties, for test-ril-bench. No
+ * property is ever set, so isInEmulator() is false on the host.
+ */
+#ifndef HOST_SYS_SYSTEM_PROPERTIES_H
+#define HOST_SYS_SYSTEM_PROPERTIES_H
+
+#ifndef PROP_VALUE_MAX
+#define PROP_VALUE_MAX  92
+#endif
+
+static inline int __system_property_get(const char *name __attribute__((unused)),
+                                        char *value)
+{
+    value[0] = '\0';
+    return 0;
+}
+
+#endif /* HOST_SYS_SYSTEM_PROPERTIES_H */
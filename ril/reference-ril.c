@@ -27,6 +27,7 @@
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <alloca.h>
 #include "atchannel.h"
@@ -34,11 +35,14 @@
 #include "misc.h"
 #include <getopt.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <cutils/properties.h>
 #include <cutils/sockets.h>
 #include <termios.h>
 #include <qemu_pipe.h>
 #include <sys/wait.h>
+#include <poll.h>
+#include <time.h>
 #include <stdbool.h>
 #include <net/if.h>
 #include <netinet/in.h>
@@ -51,6 +55,8 @@
 static void *noopRemoveWarning( void *a ) { return a; }
 #define RIL_UNUSED_PARM(a) noopRemoveWarning((void *)&(a));
 
+#define NUM_ELEMS(x) (sizeof(x)/sizeof((x)[0]))
+
 #define MAX_AT_RESPONSE 0x1000
 
 /* pathname returned from RIL_REQUEST_SETUP_DATA_CALL / RIL_REQUEST_SETUP_DEFAULT_PDP */
@@ -226,18 +232,39 @@ static pthread_cond_t s_state_cond = PTHREAD_COND_INITIALIZER;
 static int s_port = -1;
 static const char * s_device_path = NULL;
 static int          s_device_socket = 0;
+static int          s_device_fd = -1;   /* connected channel given with -f */
 
 /* trigger change to this with s_state_cond */
 static int s_closed = 0;
 
+/* Each at_open() starts a new channel generation. initializeCallback()
+   only configures the generation it was scheduled for, and reports back
+   through |s_initializedGeneration| (also under s_state_mutex) */
+static int s_channelGeneration = 0;
+static int s_initializedGeneration = 0;
+
+/* Opening the AT channel is retried with exponential backoff */
+#define RECONNECT_MIN_MSEC 50
+#define RECONNECT_MAX_MSEC 10000
+
+/* time from losing the AT channel until the new one was configured */
+static int s_reconnectCount = 0;
+static long long s_reconnectTotalMsec = 0;
+static long long s_reconnectMaxMsec = 0;
+
 static int sFD;     /* file desc of AT channel */
 static char sATBuffer[MAX_AT_RESPONSE+1];
 static char *sATBufferCur = NULL;
 
-static const struct timeval TIMEVAL_SIMPOLL = {1,0};
+#ifdef POLL_CALL_STATE
 static const struct timeval TIMEVAL_CALLSTATEPOLL = {0,500000};
+#endif
 static const struct timeval TIMEVAL_0 = {0,0};
 
+/* The emulated modem answers commands in the order it reads them, so
+   requests from different threads may share the channel */
+#define EMULATOR_MAX_OUTSTANDING_COMMANDS 4
+
 static int s_ims_registered  = 0;        // 0==unregistered
 static int s_ims_services    = 1;        // & 0x1 == sms over ims supported
 static int s_ims_format    = 1;          // FORMAT_3GPP(1) vs FORMAT_3GPP2(2);
@@ -266,6 +293,472 @@ static int s_mnc = 0;
 static int s_lac = 0;
 static int s_cid = 0;
 
+#define MAX_DATA_CALLS 16
+
+/* One PDP context, as reported by AT+CGACT? and AT+CGDCONT? */
+typedef struct {
+    int cid;
+    int active;
+    int defined;                /* listed by AT+CGDCONT? */
+    char type[16];
+    char address[64];
+} DataCall;
+
+/*
+ * The modem's PDP contexts are only re-read after +CGEV: (or one of the
+ * events WORKAROUND_FAKE_CGEV treats like it), a data call setup or a
+ * radio state change. The last contents are kept when the table is
+ * invalidated, so that unchanged lists aren't reported again.
+ */
+static pthread_mutex_t s_dataCallMutex = PTHREAD_MUTEX_INITIALIZER;
+static DataCall s_dataCalls[MAX_DATA_CALLS];
+static int s_dataCallCount = -1;    /* -1 until first read */
+static int s_dataCallsValid = 0;
+static unsigned s_dataCallGeneration = 0;
+
+static void invalidateDataCalls()
+{
+    pthread_mutex_lock(&s_dataCallMutex);
+    s_dataCallsValid = 0;
+    s_dataCallGeneration++;
+    pthread_mutex_unlock(&s_dataCallMutex);
+}
+
+/* /dev/qmi status is checked with growing intervals until it is up */
+#define QMI_UP_TIMEOUT_MSEC 10000
+#define QMI_POLL_MIN_MSEC 10
+#define QMI_POLL_MAX_MSEC 500
+
+/*
+ * Answers to the status queries the framework polls most often. An entry
+ * is filled from the modem's answer, and is dropped when something changes
+ * the state it describes or once it is older than |maxAgeMsec|.
+ * |generation| changes whenever an entry is dropped, so that an answer to a
+ * query that raced with the change isn't stored.
+ */
+typedef enum {
+    QUERY_CSQ,
+    QUERY_CREG,
+    QUERY_CGREG,
+    QUERY_COPS,
+    QUERY_CLCC,
+    QUERY_COUNT
+} CachedQuery;
+
+typedef struct {
+    const char *command;
+    const char *prefix;
+    int multiline;
+    long long maxAgeMsec;
+    ATResponse *p_response;     /* NULL if nothing is cached */
+    long long updatedMsec;
+    unsigned generation;
+} QueryCacheEntry;
+
+static pthread_mutex_t s_queryCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static QueryCacheEntry s_queryCache[QUERY_COUNT] = {
+    /* QUERY_CSQ: signal changes aren't reported, keep this short */
+    { "AT+CSQ", "+CSQ:", 0, 2000, NULL, 0, 0 },
+    /* QUERY_CREG, QUERY_CGREG: dropped on +CREG: and +CGREG: */
+    { "AT+CREG?", "+CREG:", 0, 30000, NULL, 0, 0 },
+    { "AT+CGREG?", "+CGREG:", 0, 30000, NULL, 0, 0 },
+    /* QUERY_COPS: dropped on every registration report */
+    { "AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?", "+COPS:",
+        1, 30000, NULL, 0, 0 },
+    /* QUERY_CLCC: only kept while no call is changing state */
+    { "AT+CLCC", "+CLCC:", 1, 1000, NULL, 0, 0 },
+};
+
+static long long nowMsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void sleepMsec(long long msec)
+{
+    struct timespec ts;
+    int err;
+
+    ts.tv_sec = (msec / 1000);
+    ts.tv_nsec = (msec % 1000) * 1000 * 1000;
+
+    do {
+        err = nanosleep (&ts, &ts);
+    } while (err < 0 && errno == EINTR);
+}
+
+/** assumes s_queryCacheMutex is held */
+static void dropQueryLocked(CachedQuery query)
+{
+    QueryCacheEntry *p_entry = &s_queryCache[query];
+
+    at_response_free(p_entry->p_response);
+    p_entry->p_response = NULL;
+    p_entry->generation++;
+}
+
+static void invalidateQuery(CachedQuery query)
+{
+    pthread_mutex_lock(&s_queryCacheMutex);
+    dropQueryLocked(query);
+    pthread_mutex_unlock(&s_queryCacheMutex);
+}
+
+static void invalidateAllQueries()
+{
+    int i;
+
+    pthread_mutex_lock(&s_queryCacheMutex);
+    for (i = 0 ; i < QUERY_COUNT ; i++) {
+        dropQueryLocked((CachedQuery) i);
+    }
+    pthread_mutex_unlock(&s_queryCacheMutex);
+}
+
+/**
+ * Sends one of the cached queries, or answers it from the cache while the
+ * cached answer is fresh. The response belongs to the caller, who may
+ * modify it while parsing, and must be freed with at_response_free
+ */
+static int sendCachedQuery(CachedQuery query, ATResponse **pp_outResponse)
+{
+    QueryCacheEntry *p_entry = &s_queryCache[query];
+    ATResponse *p_copy = NULL;
+    unsigned generation;
+    int err;
+
+    pthread_mutex_lock(&s_queryCacheMutex);
+
+    if (p_entry->p_response != NULL
+            && nowMsec() - p_entry->updatedMsec <= p_entry->maxAgeMsec) {
+        p_copy = at_response_dup(p_entry->p_response);
+    }
+    generation = p_entry->generation;
+
+    pthread_mutex_unlock(&s_queryCacheMutex);
+
+    if (p_copy != NULL) {
+        *pp_outResponse = p_copy;
+        return 0;
+    }
+
+    if (p_entry->multiline) {
+        err = at_send_command_multiline(p_entry->command, p_entry->prefix,
+                                        pp_outResponse);
+    } else {
+        err = at_send_command_singleline(p_entry->command, p_entry->prefix,
+                                        pp_outResponse);
+    }
+
+    if (err != 0 || (*pp_outResponse)->success == 0) {
+        return err;
+    }
+
+    p_copy = at_response_dup(*pp_outResponse);
+
+    pthread_mutex_lock(&s_queryCacheMutex);
+
+    if (p_copy != NULL && generation == p_entry->generation) {
+        at_response_free(p_entry->p_response);
+        p_entry->p_response = p_copy;
+        p_entry->updatedMsec = nowMsec();
+        p_copy = NULL;
+    }
+
+    pthread_mutex_unlock(&s_queryCacheMutex);
+
+    at_response_free(p_copy);
+
+    return 0;
+}
+
+/**
+ * Called on the reader thread with an unsolicited +CREG: or +CGREG:
+ * Unsolicited reports may only carry "<stat>", so they can't stand in for
+ * the solicited answer; they just drop it, along with the operator, which
+ * may have changed with the registration.
+ */
+static void invalidateRegistration(const char *s)
+{
+    CachedQuery query;
+
+    query = strStartsWith(s, "+CREG:") ? QUERY_CREG : QUERY_CGREG;
+
+    pthread_mutex_lock(&s_queryCacheMutex);
+    dropQueryLocked(query);
+    dropQueryLocked(QUERY_COPS);
+    pthread_mutex_unlock(&s_queryCacheMutex);
+}
+
+
+/*
+ * SIM and call state are reported by the modem (+CPIN:, %CSTAT:, RING,
+ * +CCWA, NO CARRIER, %CPI:), so timed polls are only a fallback for the
+ * states nothing is reported for, and back off while nothing changes.
+ * Every report or poll that starts a new chain bumps |generation|; a timed
+ * poll scheduled by an older chain sees that and does nothing.
+ */
+typedef struct {
+    int generation;
+    long long delayMsec;
+    long long minMsec;
+    long long maxMsec;
+} PollChain;
+
+static pthread_mutex_t s_pollMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static PollChain s_simPoll = { 0, 500, 500, 8000 };
+/* dialing and alerting calls are polled to see the far end answer, don't
+   let that take much longer than a second */
+static PollChain s_callPoll = { 0, 250, 250, 1000 };
+
+/* the index and state of the calls seen by the last call list poll */
+static unsigned s_lastCallList = 0;
+
+/* set once the modem has sent %CPI call progress reports */
+static int s_callProgressReports = 0;
+
+/**
+ * Cancels any timed poll of |p_chain| and resets its backoff
+ * returns the parameter for the poll that starts the new chain
+ */
+static void *restartPoll(PollChain *p_chain)
+{
+    int generation;
+
+    pthread_mutex_lock(&s_pollMutex);
+    generation = ++p_chain->generation;
+    p_chain->delayMsec = p_chain->minMsec;
+    pthread_mutex_unlock(&s_pollMutex);
+
+    return (void *) (intptr_t) generation;
+}
+
+/**
+ * Records the calls seen by a call list poll, as a hash of their index and
+ * state, returns 1 if they differ from the previous poll
+ */
+static int callListChanged(unsigned callList)
+{
+    int changed;
+
+    pthread_mutex_lock(&s_pollMutex);
+    changed = callList != s_lastCallList;
+    s_lastCallList = callList;
+    pthread_mutex_unlock(&s_pollMutex);
+
+    return changed;
+}
+
+/** returns 1 if |param| was handed out for the current chain */
+static int isCurrentPoll(PollChain *p_chain, void *param)
+{
+    int ret;
+
+    pthread_mutex_lock(&s_pollMutex);
+    ret = (intptr_t) param == p_chain->generation;
+    pthread_mutex_unlock(&s_pollMutex);
+
+    return ret;
+}
+
+/**
+ * Schedules |callback| after the current backoff delay, which then doubles
+ * Any other timed poll of |p_chain| is cancelled
+ */
+static void schedulePoll(PollChain *p_chain, RIL_TimedCallback callback)
+{
+    struct timeval tv;
+    int generation;
+
+    pthread_mutex_lock(&s_pollMutex);
+
+    generation = ++p_chain->generation;
+    tv.tv_sec = p_chain->delayMsec / 1000;
+    tv.tv_usec = (p_chain->delayMsec % 1000) * 1000;
+
+    p_chain->delayMsec *= 2;
+    if (p_chain->delayMsec > p_chain->maxMsec) {
+        p_chain->delayMsec = p_chain->maxMsec;
+    }
+
+    pthread_mutex_unlock(&s_pollMutex);
+
+    RIL_requestTimedCallback(callback, (void *) (intptr_t) generation, &tv);
+}
+
+/*
+ * RIL_UNSOL_CELL_INFO_LIST is built from the registration, operator and
+ * signal strength answers the framework already polls for, so reporting
+ * costs no AT traffic. A rate of 0 reports whenever one of those answers
+ * changes the cell info; any other rate checks for a change that often.
+ * INT_MAX turns reporting off.
+ */
+static pthread_mutex_t s_cellInfoMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static PollChain s_cellInfoPoll = { 0, INT_MAX, INT_MAX, INT_MAX };
+
+/* last +CSQ: answer, in RIL_SignalStrength_v10 order */
+#define SIGNAL_STRENGTH_INTS  (sizeof(RIL_SignalStrength_v10) / sizeof(int))
+static int s_signalStrength[SIGNAL_STRENGTH_INTS];
+static int s_signalStrengthValid = 0;
+
+static RIL_CellInfo_v12 s_lastCellInfo;
+static int s_cellInfoReported = 0;
+
+/** Fills in the serving cell for the current technology, without a timestamp */
+static void buildCellInfo(RIL_CellInfo_v12 *p_ci)
+{
+    RIL_SignalStrength_v10 signal;
+
+    memset(p_ci, 0, sizeof(*p_ci));
+    memset(&signal, 0, sizeof(signal));
+
+    pthread_mutex_lock(&s_cellInfoMutex);
+    if (s_signalStrengthValid) {
+        memcpy(&signal, s_signalStrength, sizeof(signal));
+    } else {
+        signal.GW_SignalStrength.signalStrength = 10;
+        signal.LTE_SignalStrength.signalStrength = 99;
+        signal.LTE_SignalStrength.rsrp = INT_MAX;
+        signal.LTE_SignalStrength.rsrq = INT_MAX;
+        signal.LTE_SignalStrength.rssnr = INT_MAX;
+        signal.LTE_SignalStrength.cqi = INT_MAX;
+    }
+    pthread_mutex_unlock(&s_cellInfoMutex);
+
+    p_ci->registered = 1;
+    p_ci->timeStampType = RIL_TIMESTAMP_TYPE_MODEM;
+
+    switch (TECH_BIT(sMdmInfo)) {
+        case MDM_LTE:
+            p_ci->cellInfoType = RIL_CELL_INFO_TYPE_LTE;
+            p_ci->CellInfo.lte.cellIdentityLte.mcc = s_mcc;
+            p_ci->CellInfo.lte.cellIdentityLte.mnc = s_mnc;
+            p_ci->CellInfo.lte.cellIdentityLte.ci = s_cid;
+            p_ci->CellInfo.lte.cellIdentityLte.pci = 0;
+            p_ci->CellInfo.lte.cellIdentityLte.tac = s_lac;
+            p_ci->CellInfo.lte.cellIdentityLte.earfcn = 0;
+            p_ci->CellInfo.lte.signalStrengthLte = signal.LTE_SignalStrength;
+            p_ci->CellInfo.lte.signalStrengthLte.timingAdvance = INT_MAX;
+            break;
+
+        case MDM_WCDMA:
+            p_ci->cellInfoType = RIL_CELL_INFO_TYPE_WCDMA;
+            p_ci->CellInfo.wcdma.cellIdentityWcdma.mcc = s_mcc;
+            p_ci->CellInfo.wcdma.cellIdentityWcdma.mnc = s_mnc;
+            p_ci->CellInfo.wcdma.cellIdentityWcdma.lac = s_lac;
+            p_ci->CellInfo.wcdma.cellIdentityWcdma.cid = s_cid;
+            p_ci->CellInfo.wcdma.cellIdentityWcdma.psc = 0;
+            p_ci->CellInfo.wcdma.cellIdentityWcdma.uarfcn = 0;
+            p_ci->CellInfo.wcdma.signalStrengthWcdma.signalStrength =
+                    signal.GW_SignalStrength.signalStrength;
+            p_ci->CellInfo.wcdma.signalStrengthWcdma.bitErrorRate =
+                    signal.GW_SignalStrength.bitErrorRate;
+            break;
+
+        default:
+            /* there's no cached CDMA cell, report it as GSM like before */
+            p_ci->cellInfoType = RIL_CELL_INFO_TYPE_GSM;
+            p_ci->CellInfo.gsm.cellIdentityGsm.mcc = s_mcc;
+            p_ci->CellInfo.gsm.cellIdentityGsm.mnc = s_mnc;
+            p_ci->CellInfo.gsm.cellIdentityGsm.lac = s_lac;
+            p_ci->CellInfo.gsm.cellIdentityGsm.cid = s_cid;
+            p_ci->CellInfo.gsm.cellIdentityGsm.arfcn = 0; // unknown
+            p_ci->CellInfo.gsm.cellIdentityGsm.bsic = 0xFF; // unknown
+            p_ci->CellInfo.gsm.signalStrengthGsm.signalStrength =
+                    signal.GW_SignalStrength.signalStrength;
+            p_ci->CellInfo.gsm.signalStrengthGsm.bitErrorRate =
+                    signal.GW_SignalStrength.bitErrorRate;
+            p_ci->CellInfo.gsm.signalStrengthGsm.timingAdvance = INT_MAX;
+            break;
+    }
+}
+
+/** Sends RIL_UNSOL_CELL_INFO_LIST unless it would repeat the last one */
+static void reportCellInfoIfChanged()
+{
+    RIL_CellInfo_v12 ci;
+    int changed;
+
+    if (s_cell_info_rate_ms == INT_MAX) {
+        return;
+    }
+
+    if (sState != RADIO_STATE_ON) {
+        /* report the cell again once the radio is back on */
+        pthread_mutex_lock(&s_cellInfoMutex);
+        s_cellInfoReported = 0;
+        pthread_mutex_unlock(&s_cellInfoMutex);
+        return;
+    }
+
+    buildCellInfo(&ci);
+
+    pthread_mutex_lock(&s_cellInfoMutex);
+    changed = !s_cellInfoReported
+            || memcmp(&ci, &s_lastCellInfo, sizeof(ci)) != 0;
+    s_lastCellInfo = ci;
+    s_cellInfoReported = 1;
+    pthread_mutex_unlock(&s_cellInfoMutex);
+
+    if (changed) {
+        ci.timeStamp = ril_nano_time();
+        RIL_onUnsolicitedResponse(RIL_UNSOL_CELL_INFO_LIST, &ci, sizeof(ci));
+    }
+}
+
+/** Called whenever one of the answers the cell info is built from is parsed */
+static void onCellInfoInput()
+{
+    if (s_cell_info_rate_ms == 0) {
+        reportCellInfoIfChanged();
+    }
+}
+
+static void onCellInfoPoll(void *param)
+{
+    if (!isCurrentPoll(&s_cellInfoPoll, param)) {
+        return;
+    }
+
+    reportCellInfoIfChanged();
+    schedulePoll(&s_cellInfoPoll, onCellInfoPoll);
+}
+
+/** Forgets the last report and restarts reporting at s_cell_info_rate_ms */
+static void restartCellInfoReports()
+{
+    int rate = s_cell_info_rate_ms;
+
+    pthread_mutex_lock(&s_cellInfoMutex);
+    s_cellInfoReported = 0;
+    pthread_mutex_unlock(&s_cellInfoMutex);
+
+    pthread_mutex_lock(&s_pollMutex);
+    s_cellInfoPoll.minMsec = rate;
+    s_cellInfoPoll.maxMsec = rate;
+    pthread_mutex_unlock(&s_pollMutex);
+
+    /* cancels the periodic report, if any */
+    restartPoll(&s_cellInfoPoll);
+
+    if (rate == INT_MAX) {
+        return;
+    }
+
+    reportCellInfoIfChanged();
+
+    if (rate > 0) {
+        schedulePoll(&s_cellInfoPoll, onCellInfoPoll);
+    }
+}
+
 static void pollSIMState (void *param);
 static void setRadioState(RIL_RadioState newState);
 static void setRadioTechnology(ModemInfo *mdm, int newtech);
@@ -445,7 +938,7 @@ static void onRadioPowerOn()
     at_send_command("AT%CTZV=1", NULL);
 #endif
 
-    pollSIMState(NULL);
+    pollSIMState(restartPoll(&s_simPoll));
 }
 
 /** do post- SIM ready initialization */
@@ -523,6 +1016,7 @@ static void requestOrSendDataCallList(RIL_Token *t);
 
 static void onDataCallListChanged(void *param __unused)
 {
+    invalidateDataCalls();
     requestOrSendDataCallList(NULL);
 }
 
@@ -597,79 +1091,55 @@ static const char* getRadioInterfaceName(bool hasWifi)
     return hasWifi ? PPP_TTY_PATH_RADIO0 : PPP_TTY_PATH_ETH0;
 }
 
-static void requestOrSendDataCallList(RIL_Token *t)
+/**
+ * Reads the PDP contexts from the modem into |calls|
+ * returns their number, or -1 on error
+ */
+static int queryDataCalls(DataCall *calls)
 {
     ATResponse *p_response;
     ATLine *p_cur;
     int err;
     int n = 0;
+    int i;
     char *out;
-    char propValue[PROP_VALUE_MAX];
-    bool hasWifi = hasWifiCapability();
-    const char* radioInterfaceName = getRadioInterfaceName(hasWifi);
 
     err = at_send_command_multiline ("AT+CGACT?", "+CGACT:", &p_response);
     if (err != 0 || p_response->success == 0) {
-        if (t != NULL)
-            RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        else
-            RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-                                      NULL, 0);
-        return;
-    }
-
-    for (p_cur = p_response->p_intermediates; p_cur != NULL;
-         p_cur = p_cur->p_next)
-        n++;
-
-    RIL_Data_Call_Response_v11 *responses =
-        alloca(n * sizeof(RIL_Data_Call_Response_v11));
-
-    int i;
-    for (i = 0; i < n; i++) {
-        responses[i].status = -1;
-        responses[i].suggestedRetryTime = -1;
-        responses[i].cid = -1;
-        responses[i].active = -1;
-        responses[i].type = "";
-        responses[i].ifname = "";
-        responses[i].addresses = "";
-        responses[i].dnses = "";
-        responses[i].gateways = "";
-        responses[i].pcscf = "";
-        responses[i].mtu = 0;
+        goto error;
     }
 
-    RIL_Data_Call_Response_v11 *response = responses;
     for (p_cur = p_response->p_intermediates; p_cur != NULL;
          p_cur = p_cur->p_next) {
         char *line = p_cur->line;
 
+        if (n == MAX_DATA_CALLS) {
+            RLOGW("ignoring PDP contexts beyond the first %d", MAX_DATA_CALLS);
+            break;
+        }
+
+        memset(&calls[n], 0, sizeof(calls[n]));
+
         err = at_tok_start(&line);
         if (err < 0)
             goto error;
 
-        err = at_tok_nextint(&line, &response->cid);
+        err = at_tok_nextint(&line, &calls[n].cid);
         if (err < 0)
             goto error;
 
-        err = at_tok_nextint(&line, &response->active);
+        err = at_tok_nextint(&line, &calls[n].active);
         if (err < 0)
             goto error;
 
-        response++;
+        n++;
     }
 
     at_response_free(p_response);
 
     err = at_send_command_multiline ("AT+CGDCONT?", "+CGDCONT:", &p_response);
     if (err != 0 || p_response->success == 0) {
-        if (t != NULL)
-            RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        else
-            RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-                                      NULL, 0);
-        return;
+        goto error;
     }
 
     for (p_cur = p_response->p_intermediates; p_cur != NULL;
@@ -686,43 +1156,140 @@ static void requestOrSendDataCallList(RIL_Token *t)
             goto error;
 
         for (i = 0; i < n; i++) {
-            if (responses[i].cid == cid)
+            if (calls[i].cid == cid)
                 break;
         }
 
-        if (i >= n) {
-            /* details for a context we didn't hear about in the last request */
+        if (i >= n) {
+            /* details for a context we didn't hear about in the last request */
+            continue;
+        }
+
+        calls[i].defined = 1;
+
+        // type
+        err = at_tok_nextstr(&line, &out);
+        if (err < 0)
+            goto error;
+
+        strlcpy(calls[i].type, out, sizeof(calls[i].type));
+
+        // APN ignored for v5
+        err = at_tok_nextstr(&line, &out);
+        if (err < 0)
+            goto error;
+
+        err = at_tok_nextstr(&line, &out);
+        if (err < 0)
+            goto error;
+
+        strlcpy(calls[i].address, out, sizeof(calls[i].address));
+    }
+
+    at_response_free(p_response);
+    return n;
+
+error:
+    at_response_free(p_response);
+    return -1;
+}
+
+/**
+ * Copies the PDP contexts into |calls|, reading them from the modem only
+ * if the table has been invalidated. *p_changed is set if they differ
+ * from the last ones read.
+ * returns their number, or -1 on error
+ */
+static int getDataCalls(DataCall *calls, int *p_changed)
+{
+    unsigned generation;
+    int n;
+
+    pthread_mutex_lock(&s_dataCallMutex);
+
+    if (s_dataCallsValid) {
+        n = s_dataCallCount;
+        memcpy(calls, s_dataCalls, n * sizeof(DataCall));
+        pthread_mutex_unlock(&s_dataCallMutex);
+        *p_changed = 0;
+        return n;
+    }
+    generation = s_dataCallGeneration;
+
+    pthread_mutex_unlock(&s_dataCallMutex);
+
+    n = queryDataCalls(calls);
+    if (n < 0) {
+        return n;
+    }
+
+    pthread_mutex_lock(&s_dataCallMutex);
+
+    *p_changed = n != s_dataCallCount
+                    || memcmp(calls, s_dataCalls, n * sizeof(DataCall)) != 0;
+
+    if (generation == s_dataCallGeneration) {
+        memcpy(s_dataCalls, calls, n * sizeof(DataCall));
+        s_dataCallCount = n;
+        s_dataCallsValid = 1;
+    }
+
+    pthread_mutex_unlock(&s_dataCallMutex);
+
+    return n;
+}
+
+static void requestOrSendDataCallList(RIL_Token *t)
+{
+    DataCall calls[MAX_DATA_CALLS];
+    int changed;
+    int n;
+    char propValue[PROP_VALUE_MAX];
+    bool hasWifi = hasWifiCapability();
+    const char* radioInterfaceName = getRadioInterfaceName(hasWifi);
+
+    n = getDataCalls(calls, &changed);
+    if (n < 0) {
+        if (t != NULL)
+            RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        else
+            RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
+                                      NULL, 0);
+        return;
+    }
+
+    if (t == NULL && !changed) {
+        /* the event didn't change any context, nothing to report */
+        return;
+    }
+
+    RIL_Data_Call_Response_v11 *responses =
+        alloca(n * sizeof(RIL_Data_Call_Response_v11));
+
+    int i;
+    for (i = 0; i < n; i++) {
+        responses[i].status = -1;
+        responses[i].suggestedRetryTime = -1;
+        responses[i].cid = calls[i].cid;
+        responses[i].active = calls[i].active;
+        responses[i].type = "";
+        responses[i].ifname = "";
+        responses[i].addresses = "";
+        responses[i].dnses = "";
+        responses[i].gateways = "";
+        responses[i].pcscf = "";
+        responses[i].mtu = 0;
+
+        if (!calls[i].defined) {
             continue;
         }
 
         // Assume no error
         responses[i].status = 0;
 
-        // type
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0)
-            goto error;
-
-        int type_size = strlen(out) + 1;
-        responses[i].type = alloca(type_size);
-        strlcpy(responses[i].type, out, type_size);
-
-        // APN ignored for v5
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0)
-            goto error;
-
-        int ifname_size = strlen(radioInterfaceName) + 1;
-        responses[i].ifname = alloca(ifname_size);
-        strlcpy(responses[i].ifname, radioInterfaceName, ifname_size);
-
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0)
-            goto error;
-
-        int addresses_size = strlen(out) + 1;
-        responses[i].addresses = alloca(addresses_size);
-        strlcpy(responses[i].addresses, out, addresses_size);
+        responses[i].type = calls[i].type;
+        responses[i].ifname = (char *) radioInterfaceName;
+        responses[i].addresses = calls[i].address;
 
         if (isInEmulator()) {
             /* We are in the emulator - the dns servers are listed
@@ -779,8 +1346,6 @@ static void requestOrSendDataCallList(RIL_Token *t)
         }
     }
 
-    at_response_free(p_response);
-
     if (t != NULL)
         RIL_onRequestComplete(*t, RIL_E_SUCCESS, responses,
                               n * sizeof(RIL_Data_Call_Response_v11));
@@ -788,17 +1353,6 @@ static void requestOrSendDataCallList(RIL_Token *t)
         RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
                                   responses,
                                   n * sizeof(RIL_Data_Call_Response_v11));
-
-    return;
-
-error:
-    if (t != NULL)
-        RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    else
-        RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-                                  NULL, 0);
-
-    at_response_free(p_response);
 }
 
 static void setNetworkSelectionAutomatic(RIL_Token t)
@@ -859,8 +1413,13 @@ error:
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
 }
 
-static void sendCallStateChanged(void *param __unused)
+static void sendCallStateChanged(void *param)
 {
+    if (!isCurrentPoll(&s_callPoll, param)) {
+        // a call event or a newer poll superseded this one
+        return;
+    }
+
     RIL_onUnsolicitedResponse (
         RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
         NULL, 0);
@@ -877,6 +1436,8 @@ static void requestGetCurrentCalls(void *data __unused, size_t datalen __unused,
     RIL_Call **pp_calls;
     int i;
     int needRepoll = 0;
+    int needPoll = 0;
+    unsigned callList = 5381;
 
 #ifdef WORKAROUND_ERRONEOUS_ANSWER
     int prevIncomingOrWaitingLine;
@@ -885,10 +1446,11 @@ static void requestGetCurrentCalls(void *data __unused, size_t datalen __unused,
     s_incomingOrWaitingLine = -1;
 #endif /*WORKAROUND_ERRONEOUS_ANSWER*/
 
-    err = at_send_command_multiline ("AT+CLCC", "+CLCC:", &p_response);
+    err = sendCachedQuery(QUERY_CLCC, &p_response);
 
     if (err != 0 || p_response->success == 0) {
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        at_response_free(p_response);
         return;
     }
 
@@ -935,9 +1497,26 @@ static void requestGetCurrentCalls(void *data __unused, size_t datalen __unused,
             needRepoll = 1;
         }
 
+        /* incoming and waiting calls end with NO CARRIER, but unless the
+           modem sends %CPI nothing says when the far end answers */
+        if ((p_calls[countValidCalls].state == RIL_CALL_DIALING
+                || p_calls[countValidCalls].state == RIL_CALL_ALERTING)
+            && !s_callProgressReports
+        ) {
+            needPoll = 1;
+        }
+
+        callList = callList * 33 + (p_calls[countValidCalls].index << 3)
+                + p_calls[countValidCalls].state;
+
         countValidCalls++;
     }
 
+    if (needRepoll) {
+        /* calls are changing state, the next poll must ask the modem */
+        invalidateQuery(QUERY_CLCC);
+    }
+
 #ifdef WORKAROUND_ERRONEOUS_ANSWER
     // Basically:
     // A call was incoming or waiting
@@ -960,6 +1539,7 @@ static void requestGetCurrentCalls(void *data __unused, size_t datalen __unused,
                     "Hit WORKAROUND_ERRONOUS_ANSWER case."
                     " Repoll count: %d\n", s_repollCallsCount);
                 s_repollCallsCount++;
+                invalidateQuery(QUERY_CLCC);
                 goto error;
             }
         }
@@ -977,11 +1557,20 @@ static void requestGetCurrentCalls(void *data __unused, size_t datalen __unused,
 #ifdef POLL_CALL_STATE
     if (countValidCalls) {  // We don't seem to get a "NO CARRIER" message from
                             // smd, so we're forced to poll until the call ends.
+        RIL_requestTimedCallback (sendCallStateChanged,
+                restartPoll(&s_callPoll), &TIMEVAL_CALLSTATEPOLL);
+    }
 #else
-    if (needRepoll) {
-#endif
-        RIL_requestTimedCallback (sendCallStateChanged, NULL, &TIMEVAL_CALLSTATEPOLL);
+    if (callListChanged(callList)) {
+        /* a call just changed state, start over at the shortest delay */
+        restartPoll(&s_callPoll);
+    }
+    if (needPoll) {
+        schedulePoll(&s_callPoll, sendCallStateChanged);
+    } else {
+        restartPoll(&s_callPoll);
     }
+#endif
 
     return;
 #ifdef WORKAROUND_ERRONEOUS_ANSWER
@@ -1088,7 +1677,7 @@ static void requestSignalStrength(void *data __unused, size_t datalen __unused,
 
     memset(response, 0, sizeof(response));
 
-    err = at_send_command_singleline("AT+CSQ", "+CSQ:", &p_response);
+    err = sendCachedQuery(QUERY_CSQ, &p_response);
 
     if (err < 0 || p_response->success == 0) {
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
@@ -1107,6 +1696,12 @@ static void requestSignalStrength(void *data __unused, size_t datalen __unused,
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
 
+    pthread_mutex_lock(&s_cellInfoMutex);
+    memcpy(s_signalStrength, response, sizeof(s_signalStrength));
+    s_signalStrengthValid = 1;
+    pthread_mutex_unlock(&s_cellInfoMutex);
+    onCellInfoInput();
+
     at_response_free(p_response);
     return;
 
@@ -1536,8 +2131,7 @@ static void requestRegistrationState(int request, void *data __unused,
     int *registration;
     char **responseStr = NULL;
     ATResponse *p_response = NULL;
-    const char *cmd;
-    const char *prefix;
+    CachedQuery query;
     char *line;
     int i = 0, j, numElements = 0;
     int count = 3;
@@ -1545,19 +2139,17 @@ static void requestRegistrationState(int request, void *data __unused,
 
     RLOGD("requestRegistrationState");
     if (request == RIL_REQUEST_VOICE_REGISTRATION_STATE) {
-        cmd = "AT+CREG?";
-        prefix = "+CREG:";
+        query = QUERY_CREG;
         numElements = REG_STATE_LEN;
     } else if (request == RIL_REQUEST_DATA_REGISTRATION_STATE) {
-        cmd = "AT+CGREG?";
-        prefix = "+CGREG:";
+        query = QUERY_CGREG;
         numElements = REG_DATA_STATE_LEN;
     } else {
         assert(0);
         goto error;
     }
 
-    err = at_send_command_singleline(cmd, prefix, &p_response);
+    err = sendCachedQuery(query, &p_response);
 
     if (err != 0) goto error;
 
@@ -1628,6 +2220,7 @@ static void requestRegistrationState(int request, void *data __unused,
     responseStr = NULL;
     at_response_free(p_response);
 
+    onCellInfoInput();
     return;
 error:
     if (responseStr) {
@@ -1655,9 +2248,7 @@ static void requestOperator(void *data __unused, size_t datalen __unused, RIL_To
 
     ATResponse *p_response = NULL;
 
-    err = at_send_command_multiline(
-        "AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?",
-        "+COPS:", &p_response);
+    err = sendCachedQuery(QUERY_COPS, &p_response);
 
     /* we expect 3 lines here:
      * +COPS: 0,0,"T - Mobile"
@@ -1713,6 +2304,7 @@ static void requestOperator(void *data __unused, size_t datalen __unused, RIL_To
     RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
     at_response_free(p_response);
 
+    onCellInfoInput();
     return;
 error:
     RLOGE("requestOperator must not return error when radio is on");
@@ -2004,7 +2596,11 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
     size_t len;
     ssize_t written, rlen;
     char status[32] = {0};
-    int retry = 10;
+    char lastStatus[32] = {0};
+    struct pollfd pfd;
+    long long deadline;
+    long long delay = QMI_POLL_MIN_MSEC;
+    int ready;
     const char *pdp_type;
 
     RLOGD("requesting data connection to APN '%s'", apn);
@@ -2030,10 +2626,18 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
             cur += written;
         }
 
-        // wait for interface to come online
+        // wait for interface to come online, waking up as soon as the
+        // device has a new status to read
+
+        deadline = nowMsec() + QMI_UP_TIMEOUT_MSEC;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+
+        for (;;) {
+            do {
+                ready = poll(&pfd, 1, delay);
+            } while (ready < 0 && errno == EINTR);
 
-        do {
-            sleep(1);
             do {
                 rlen = read(fd, status, 31);
             } while (rlen < 0 && errno == EINTR);
@@ -2046,15 +2650,31 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
                 status[rlen] = '\0';
                 RLOGD("### status: %s", status);
             }
-        } while (strncmp(status, "STATE=up", 8) && strcmp(status, "online") && --retry);
 
-        close(fd);
+            if (!strncmp(status, "STATE=up", 8) || !strcmp(status, "online")) {
+                break;
+            }
 
-        if (retry == 0) {
-            RLOGE("### Failed to get data connection up\n");
-            goto error;
+            if (nowMsec() >= deadline) {
+                close(fd);
+                RLOGE("### Failed to get data connection up\n");
+                goto error;
+            }
+
+            if (ready > 0 && !strcmp(status, lastStatus)) {
+                // always readable, so poll() can't tell us about changes
+                sleepMsec(delay);
+            }
+            strlcpy(lastStatus, status, sizeof(lastStatus));
+
+            delay *= 2;
+            if (delay > QMI_POLL_MAX_MSEC) {
+                delay = QMI_POLL_MAX_MSEC;
+            }
         }
 
+        close(fd);
+
         qmistatus = system("netcfg rmnet0 dhcp");
 
         RLOGD("netcfg rmnet0 dhcp: status %d\n", qmistatus);
@@ -2075,21 +2695,28 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
         }
 
         asprintf(&cmd, "AT+CGDCONT=1,\"%s\",\"%s\",,0,0", pdp_type, apn);
-        //FIXME check for error here
-        err = at_send_command(cmd, NULL);
-        free(cmd);
 
-        // Set required QoS params to default
-        err = at_send_command("AT+CGQREQ=1", NULL);
-
-        // Set minimum QoS params to default
-        err = at_send_command("AT+CGQMIN=1", NULL);
-
-        // packet-domain event reporting
-        err = at_send_command("AT+CGEREP=1,0", NULL);
+        const char *setupCommands[] = {
+            cmd,
+            // Set required QoS params to default
+            "AT+CGQREQ=1",
+            // Set minimum QoS params to default
+            "AT+CGQMIN=1",
+            // packet-domain event reporting
+            "AT+CGEREP=1,0",
+            // Hangup anything that's happening there now
+            "AT+CGACT=1,0",
+        };
+        int setupSuccess[NUM_ELEMS(setupCommands)];
+
+        err = at_send_command_batch(setupCommands, NUM_ELEMS(setupCommands),
+                                    setupSuccess);
+        free(cmd);
 
-        // Hangup anything that's happening there now
-        err = at_send_command("AT+CGACT=1,0", NULL);
+        // Only the PDP context is required, the rest keep their defaults
+        if (err < 0 || !setupSuccess[0]) {
+            goto error;
+        }
 
         // Start data on PDP context 1
         err = at_send_command("ATD*99***1#", &p_response);
@@ -2099,6 +2726,7 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
         }
     }
 
+    invalidateDataCalls();
     requestOrSendDataCallList(&t);
 
     at_response_free(p_response);
@@ -2276,33 +2904,10 @@ static int techFromModemType(int mdmtype)
 
 static void requestGetCellInfoList(void *data __unused, size_t datalen __unused, RIL_Token t)
 {
-    uint64_t curTime = ril_nano_time();
-    RIL_CellInfo_v12 ci[1] =
-    {
-        { // ci[0]
-            1, // cellInfoType
-            1, // registered
-            RIL_TIMESTAMP_TYPE_MODEM,
-            curTime - 1000, // Fake some time in the past
-            { // union CellInfo
-                {  // RIL_CellInfoGsm gsm
-                    {  // gsm.cellIdneityGsm
-                        s_mcc, // mcc
-                        s_mnc, // mnc
-                        s_lac, // lac
-                        s_cid, // cid
-                        0, //arfcn unknown
-                        0xFF, // bsic unknown
-                    },
-                    {  // gsm.signalStrengthGsm
-                        10, // signalStrength
-                        0  // bitErrorRate
-                        , INT_MAX // timingAdvance invalid value
-                    }
-                }
-            }
-        }
-    };
+    RIL_CellInfo_v12 ci[1];
+
+    buildCellInfo(&ci[0]);
+    ci[0].timeStamp = ril_nano_time() - 1000; // Fake some time in the past
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, ci, sizeof(ci));
 }
@@ -2310,12 +2915,15 @@ static void requestGetCellInfoList(void *data __unused, size_t datalen __unused,
 
 static void requestSetCellInfoListRate(void *data, size_t datalen __unused, RIL_Token t)
 {
-    // For now we'll save the rate but no RIL_UNSOL_CELL_INFO_LIST messages
-    // will be sent.
     assert (datalen == sizeof(int));
     s_cell_info_rate_ms = ((int *)data)[0];
+    if (s_cell_info_rate_ms < 0) {
+        s_cell_info_rate_ms = 0;
+    }
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+
+    restartCellInfoReports();
 }
 
 static void requestGetHardwareConfig(void *data, size_t datalen, RIL_Token t)
@@ -2417,7 +3025,7 @@ static void requestGetSimAuthentication(void *data, size_t datalen __unused, RIL
     parseAuthResponse(line, &auth_response);
     RIL_onRequestComplete(t, auth_response.sw2, &auth_response, sizeof(auth_response));
     free(auth_response.simResponse);
-    free(p_response);
+    at_response_free(p_response);
 }
 
 static void requestModemActivityInfo(RIL_Token t)
@@ -2481,8 +3089,193 @@ static void requestSetCarrierRestrictions(const RIL_CarrierRestrictions *restric
     }
 }
 
+/*
+ * Per-request metadata, indexed by request code. Requests not listed here
+ * need the radio on and don't touch the query cache.
+ */
+#define REQUEST_RADIO_OFF    0x01   /* handled while the radio is off */
+#define REQUEST_UNAVAILABLE  0x02   /* handled while the radio is unavailable */
+#define REQUEST_DROPS_CALLS  0x04   /* makes the cached call list stale */
+#define REQUEST_DROPS_ALL    0x08   /* makes every cached answer stale */
+
+#define MAX_REQUEST_CODE     RIL_REQUEST_STOP_KEEPALIVE
+
+typedef struct {
+    unsigned char flags;
+} RequestInfo;
+
+static const RequestInfo s_requestInfo[MAX_REQUEST_CODE + 1] = {
+    [RIL_REQUEST_ANSWER] = { REQUEST_DROPS_CALLS },
+    [RIL_REQUEST_BASEBAND_VERSION] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_CDMA_GET_SUBSCRIPTION_SOURCE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_CDMA_QUERY_PREFERRED_VOICE_PRIVACY_MODE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_CDMA_SET_PREFERRED_VOICE_PRIVACY_MODE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_CDMA_SET_ROAMING_PREFERENCE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_CDMA_SET_SUBSCRIPTION_SOURCE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_CDMA_SUBSCRIPTION] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_CONFERENCE] = { REQUEST_DROPS_CALLS },
+    [RIL_REQUEST_DEVICE_IDENTITY] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_DIAL] = { REQUEST_DROPS_CALLS },
+    [RIL_REQUEST_EXIT_EMERGENCY_CALLBACK_MODE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_GET_ACTIVITY_INFO] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_GET_CARRIER_RESTRICTIONS] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_GET_CURRENT_CALLS] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_GET_IMEI] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_GET_MUTE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_GET_NEIGHBORING_CELL_IDS] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_GET_PREFERRED_NETWORK_TYPE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_GET_RADIO_CAPABILITY] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_GET_SIM_STATUS] = { REQUEST_RADIO_OFF | REQUEST_UNAVAILABLE },
+    [RIL_REQUEST_HANGUP] = { REQUEST_DROPS_CALLS },
+    [RIL_REQUEST_HANGUP_FOREGROUND_RESUME_BACKGROUND] = { REQUEST_DROPS_CALLS },
+    [RIL_REQUEST_HANGUP_WAITING_OR_BACKGROUND] = { REQUEST_DROPS_CALLS },
+    [RIL_REQUEST_NV_RESET_CONFIG] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_QUERY_AVAILABLE_BAND_MODE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_QUERY_NETWORK_SELECTION_MODE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_QUERY_TTY_MODE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_RADIO_POWER] = { REQUEST_RADIO_OFF | REQUEST_DROPS_ALL },
+    [RIL_REQUEST_SEPARATE_CONNECTION] = { REQUEST_DROPS_CALLS },
+    [RIL_REQUEST_SET_BAND_MODE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_SET_CARRIER_RESTRICTIONS] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_SET_LOCATION_UPDATES] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC] = { REQUEST_DROPS_ALL },
+    [RIL_REQUEST_SET_PREFERRED_NETWORK_TYPE] = { REQUEST_RADIO_OFF | REQUEST_DROPS_ALL },
+    [RIL_REQUEST_SET_TTY_MODE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_SET_UNSOL_CELL_INFO_LIST_RATE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_STOP_LCE] = { REQUEST_RADIO_OFF },
+    [RIL_REQUEST_SWITCH_WAITING_OR_HOLDING_AND_ACTIVE] = { REQUEST_DROPS_CALLS },
+    [RIL_REQUEST_UDUB] = { REQUEST_DROPS_CALLS },
+    [RIL_REQUEST_VOICE_RADIO_TECH] = { REQUEST_RADIO_OFF },
+};
+
+static int requestFlags(int request)
+{
+    if (request < 0 || request > MAX_REQUEST_CODE) {
+        return 0;
+    }
+    return s_requestInfo[request].flags;
+}
+
+/*
+ * Per-request counts and latencies, shown by the "dump-request-stats"
+ * OEM_HOOK_STRINGS request. Latency is the time onRequest spent on the
+ * request, in a histogram of log2(usec) buckets; the last bucket is open.
+ * Requests with larger codes share the last slot.
+ */
+#define LATENCY_BUCKETS  24
+
+typedef struct {
+    unsigned count;
+    unsigned rejected;          /* refused because of the radio state */
+    long long totalUsec;
+    long long maxUsec;
+    unsigned histogram[LATENCY_BUCKETS];
+} RequestStats;
+
+static pthread_mutex_t s_requestStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static RequestStats s_requestStats[MAX_REQUEST_CODE + 2];
+
+static long long nowUsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static RequestStats *requestStats(int request)
+{
+    if (request < 0 || request > MAX_REQUEST_CODE) {
+        return &s_requestStats[MAX_REQUEST_CODE + 1];
+    }
+    return &s_requestStats[request];
+}
+
+static void recordRequest(int request, long long usec)
+{
+    RequestStats *p_stats = requestStats(request);
+    int bucket = 0;
+    long long v;
+
+    for (v = usec ; v > 0 && bucket < LATENCY_BUCKETS - 1 ; v >>= 1) {
+        bucket++;
+    }
+
+    pthread_mutex_lock(&s_requestStatsMutex);
+    p_stats->count++;
+    p_stats->totalUsec += usec;
+    if (usec > p_stats->maxUsec) {
+        p_stats->maxUsec = usec;
+    }
+    p_stats->histogram[bucket]++;
+    pthread_mutex_unlock(&s_requestStatsMutex);
+}
+
+static void rejectRequest(int request, RIL_Errno e, RIL_Token t)
+{
+    RequestStats *p_stats = requestStats(request);
+
+    RIL_onRequestComplete(t, e, NULL, 0);
+
+    pthread_mutex_lock(&s_requestStatsMutex);
+    p_stats->rejected++;
+    pthread_mutex_unlock(&s_requestStatsMutex);
+}
+
+/**
+ * Answers "dump-request-stats" with one line per request type seen:
+ * "<name> count=<n> rejected=<n> avg_us=<n> max_us=<n> hist=<b0>,<b1>,..."
+ * where bucket i counts latencies below 2^i usec
+ */
+static void requestDumpRequestStats(RIL_Token t)
+{
+    RequestStats stats[MAX_REQUEST_CODE + 2];
+    char *lines[MAX_REQUEST_CODE + 2];
+    char hist[LATENCY_BUCKETS * 11];
+    int count = 0;
+    int i, b, len;
+
+    pthread_mutex_lock(&s_requestStatsMutex);
+    memcpy(stats, s_requestStats, sizeof(stats));
+    pthread_mutex_unlock(&s_requestStatsMutex);
+
+    for (i = 0 ; i < (int) NUM_ELEMS(stats) ; i++) {
+        const RequestStats *p_stats = &stats[i];
+
+        if (p_stats->count == 0 && p_stats->rejected == 0) {
+            continue;
+        }
+
+        len = 0;
+        for (b = 0 ; b < LATENCY_BUCKETS ; b++) {
+            len += snprintf(hist + len, sizeof(hist) - len, "%s%u",
+                            b > 0 ? "," : "", p_stats->histogram[b]);
+        }
+
+        if (asprintf(&lines[count],
+                     "%s count=%u rejected=%u avg_us=%lld max_us=%lld hist=%s",
+                     i <= MAX_REQUEST_CODE ? requestToString(i) : "<other>",
+                     p_stats->count, p_stats->rejected,
+                     p_stats->count > 0 ? p_stats->totalUsec / p_stats->count : 0,
+                     p_stats->maxUsec, hist) < 0) {
+            continue;
+        }
+        RLOGD("%s", lines[count]);
+        count++;
+    }
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, lines, count * sizeof(char *));
+
+    for (i = 0 ; i < count ; i++) {
+        free(lines[i]);
+    }
+}
+
 /*** Callback methods from the RIL library to us ***/
 
+static void processRequest (int request, void *data, size_t datalen, RIL_Token t);
+
 /**
  * Call from RIL to us to make a RIL_REQUEST
  *
@@ -2498,67 +3291,45 @@ static void requestSetCarrierRestrictions(const RIL_CarrierRestrictions *restric
 static void
 onRequest (int request, void *data, size_t datalen, RIL_Token t)
 {
-    ATResponse *p_response;
-    int err;
+    int flags = requestFlags(request);
+    long long start;
 
     RLOGD("onRequest: %s", requestToString(request));
 
     /* Ignore all requests except RIL_REQUEST_GET_SIM_STATUS
      * when RADIO_STATE_UNAVAILABLE.
      */
-    if (sState == RADIO_STATE_UNAVAILABLE
-        && request != RIL_REQUEST_GET_SIM_STATUS
-    ) {
-        RIL_onRequestComplete(t, RIL_E_RADIO_NOT_AVAILABLE, NULL, 0);
+    if (sState == RADIO_STATE_UNAVAILABLE && !(flags & REQUEST_UNAVAILABLE)) {
+        rejectRequest(request, RIL_E_RADIO_NOT_AVAILABLE, t);
         return;
     }
 
     /* Ignore all non-power requests when RADIO_STATE_OFF
      * (except RIL_REQUEST_GET_SIM_STATUS)
      */
-    if (sState == RADIO_STATE_OFF) {
-        switch(request) {
-            case RIL_REQUEST_BASEBAND_VERSION:
-            case RIL_REQUEST_CDMA_GET_SUBSCRIPTION_SOURCE:
-            case RIL_REQUEST_CDMA_QUERY_PREFERRED_VOICE_PRIVACY_MODE:
-            case RIL_REQUEST_CDMA_SET_PREFERRED_VOICE_PRIVACY_MODE:
-            case RIL_REQUEST_CDMA_SET_ROAMING_PREFERENCE:
-            case RIL_REQUEST_CDMA_SET_SUBSCRIPTION_SOURCE:
-            case RIL_REQUEST_CDMA_SUBSCRIPTION:
-            case RIL_REQUEST_DEVICE_IDENTITY:
-            case RIL_REQUEST_EXIT_EMERGENCY_CALLBACK_MODE:
-            case RIL_REQUEST_GET_ACTIVITY_INFO:
-            case RIL_REQUEST_GET_CARRIER_RESTRICTIONS:
-            case RIL_REQUEST_GET_CURRENT_CALLS:
-            case RIL_REQUEST_GET_IMEI:
-            case RIL_REQUEST_GET_MUTE:
-            case RIL_REQUEST_GET_NEIGHBORING_CELL_IDS:
-            case RIL_REQUEST_GET_PREFERRED_NETWORK_TYPE:
-            case RIL_REQUEST_GET_RADIO_CAPABILITY:
-            case RIL_REQUEST_GET_SIM_STATUS:
-            case RIL_REQUEST_NV_RESET_CONFIG:
-            case RIL_REQUEST_QUERY_AVAILABLE_BAND_MODE:
-            case RIL_REQUEST_QUERY_NETWORK_SELECTION_MODE:
-            case RIL_REQUEST_QUERY_TTY_MODE:
-            case RIL_REQUEST_RADIO_POWER:
-            case RIL_REQUEST_SET_BAND_MODE:
-            case RIL_REQUEST_SET_CARRIER_RESTRICTIONS:
-            case RIL_REQUEST_SET_LOCATION_UPDATES:
-            case RIL_REQUEST_SET_PREFERRED_NETWORK_TYPE:
-            case RIL_REQUEST_SET_TTY_MODE:
-            case RIL_REQUEST_SET_UNSOL_CELL_INFO_LIST_RATE:
-            case RIL_REQUEST_STOP_LCE:
-            case RIL_REQUEST_VOICE_RADIO_TECH:
-                // Process all the above, even though the radio is off
-                break;
+    if (sState == RADIO_STATE_OFF && !(flags & REQUEST_RADIO_OFF)) {
+        // say NOT_AVAILABLE because the radio is off
+        rejectRequest(request, RIL_E_RADIO_NOT_AVAILABLE, t);
+        return;
+    }
 
-            default:
-                // For all others, say NOT_AVAILABLE because the radio is off
-                RIL_onRequestComplete(t, RIL_E_RADIO_NOT_AVAILABLE, NULL, 0);
-                return;
-        }
+    if (flags & REQUEST_DROPS_ALL) {
+        invalidateAllQueries();
+    } else if (flags & REQUEST_DROPS_CALLS) {
+        invalidateQuery(QUERY_CLCC);
     }
 
+    start = nowUsec();
+    processRequest(request, data, datalen, t);
+    recordRequest(request, nowUsec() - start);
+}
+
+static void
+processRequest (int request, void *data, size_t datalen, RIL_Token t)
+{
+    ATResponse *p_response;
+    int err;
+
     switch (request) {
         case RIL_REQUEST_GET_SIM_STATUS: {
             RIL_CardStatus_v6 *p_card_status;
@@ -2757,6 +3528,11 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
 
             RLOGD("got OEM_HOOK_STRINGS: 0x%8p %lu", data, (long)datalen);
 
+            if (datalen >= sizeof (char *) && ((char **)data)[0] != NULL
+                    && !strcmp(((char **)data)[0], "dump-request-stats")) {
+                requestDumpRequestStats(t);
+                break;
+            }
 
             for (i = (datalen / sizeof (char *)), cur = (const char **)data ;
                     i > 0 ; cur++, i --) {
@@ -3013,6 +3789,7 @@ setRadioTechnology(ModemInfo *mdm, int newtech)
                                           &tech, sizeof(tech));
             }
         }
+        onCellInfoInput();
     }
 }
 
@@ -3043,6 +3820,11 @@ setRadioState(RIL_RadioState newState)
 
     pthread_mutex_unlock(&s_state_mutex);
 
+    if (sState != oldState) {
+        invalidateAllQueries();
+        invalidateDataCalls();
+    }
+
 
     /* do these outside of the mutex */
     if (sState != oldState) {
@@ -3351,11 +4133,16 @@ static void freeCardStatus(RIL_CardStatus_v6 *p_card_status) {
  *  (all SMS-related commands)
  */
 
-static void pollSIMState (void *param __unused)
+static void pollSIMState (void *param)
 {
     ATResponse *p_response;
     int ret;
 
+    if (!isCurrentPoll(&s_simPoll, param)) {
+        // a SIM report or a newer poll superseded this one
+        return;
+    }
+
     if (sState != RADIO_STATE_UNAVAILABLE) {
         // no longer valid to poll
         return;
@@ -3372,7 +4159,8 @@ static void pollSIMState (void *param __unused)
         return;
 
         case SIM_NOT_READY:
-            RIL_requestTimedCallback (pollSIMState, NULL, &TIMEVAL_SIMPOLL);
+            // +CPIN: or %CSTAT: restarts this as soon as the SIM is ready
+            schedulePoll(&s_simPoll, pollSIMState);
         return;
 
         case SIM_READY:
@@ -3579,86 +4367,139 @@ static void probeForModemMode(ModemInfo *info)
 }
 
 /**
- * Initialize everything that can be configured while we're still in
- * AT+CFUN=0
+ * Modem configuration sent on every bring-up. None of these have
+ * intermediate responses, so they can be packed into a few command lines.
  */
-static void initializeCallback(void *param __unused)
-{
-    ATResponse *p_response = NULL;
-    int err;
-
-    setRadioState (RADIO_STATE_OFF);
-
-    at_handshake();
-
-    probeForModemMode(sMdmInfo);
-    /* note: we don't check errors here. Everything important will
-       be handled in onATTimeout and onATReaderClosed */
-
+static const char * const s_initCommands[] = {
     /*  atchannel is tolerant of echo but it must */
     /*  have verbose result codes */
-    at_send_command("ATE0Q0V1", NULL);
+    "ATE0Q0V1",
 
     /*  No auto-answer */
-    at_send_command("ATS0=0", NULL);
+    "ATS0=0",
 
     /*  Extended errors */
-    at_send_command("AT+CMEE=1", NULL);
+    "AT+CMEE=1",
 
     /*  Network registration events */
-    err = at_send_command("AT+CREG=2", &p_response);
-
-    /* some handsets -- in tethered mode -- don't support CREG=2 */
-    if (err < 0 || p_response->success == 0) {
-        at_send_command("AT+CREG=1", NULL);
-    }
-
-    at_response_free(p_response);
+    "AT+CREG=2",
 
     /*  GPRS registration events */
-    at_send_command("AT+CGREG=1", NULL);
+    "AT+CGREG=1",
 
     /*  Call Waiting notifications */
-    at_send_command("AT+CCWA=1", NULL);
+    "AT+CCWA=1",
 
     /*  Alternating voice/data off */
-    at_send_command("AT+CMOD=0", NULL);
+    "AT+CMOD=0",
 
     /*  Not muted */
-    at_send_command("AT+CMUT=0", NULL);
+    "AT+CMUT=0",
 
     /*  +CSSU unsolicited supp service notifications */
-    at_send_command("AT+CSSN=0,1", NULL);
+    "AT+CSSN=0,1",
 
     /*  no connected line identification */
-    at_send_command("AT+COLP=0", NULL);
+    "AT+COLP=0",
 
     /*  HEX character set */
-    at_send_command("AT+CSCS=\"HEX\"", NULL);
+    "AT+CSCS=\"HEX\"",
 
     /*  USSD unsolicited */
-    at_send_command("AT+CUSD=1", NULL);
+    "AT+CUSD=1",
 
     /*  Enable +CGEV GPRS event notifications, but don't buffer */
-    at_send_command("AT+CGEREP=1,0", NULL);
+    "AT+CGEREP=1,0",
 
     /*  SMS PDU mode */
-    at_send_command("AT+CMGF=0", NULL);
+    "AT+CMGF=0",
 
 #ifdef USE_TI_COMMANDS
 
-    at_send_command("AT%CPI=3", NULL);
+    "AT%CPI=3",
 
     /*  TI specific -- notifications when SMS is ready (currently ignored) */
-    at_send_command("AT%CSTAT=1", NULL);
+    "AT%CSTAT=1",
 
 #endif /* USE_TI_COMMANDS */
+};
 
+/**
+ * Initialize everything that can be configured while we're still in
+ * AT+CFUN=0
+ *
+ * param is the channel generation this was scheduled for; if that channel
+ * has been closed since, there is nothing to do
+ */
+static void initializeCallback(void *param)
+{
+    int generation = (intptr_t) param;
+    int success[NUM_ELEMS(s_initCommands)];
+    long long start = nowMsec();
+    int roundTrips;
+    size_t i;
+
+    pthread_mutex_lock(&s_state_mutex);
+    if (generation != s_channelGeneration || s_closed > 0) {
+        pthread_mutex_unlock(&s_state_mutex);
+        RLOGI("AT channel %d closed before it was initialized", generation);
+        return;
+    }
+    pthread_mutex_unlock(&s_state_mutex);
+
+    setRadioState (RADIO_STATE_OFF);
+
+    at_handshake();
+
+    probeForModemMode(sMdmInfo);
+    /* note: we don't check errors here. Everything important will
+       be handled in onATTimeout and onATReaderClosed */
+
+    roundTrips = at_send_command_batch(s_initCommands,
+                    NUM_ELEMS(s_initCommands), success);
+
+    for (i = 0 ; roundTrips >= 0 && i < NUM_ELEMS(s_initCommands) ; i++) {
+        /* some handsets -- in tethered mode -- don't support CREG=2 */
+        if (!success[i] && 0 == strcmp(s_initCommands[i], "AT+CREG=2")) {
+            at_send_command("AT+CREG=1", NULL);
+            roundTrips++;
+        }
+    }
+
+    RLOGI("modem configured in %lld ms (%d command lines for %d commands)",
+            nowMsec() - start, roundTrips, (int) NUM_ELEMS(s_initCommands));
 
     /* assume radio is off on error */
     if (isRadioOn() > 0) {
         setRadioState (RADIO_STATE_ON);
     }
+
+    pthread_mutex_lock(&s_state_mutex);
+    if (generation == s_channelGeneration) {
+        s_initializedGeneration = generation;
+        pthread_cond_broadcast(&s_state_cond);
+    }
+    pthread_mutex_unlock(&s_state_mutex);
+}
+
+/**
+ * Waits until initializeCallback() has configured channel |generation|
+ * returns 0 when it has, -1 if the channel closed first
+ */
+static int waitForInitialized(int generation)
+{
+    int ret;
+
+    pthread_mutex_lock(&s_state_mutex);
+
+    while (s_initializedGeneration != generation && s_closed == 0) {
+        pthread_cond_wait(&s_state_cond, &s_state_mutex);
+    }
+    ret = s_initializedGeneration == generation ? 0 : -1;
+
+    pthread_mutex_unlock(&s_state_mutex);
+
+    return ret;
 }
 
 static void waitForClose()
@@ -3723,6 +4564,8 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
                 || strStartsWith(s,"NO CARRIER")
                 || strStartsWith(s,"+CCWA")
     ) {
+        invalidateQuery(QUERY_CLCC);
+        restartPoll(&s_callPoll);
         RIL_onUnsolicitedResponse (
             RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
             NULL, 0);
@@ -3732,12 +4575,31 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
     } else if (strStartsWith(s,"+CREG:")
                 || strStartsWith(s,"+CGREG:")
     ) {
+        invalidateRegistration(s);
         RIL_onUnsolicitedResponse (
             RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED,
             NULL, 0);
 #ifdef WORKAROUND_FAKE_CGEV
         RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
 #endif /* WORKAROUND_FAKE_CGEV */
+    } else if (strStartsWith(s, "%CPI:")) {
+        /* TI specific -- call progress, so DIALING and ALERTING calls
+           don't need to be polled */
+        s_callProgressReports = 1;
+        invalidateQuery(QUERY_CLCC);
+        restartPoll(&s_callPoll);
+        RIL_onUnsolicitedResponse (
+            RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
+            NULL, 0);
+    } else if (strStartsWith(s, "+CPIN:")
+                || strStartsWith(s, "%CSTAT:")
+    ) {
+        /* SIM state changed (%CSTAT: is TI specific), check it on the
+           main thread since it takes AT commands */
+        RIL_requestTimedCallback (pollSIMState, restartPoll(&s_simPoll), NULL);
+        RIL_onUnsolicitedResponse (
+            RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED,
+            NULL, 0);
     } else if (strStartsWith(s, "+CMT:")) {
         RIL_onUnsolicitedResponse (
             RIL_UNSOL_RESPONSE_NEW_SMS,
@@ -3888,11 +4750,19 @@ mainLoop(void *param __unused)
 {
     int fd;
     int ret;
+    int generation;
+    long long retryMsec = RECONNECT_MIN_MSEC;
+    long long lostMsec = -1;    /* when the previous channel closed */
+    long long readyMsec;
 
     AT_DUMP("== ", "entering mainLoop()", -1 );
     at_set_on_reader_closed(onATReaderClosed);
     at_set_on_timeout(onATTimeout);
 
+    if (isInEmulator()) {
+        at_set_max_outstanding(EMULATOR_MAX_OUTSTANDING_COMMANDS);
+    }
+
     for (;;) {
         fd = -1;
         while  (fd < 0) {
@@ -3913,16 +4783,30 @@ mainLoop(void *param __unused)
                     ios.c_lflag = 0;  /* disable ECHO, ICANON, etc... */
                     tcsetattr( fd, TCSANOW, &ios );
                 }
+            } else if (s_device_fd >= 0) {
+                /* there is nothing to reconnect to once it closes */
+                fd = s_device_fd;
+                s_device_fd = -1;
             }
 
             if (fd < 0) {
                 perror ("opening AT interface. retrying...");
-                sleep(10);
+                sleepMsec(retryMsec);
+                retryMsec *= 2;
+                if (retryMsec > RECONNECT_MAX_MSEC) {
+                    retryMsec = RECONNECT_MAX_MSEC;
+                }
                 /* never returns */
             }
         }
 
+        retryMsec = RECONNECT_MIN_MSEC;
+
+        pthread_mutex_lock(&s_state_mutex);
+        generation = ++s_channelGeneration;
         s_closed = 0;
+        pthread_mutex_unlock(&s_state_mutex);
+
         ret = at_open(fd, onUnsolicited);
 
         if (ret < 0) {
@@ -3930,13 +4814,29 @@ mainLoop(void *param __unused)
             return 0;
         }
 
-        RIL_requestTimedCallback(initializeCallback, NULL, &TIMEVAL_0);
+        // initializeCallback does nothing if this channel is gone by
+        // the time it is dispatched
+        RIL_requestTimedCallback(initializeCallback,
+                (void *) (intptr_t) generation, &TIMEVAL_0);
+
+        if (waitForInitialized(generation) == 0 && lostMsec >= 0) {
+            readyMsec = nowMsec() - lostMsec;
+
+            s_reconnectCount++;
+            s_reconnectTotalMsec += readyMsec;
+            if (readyMsec > s_reconnectMaxMsec) {
+                s_reconnectMaxMsec = readyMsec;
+            }
 
-        // Give initializeCallback a chance to dispatched, since
-        // we don't presently have a cancellation mechanism
-        sleep(1);
+            RLOGI("AT channel back after %lld ms "
+                    "(%d reconnects, average %lld ms, worst %lld ms)",
+                    readyMsec, s_reconnectCount,
+                    s_reconnectTotalMsec / s_reconnectCount,
+                    s_reconnectMaxMsec);
+        }
 
         waitForClose();
+        lostMsec = nowMsec();
         RLOGI("Re-opening after close");
     }
 }
@@ -3954,7 +4854,7 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
 
     s_rilenv = env;
 
-    while ( -1 != (opt = getopt(argc, argv, "p:d:s:c:"))) {
+    while ( -1 != (opt = getopt(argc, argv, "p:d:s:f:c:"))) {
         switch (opt) {
             case 'p':
                 s_port = atoi(optarg);
@@ -3976,6 +4876,15 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
                 RLOGI("Opening socket %s\n", s_device_path);
             break;
 
+            case 'f':
+                s_device_fd = atoi(optarg);
+                if (s_device_fd < 0) {
+                    usage(argv[0]);
+                    return NULL;
+                }
+                RLOGI("Using connected fd %d\n", s_device_fd);
+            break;
+
             case 'c':
                 RLOGI("Client id received %s\n", optarg);
             break;
@@ -3986,7 +4895,8 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
         }
     }
 
-    if (s_port < 0 && s_device_path == NULL && !isInEmulator()) {
+    if (s_port < 0 && s_device_path == NULL && s_device_fd < 0
+            && !isInEmulator()) {
         usage(argv[0]);
         return NULL;
     }
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2006 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* This program measures the throughput of the AT channel reader.
+ *
+ * A fake modem thread sits on the other end of a socketpair and answers
+ * every command with a burst of +CLCC lines followed by OK, written in
+ * small chunks so that lines straddle reads the way they do on the
+ * emulator's modem pipe.
+ *
+ * With more than one sender thread, the channel is allowed to keep that
+ * many commands outstanding at once.
+ *
+ * Usage: test-ril-atchannel-bench [commands] [lines-per-response] [threads]
+ */
+#include <sys/socket.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "atchannel.h"
+
+#define  DEFAULT_COMMANDS  20000
+#define  DEFAULT_LINES     8
+#define  CHUNK_SIZE        37
+#define  MAX_THREADS       16
+
+static int s_lines = DEFAULT_LINES;
+static int s_commandsPerThread;
+
+static const char s_clcc[] = "+CLCC: 1,0,0,0,0,\"6505551212\",129\r\n";
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void *modem_thread(void *arg)
+{
+    int fd = (int)(long)arg;
+    char cmd[256];
+    char *reply;
+    size_t replyLen = 0;
+    size_t cmdLen = 0;
+    int n;
+
+    reply = malloc(sizeof(s_clcc) * s_lines + 8);
+    if (reply == NULL)
+        return NULL;
+
+    for (n = 0; n < s_lines; n++) {
+        memcpy(reply + replyLen, s_clcc, sizeof(s_clcc) - 1);
+        replyLen += sizeof(s_clcc) - 1;
+    }
+    memcpy(reply + replyLen, "OK\r\n", 4);
+    replyLen += 4;
+
+    for (;;) {
+        ssize_t ret = read(fd, cmd + cmdLen, sizeof(cmd) - cmdLen);
+        size_t off;
+
+        if (ret <= 0)
+            break;
+        cmdLen += ret;
+
+        /* answer each complete command */
+        while (cmdLen > 0 && memchr(cmd, '\r', cmdLen) != NULL) {
+            char *eol = memchr(cmd, '\r', cmdLen);
+            size_t used = eol - cmd + 1;
+
+            for (off = 0; off < replyLen; off += CHUNK_SIZE) {
+                size_t len = replyLen - off;
+                if (len > CHUNK_SIZE)
+                    len = CHUNK_SIZE;
+                if (write_all(fd, reply + off, len) < 0)
+                    goto out;
+            }
+            memmove(cmd, cmd + used, cmdLen - used);
+            cmdLen -= used;
+        }
+        if (cmdLen == sizeof(cmd))
+            cmdLen = 0;
+    }
+out:
+    free(reply);
+    close(fd);
+    return NULL;
+}
+
+static void on_unsolicited(const char *s, const char *sms_pdu)
+{
+    (void)s;
+    (void)sms_pdu;
+}
+
+static void *sender_thread(void *arg)
+{
+    long lines = 0;
+    int n;
+
+    (void)arg;
+
+    for (n = 0; n < s_commandsPerThread; n++) {
+        ATResponse *p_response = NULL;
+        ATLine *p_cur;
+        int err;
+
+        err = at_send_command_multiline("AT+CLCC", "+CLCC:", &p_response);
+        if (err < 0 || p_response->success == 0) {
+            fprintf(stderr, "command %d failed: %d\n", n, err);
+            at_response_free(p_response);
+            return (void *)-1L;
+        }
+        for (p_cur = p_response->p_intermediates; p_cur != NULL;
+                p_cur = p_cur->p_next)
+            lines++;
+        at_response_free(p_response);
+    }
+
+    return (void *)lines;
+}
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    int commands = DEFAULT_COMMANDS;
+    int threads = 1;
+    int fds[2];
+    pthread_t tid;
+    pthread_t senders[MAX_THREADS];
+    double start, elapsed;
+    long lines = 0;
+    int n;
+
+    if (argc > 1)
+        commands = atoi(argv[1]);
+    if (argc > 2)
+        s_lines = atoi(argv[2]);
+    if (argc > 3)
+        threads = atoi(argv[3]);
+
+    if (commands <= 0 || s_lines < 0 || threads <= 0 || threads > MAX_THREADS) {
+        fprintf(stderr, "usage: %s [commands] [lines-per-response] [threads]\n",
+                argv[0]);
+        return 1;
+    }
+    s_commandsPerThread = commands / threads;
+    commands = s_commandsPerThread * threads;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (pthread_create(&tid, NULL, modem_thread, (void *)(long)fds[1]) != 0) {
+        fprintf(stderr, "could not create modem thread\n");
+        return 1;
+    }
+
+    at_set_max_outstanding(threads);
+
+    if (at_open(fds[0], on_unsolicited) < 0) {
+        fprintf(stderr, "at_open failed\n");
+        return 1;
+    }
+
+    start = now_secs();
+    for (n = 0; n < threads; n++) {
+        if (pthread_create(&senders[n], NULL, sender_thread, NULL) != 0) {
+            fprintf(stderr, "could not create sender thread\n");
+            return 1;
+        }
+    }
+    for (n = 0; n < threads; n++) {
+        void *ret;
+
+        pthread_join(senders[n], &ret);
+        if ((long)ret < 0)
+            return 1;
+        lines += (long)ret;
+    }
+    elapsed = now_secs() - start;
+
+    if (lines != (long)commands * s_lines) {
+        fprintf(stderr, "expected %ld lines, got %ld\n",
+                (long)commands * s_lines, lines);
+        return 1;
+    }
+
+    printf("%d commands, %ld lines in %.3f s: %.0f commands/s, %.0f lines/s\n",
+           commands, lines, elapsed, commands / elapsed, lines / elapsed);
+
+    at_close();
+    return 0;
+}
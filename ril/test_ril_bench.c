@@ -0,0 +1,686 @@
+/*
+ * Copyright (C) 2006 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* This program measures reference-ril request throughput on a Linux host.
+ *
+ * reference-ril is linked in and started through RIL_Init() with
+ * "-f <fd>", one end of a socketpair, and a scripted fake modem answers on
+ * the other end. The program stands in for libril: it provides the RIL_Env
+ * callbacks, runs timed callbacks on a thread of their own, and issues a
+ * mix of the requests the framework polls for most from one or more
+ * threads.
+ *
+ * The modem answers each command line with the reply of the first rule
+ * whose command is a prefix of the line, or "OK". The built-in rules bring
+ * the radio up with a registered network and a ready SIM; a script given
+ * with -f adds rules ahead of them, one per line:
+ *
+ *     <command prefix><TAB><reply line>|<reply line>|...|OK
+ *
+ * Usage: test-ril-bench [-n requests] [-t threads] [-d reply-delay-usec]
+ *                       [-l clcc-lines] [-u burst-lines] [-i burst-msec]
+ *                       [-f script]
+ *
+ * Prints request latency percentiles, AT command lines per request and
+ * the CPU time used by the AT reader thread.
+ */
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include "ril.h"
+#include "atchannel.h"
+#include "misc.h"
+
+#define  DEFAULT_REQUESTS      10000
+#define  MAX_THREADS           16
+#define  MAX_RULES             64
+#define  MAX_REPLY             4096
+#define  RADIO_ON_TIMEOUT_SEC  10
+
+typedef struct {
+    char *command;
+    char *reply;        /* "\r\n" separated lines, final response included */
+} Rule;
+
+static Rule s_rules[MAX_RULES];
+static int s_ruleCount;
+
+static int s_replyDelayUsec;
+static int s_burstLines;
+static int s_burstMsec = 100;
+
+static pthread_mutex_t s_writeMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_modemFd = -1;
+
+static const int s_requestMix[] = {
+    RIL_REQUEST_SIGNAL_STRENGTH,
+    RIL_REQUEST_VOICE_REGISTRATION_STATE,
+    RIL_REQUEST_DATA_REGISTRATION_STATE,
+    RIL_REQUEST_OPERATOR,
+    RIL_REQUEST_GET_CURRENT_CALLS,
+    RIL_REQUEST_GET_IMSI,           /* never cached */
+};
+#define REQUEST_MIX_COUNT  (int) (sizeof(s_requestMix) / sizeof(s_requestMix[0]))
+
+/* libril provides this one */
+const char *requestToString(int request)
+{
+    switch (request) {
+        case RIL_REQUEST_SIGNAL_STRENGTH: return "SIGNAL_STRENGTH";
+        case RIL_REQUEST_VOICE_REGISTRATION_STATE: return "VOICE_REGISTRATION_STATE";
+        case RIL_REQUEST_DATA_REGISTRATION_STATE: return "DATA_REGISTRATION_STATE";
+        case RIL_REQUEST_OPERATOR: return "OPERATOR";
+        case RIL_REQUEST_GET_CURRENT_CALLS: return "GET_CURRENT_CALLS";
+        case RIL_REQUEST_GET_IMSI: return "GET_IMSI";
+        default: return "<unknown request>";
+    }
+}
+
+/*** fake modem ***/
+
+static int addRule(const char *command, const char *reply)
+{
+    char *lines;
+    char *p;
+
+    if (s_ruleCount == MAX_RULES) {
+        return -1;
+    }
+
+    /* '|' separates lines, the channel wants "\r\n" */
+    lines = malloc(strlen(reply) * 2 + 3);
+    if (lines == NULL) {
+        return -1;
+    }
+    for (p = lines ; *reply != '\0' ; reply++) {
+        if (*reply == '|') {
+            *p++ = '\r';
+            *p++ = '\n';
+        } else {
+            *p++ = *reply;
+        }
+    }
+    strcpy(p, "\r\n");
+
+    s_rules[s_ruleCount].command = strdup(command);
+    s_rules[s_ruleCount].reply = lines;
+    s_ruleCount++;
+
+    return 0;
+}
+
+static int loadScript(const char *path)
+{
+    FILE *f;
+    char line[MAX_REPLY];
+    int err = 0;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (err == 0 && fgets(line, sizeof(line), f) != NULL) {
+        char *tab = strchr(line, '\t');
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        if (tab == NULL) {
+            fprintf(stderr, "%s: no TAB in '%s'\n", path, line);
+            err = -1;
+            break;
+        }
+        *tab = '\0';
+        err = addRule(line, tab + 1);
+    }
+
+    fclose(f);
+    return err;
+}
+
+static void addDefaultRules(int clccLines)
+{
+    static const char clcc[] = "+CLCC: 1,0,0,0,0,\"6505551212\",129|";
+    char *reply;
+    int n;
+
+    addRule("AT+CFUN?", "+CFUN: 1|OK");
+    addRule("AT+CPIN?", "+CPIN: READY|OK");
+    addRule("AT+CSQ", "+CSQ: 20,99,-1,-1,-1,-1,-1,20,-90,-10,100,2147483647,2147483647|OK");
+    addRule("AT+CREG?", "+CREG: 2,1,00C3,0000A1B2|OK");
+    addRule("AT+CGREG?", "+CGREG: 2,1,00C3,0000A1B2,3|OK");
+    addRule("AT+COPS=3,0;+COPS?",
+            "+COPS: 0,0,\"Android\"|+COPS: 0,1,\"Android\"|+COPS: 0,2,\"310260\"|OK");
+    addRule("AT+COPS?", "+COPS: 0|OK");
+    addRule("AT+CGSN", "000000000000000|OK");
+    addRule("AT+CIMI", "310260000000000|OK");
+    addRule("AT+CGMR", "bench|OK");
+    addRule("AT+CTEC?", "+CTEC: 0,ff|OK");
+    addRule("AT+CGDCONT?", "OK");
+    addRule("AT+CGACT?", "OK");
+
+    reply = malloc(sizeof(clcc) * clccLines + 3);
+    reply[0] = '\0';
+    for (n = 0 ; n < clccLines ; n++) {
+        strcat(reply, clcc);
+    }
+    strcat(reply, "OK");
+    addRule("AT+CLCC", reply);
+    free(reply);
+}
+
+static int writeAll(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int reply(int fd, const char *s)
+{
+    int ret;
+
+    pthread_mutex_lock(&s_writeMutex);
+    ret = writeAll(fd, s, strlen(s));
+    pthread_mutex_unlock(&s_writeMutex);
+
+    return ret;
+}
+
+static const char *findReply(const char *command)
+{
+    int i;
+
+    for (i = 0 ; i < s_ruleCount ; i++) {
+        if (strStartsWith(command, s_rules[i].command)) {
+            return s_rules[i].reply;
+        }
+    }
+    return "OK\r\n";
+}
+
+static void *modemThread(void *arg)
+{
+    int fd = (int)(long)arg;
+    char cmd[MAX_REPLY];
+    size_t cmdLen = 0;
+
+    for (;;) {
+        ssize_t ret = read(fd, cmd + cmdLen, sizeof(cmd) - 1 - cmdLen);
+        char *eol;
+
+        if (ret <= 0)
+            break;
+        cmdLen += ret;
+
+        while ((eol = memchr(cmd, '\r', cmdLen)) != NULL) {
+            size_t used = eol - cmd + 1;
+
+            *eol = '\0';
+            if (s_replyDelayUsec > 0) {
+                usleep(s_replyDelayUsec);
+            }
+            if (reply(fd, findReply(cmd)) < 0)
+                goto out;
+
+            memmove(cmd, cmd + used, cmdLen - used);
+            cmdLen -= used;
+        }
+        if (cmdLen == sizeof(cmd) - 1)
+            cmdLen = 0;
+    }
+out:
+    close(fd);
+    return NULL;
+}
+
+/* sends |s_burstLines| registration reports every |s_burstMsec| */
+static void *burstThread(void *arg)
+{
+    static const char report[] = "+CREG: 1\r\n";
+    char *burst;
+    int n;
+
+    (void)arg;
+
+    burst = malloc(sizeof(report) * s_burstLines + 1);
+    if (burst == NULL)
+        return NULL;
+    burst[0] = '\0';
+    for (n = 0 ; n < s_burstLines ; n++) {
+        strcat(burst, report);
+    }
+
+    for (;;) {
+        int fd;
+
+        usleep(s_burstMsec * 1000);
+
+        pthread_mutex_lock(&s_writeMutex);
+        fd = s_modemFd;
+        if (fd >= 0) {
+            writeAll(fd, burst, strlen(burst));
+        }
+        pthread_mutex_unlock(&s_writeMutex);
+    }
+
+    return NULL;
+}
+
+/*** RIL_Env ***/
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;
+    RIL_Errno e;
+} Pending;
+
+typedef struct TimedCallback {
+    struct TimedCallback *p_next;
+    RIL_TimedCallback callback;
+    void *param;
+    struct timespec when;
+} TimedCallback;
+
+static pthread_mutex_t s_timerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_timerCond;
+static TimedCallback *sp_timers;
+
+static unsigned long s_unsolicitedCount;
+
+static void onRequestComplete(RIL_Token t, RIL_Errno e,
+                              void *response, size_t responselen)
+{
+    Pending *p_pending = (Pending *) t;
+
+    (void)response;
+    (void)responselen;
+
+    pthread_mutex_lock(&p_pending->mutex);
+    p_pending->done = 1;
+    p_pending->e = e;
+    pthread_cond_signal(&p_pending->cond);
+    pthread_mutex_unlock(&p_pending->mutex);
+}
+
+static void onUnsolicitedResponse(int unsolResponse, const void *data,
+                                  size_t datalen)
+{
+    (void)unsolResponse;
+    (void)data;
+    (void)datalen;
+
+    pthread_mutex_lock(&s_timerMutex);
+    s_unsolicitedCount++;
+    pthread_mutex_unlock(&s_timerMutex);
+}
+
+static int timespecBefore(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec
+            || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void requestTimedCallback(RIL_TimedCallback callback, void *param,
+                                 const struct timeval *relativeTime)
+{
+    TimedCallback *p_timer;
+    TimedCallback **pp_cur;
+
+    p_timer = calloc(1, sizeof(*p_timer));
+    if (p_timer == NULL) {
+        return;
+    }
+    p_timer->callback = callback;
+    p_timer->param = param;
+
+    clock_gettime(CLOCK_MONOTONIC, &p_timer->when);
+    if (relativeTime != NULL) {
+        p_timer->when.tv_sec += relativeTime->tv_sec;
+        p_timer->when.tv_nsec += relativeTime->tv_usec * 1000;
+        if (p_timer->when.tv_nsec >= 1000000000L) {
+            p_timer->when.tv_sec++;
+            p_timer->when.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&s_timerMutex);
+
+    /* sorted by due time, equal times in the order they were requested */
+    for (pp_cur = &sp_timers ; *pp_cur != NULL ; pp_cur = &(*pp_cur)->p_next) {
+        if (timespecBefore(&p_timer->when, &(*pp_cur)->when)) {
+            break;
+        }
+    }
+    p_timer->p_next = *pp_cur;
+    *pp_cur = p_timer;
+
+    pthread_cond_signal(&s_timerCond);
+    pthread_mutex_unlock(&s_timerMutex);
+}
+
+/* runs timed callbacks one at a time, like the libril event loop */
+static void *timerThread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&s_timerMutex);
+
+    for (;;) {
+        struct timespec now;
+        TimedCallback *p_timer = sp_timers;
+
+        if (p_timer == NULL) {
+            pthread_cond_wait(&s_timerCond, &s_timerMutex);
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timespecBefore(&now, &p_timer->when)) {
+            pthread_cond_timedwait(&s_timerCond, &s_timerMutex, &p_timer->when);
+            continue;
+        }
+
+        sp_timers = p_timer->p_next;
+
+        pthread_mutex_unlock(&s_timerMutex);
+        p_timer->callback(p_timer->param);
+        free(p_timer);
+        pthread_mutex_lock(&s_timerMutex);
+    }
+
+    return NULL;
+}
+
+static const struct RIL_Env s_env = {
+    onRequestComplete,
+    onUnsolicitedResponse,
+    requestTimedCallback,
+    NULL
+};
+
+/*** benchmark ***/
+
+static const RIL_RadioFunctions *s_funcs;
+static int s_requestsPerThread;
+static long long *s_latencyUsec;    /* per request, in issue order */
+static int s_failures[REQUEST_MIX_COUNT];
+static pthread_mutex_t s_resultMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long long nowUsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void *requestThread(void *arg)
+{
+    int thread = (int)(long)arg;
+    int n;
+
+    for (n = 0 ; n < s_requestsPerThread ; n++) {
+        int index = thread * s_requestsPerThread + n;
+        int mix = index % REQUEST_MIX_COUNT;
+        Pending pending;
+        long long start;
+
+        pthread_mutex_init(&pending.mutex, NULL);
+        pthread_cond_init(&pending.cond, NULL);
+        pending.done = 0;
+
+        start = nowUsec();
+        s_funcs->onRequest(s_requestMix[mix], NULL, 0, (RIL_Token) &pending);
+
+        pthread_mutex_lock(&pending.mutex);
+        while (!pending.done) {
+            pthread_cond_wait(&pending.cond, &pending.mutex);
+        }
+        pthread_mutex_unlock(&pending.mutex);
+
+        s_latencyUsec[index] = nowUsec() - start;
+
+        if (pending.e != RIL_E_SUCCESS) {
+            pthread_mutex_lock(&s_resultMutex);
+            s_failures[mix]++;
+            pthread_mutex_unlock(&s_resultMutex);
+        }
+
+        pthread_cond_destroy(&pending.cond);
+        pthread_mutex_destroy(&pending.mutex);
+    }
+
+    return NULL;
+}
+
+static int compareLatency(const void *a, const void *b)
+{
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static long long percentile(const long long *sorted, int count, int pct)
+{
+    int index = (int) ((long long) count * pct / 100);
+    if (index >= count)
+        index = count - 1;
+    return sorted[index];
+}
+
+/**
+ * Starts the fake modem on one end of a socketpair
+ * returns the other end, for reference-ril, or -1
+ */
+static int startModem(pthread_t *p_tid)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return -1;
+    }
+
+    s_modemFd = fds[0];
+
+    if (pthread_create(p_tid, NULL, modemThread, (void *)(long)fds[0]) != 0) {
+        fprintf(stderr, "could not create modem thread\n");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    return fds[1];
+}
+
+int main(int argc, char **argv)
+{
+    int requests = DEFAULT_REQUESTS;
+    int threads = 1;
+    int clccLines = 1;
+    const char *script = NULL;
+    char fdArg[16];
+    char *rilArgv[4];
+    pthread_t tid;
+    pthread_t requesters[MAX_THREADS];
+    pthread_condattr_t attr;
+    ATChannelStats before, after;
+    unsigned long unsolicited;
+    long long start, elapsed;
+    long long *sorted;
+    int opt, n, i;
+    int fd;
+
+    while ((opt = getopt(argc, argv, "n:t:d:l:u:i:f:")) != -1) {
+        switch (opt) {
+            case 'n': requests = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'd': s_replyDelayUsec = atoi(optarg); break;
+            case 'l': clccLines = atoi(optarg); break;
+            case 'u': s_burstLines = atoi(optarg); break;
+            case 'i': s_burstMsec = atoi(optarg); break;
+            case 'f': script = optarg; break;
+            default: goto usage;
+        }
+    }
+
+    if (requests <= 0 || threads <= 0 || threads > MAX_THREADS
+            || clccLines < 0 || s_replyDelayUsec < 0 || s_burstLines < 0
+            || s_burstMsec <= 0) {
+        goto usage;
+    }
+
+    if (isInEmulator()) {
+        /* reference-ril would open the emulator's modem instead */
+        fprintf(stderr, "%s: run this on the host, not in the emulator\n", argv[0]);
+        return 1;
+    }
+
+    s_requestsPerThread = requests / threads;
+    requests = s_requestsPerThread * threads;
+
+    if (script != NULL && loadScript(script) < 0) {
+        return 1;
+    }
+    addDefaultRules(clccLines);
+
+    s_latencyUsec = calloc(requests, sizeof(long long));
+    sorted = calloc(requests, sizeof(long long));
+    if (s_latencyUsec == NULL || sorted == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    fd = startModem(&tid);
+    if (fd < 0) {
+        return 1;
+    }
+    if (s_burstLines > 0) {
+        pthread_create(&tid, NULL, burstThread, NULL);
+    }
+
+    /* timed callbacks are due by CLOCK_MONOTONIC */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s_timerCond, &attr);
+    pthread_create(&tid, NULL, timerThread, NULL);
+
+    rilArgv[0] = argv[0];
+    snprintf(fdArg, sizeof(fdArg), "%d", fd);
+    rilArgv[1] = "-f";
+    rilArgv[2] = fdArg;
+    rilArgv[3] = NULL;
+    optind = 1;
+
+    s_funcs = RIL_Init(&s_env, 3, rilArgv);
+    if (s_funcs == NULL) {
+        fprintf(stderr, "RIL_Init failed\n");
+        return 1;
+    }
+
+    for (n = 0 ; s_funcs->onStateRequest() != RADIO_STATE_ON ; n++) {
+        if (n == RADIO_ON_TIMEOUT_SEC * 100) {
+            fprintf(stderr, "radio did not come on\n");
+            return 1;
+        }
+        usleep(10 * 1000);
+    }
+
+    at_get_stats(&before);
+    pthread_mutex_lock(&s_timerMutex);
+    unsolicited = s_unsolicitedCount;
+    pthread_mutex_unlock(&s_timerMutex);
+
+    start = nowUsec();
+    for (n = 0 ; n < threads ; n++) {
+        if (pthread_create(&requesters[n], NULL, requestThread, (void *)(long)n) != 0) {
+            fprintf(stderr, "could not create request thread\n");
+            return 1;
+        }
+    }
+    for (n = 0 ; n < threads ; n++) {
+        pthread_join(requesters[n], NULL);
+    }
+    elapsed = nowUsec() - start;
+
+    at_get_stats(&after);
+    pthread_mutex_lock(&s_timerMutex);
+    unsolicited = s_unsolicitedCount - unsolicited;
+    pthread_mutex_unlock(&s_timerMutex);
+
+    printf("%d requests from %d threads in %.3f s: %.0f requests/s\n",
+           requests, threads, elapsed / 1e6, requests * 1e6 / elapsed);
+
+    for (i = -1 ; i < REQUEST_MIX_COUNT ; i++) {
+        int count = 0;
+
+        for (n = 0 ; n < requests ; n++) {
+            if (i < 0 || n % REQUEST_MIX_COUNT == i) {
+                sorted[count++] = s_latencyUsec[n];
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+        qsort(sorted, count, sizeof(long long), compareLatency);
+
+        printf("%-26s p50 %6lld  p90 %6lld  p99 %6lld  max %6lld us",
+               i < 0 ? "all" : requestToString(s_requestMix[i]),
+               percentile(sorted, count, 50), percentile(sorted, count, 90),
+               percentile(sorted, count, 99), sorted[count - 1]);
+        if (i >= 0 && s_failures[i] > 0) {
+            printf("  (%d failed)", s_failures[i]);
+        }
+        printf("\n");
+    }
+
+    printf("AT command lines per request: %.2f\n",
+           (double) (after.commands - before.commands) / requests);
+    printf("AT reads: %lu, %llu bytes, %lu unsolicited lines\n",
+           after.reads - before.reads, after.bytesRead - before.bytesRead,
+           after.unsolicited - before.unsolicited);
+    printf("AT reader CPU: %.3f ms (%.2f us per request)\n",
+           (after.readerCpuUsec - before.readerCpuUsec) / 1e3,
+           (double) (after.readerCpuUsec - before.readerCpuUsec) / requests);
+    printf("unsolicited responses to the framework: %lu\n", unsolicited);
+
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-n requests] [-t threads] [-d reply-delay-usec]\n"
+                    "       [-l clcc-lines] [-u burst-lines] [-i burst-msec]\n"
+                    "       [-f script]\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,31 @@
+# Build reference-ril tests, included from main Android.mk
+
+# Throughput benchmark for the AT channel reader, talking to a fake
+# modem over a socketpair.
+#
+include $(CLEAR_VARS)
+LOCAL_MODULE := test-ril-atchannel-bench
+LOCAL_SRC_FILES := test_atchannel_bench.c atchannel.c misc.c at_tok.c
+LOCAL_CFLAGS := -D_GNU_SOURCE
+LOCAL_CFLAGS += -Wall -Wextra -Wno-unused-variable -Wno-unused-function -Werror
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
+
+# Request throughput benchmark for the whole RIL, run on a Linux host
+# against a scripted fake modem. host/ stands in for what reference-ril
+# takes from bionic, libqemu_pipe and librilutils. reference-ril.c has
+# warnings the host compiler reports, so no -Werror here.
+#
+include $(CLEAR_VARS)
+LOCAL_MODULE := test-ril-bench
+LOCAL_SRC_FILES := test_ril_bench.c reference-ril.c atchannel.c misc.c at_tok.c \
+    host/host_shims.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/host hardware/ril/include
+LOCAL_CFLAGS := -D_GNU_SOURCE -DRIL_SHLIB -DAT_STATS
+LOCAL_CFLAGS += -include $(LOCAL_PATH)/host/host_shims.h
+LOCAL_CFLAGS += -Wall -Wextra -Wno-unused-variable -Wno-unused-function
+LOCAL_STATIC_LIBRARIES := libcutils libutils liblog libbase
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_HOST_EXECUTABLE)
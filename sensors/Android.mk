@@ -28,3 +28,5 @@ LOCAL_SRC_FILES := sensors_qemu.c
 LOCAL_MODULE := sensors.ranchu
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(LOCAL_PATH)/tests.mk
@@ -33,6 +33,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <log/log.h>
 #include <cutils/sockets.h>
 #include <hardware/sensors.h>
@@ -132,6 +136,313 @@ static int64_t now_ns(void) {
     return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
+/** SENSOR EVENT PARSING
+ **
+ ** Each message from the emulator is a line like "acceleration:<x>:<y>:<z>",
+ ** "sync:<time>" or "wake". The name before the first ':' is looked up
+ ** by its first character, then the values are parsed in one pass.
+ **/
+
+#define  LINE_SENSOR      0   /* values of a sensor, see |id| */
+#define  LINE_GUEST_SYNC  1
+#define  LINE_SYNC        2
+#define  LINE_WAKE        3
+
+typedef struct {
+    const char*  name;
+    int          len;
+    int          kind;      /* LINE_* */
+    int          id;        /* sensor id for LINE_SENSOR */
+    int          count;     /* number of values */
+    int          type;      /* SENSOR_TYPE_* */
+    int          status;    /* sets the accuracy of a sensors_vec_t */
+} SensorLine;
+
+#define  SENSOR_LINE(name, kind, id, count, type, status) \
+    { name, sizeof(name) - 1, kind, id, count, type, status }
+
+static const SensorLine _sensorLines[] = {
+    SENSOR_LINE("acceleration", LINE_SENSOR, ID_ACCELERATION, 3,
+                SENSOR_TYPE_ACCELEROMETER, 0),
+    SENSOR_LINE("gyroscope", LINE_SENSOR, ID_GYROSCOPE, 3,
+                SENSOR_TYPE_GYROSCOPE, 0),
+    SENSOR_LINE("guest-sync", LINE_GUEST_SYNC, -1, 0, 0, 0),
+    SENSOR_LINE("humidity", LINE_SENSOR, ID_HUMIDITY, 1,
+                SENSOR_TYPE_RELATIVE_HUMIDITY, 0),
+    SENSOR_LINE("light", LINE_SENSOR, ID_LIGHT, 1,
+                SENSOR_TYPE_LIGHT, 0),
+    SENSOR_LINE("magnetic", LINE_SENSOR, ID_MAGNETIC_FIELD, 3,
+                SENSOR_TYPE_MAGNETIC_FIELD, 1),
+    SENSOR_LINE("magnetic-uncalibrated", LINE_SENSOR,
+                ID_MAGNETIC_FIELD_UNCALIBRATED, 3,
+                SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED, 1),
+    SENSOR_LINE("orientation", LINE_SENSOR, ID_ORIENTATION, 3,
+                SENSOR_TYPE_ORIENTATION, 1),
+    SENSOR_LINE("proximity", LINE_SENSOR, ID_PROXIMITY, 1,
+                SENSOR_TYPE_PROXIMITY, 0),
+    SENSOR_LINE("pressure", LINE_SENSOR, ID_PRESSURE, 1,
+                SENSOR_TYPE_PRESSURE, 0),
+    SENSOR_LINE("sync", LINE_SYNC, -1, 0, 0, 0),
+    SENSOR_LINE("temperature", LINE_SENSOR, ID_TEMPERATURE, 1,
+                SENSOR_TYPE_AMBIENT_TEMPERATURE, 0),
+    SENSOR_LINE("wake", LINE_WAKE, -1, 0, 0, 0),
+};
+
+/* Return the entry of _sensorLines[] named by the |len| first characters
+ * of |name|, or NULL. */
+static const SensorLine* _sensorLineFromName(const char* name, int len)
+{
+    int first, last, nn;
+
+    if (len <= 0) {
+        return NULL;
+    }
+
+    /* _sensorLines[] is sorted, only look at names with the same first
+     * character. */
+    switch (name[0]) {
+        case 'a': first = 0;  last = 0;  break;
+        case 'g': first = 1;  last = 2;  break;
+        case 'h': first = 3;  last = 3;  break;
+        case 'l': first = 4;  last = 4;  break;
+        case 'm': first = 5;  last = 6;  break;
+        case 'o': first = 7;  last = 7;  break;
+        case 'p': first = 8;  last = 9;  break;
+        case 's': first = 10; last = 10; break;
+        case 't': first = 11; last = 11; break;
+        case 'w': first = 12; last = 12; break;
+        default:
+            return NULL;
+    }
+
+    for (nn = first; nn <= last; nn++) {
+        if (_sensorLines[nn].len == len &&
+            !memcmp(_sensorLines[nn].name, name, len)) {
+            return &_sensorLines[nn];
+        }
+    }
+    return NULL;
+}
+
+static const double _powersOf10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+    1e20, 1e21, 1e22,
+};
+
+#define  MAX_EXACT_POWER_OF_10  22
+
+/* Parse a float in the "%g" format the emulator uses, from |p| up to |end|.
+ * Returns a pointer after it, or NULL if there is no number there. Anything
+ * that can't be converted exactly here, such as "inf" or numbers with more
+ * than 18 digits, is left to strtof().
+ */
+static const char* _parseFloat(const char* p, const char* end, float* value)
+{
+    const char* start = p;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0, negative = 0;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+    for (; p < end && (unsigned)(*p - '0') < 10; p++, digits++) {
+        mantissa = mantissa * 10 + (*p - '0');
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && (unsigned)(*p - '0') < 10; p++, digits++) {
+            mantissa = mantissa * 10 + (*p - '0');
+            exponent--;
+        }
+    }
+    if (p < end && digits > 0 && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        int exp_negative = 0, exp_value = 0, exp_digits = 0;
+
+        if (q < end && (*q == '-' || *q == '+')) {
+            exp_negative = (*q == '-');
+            q++;
+        }
+        for (; q < end && (unsigned)(*q - '0') < 10 && exp_digits < 4;
+             q++, exp_digits++) {
+            exp_value = exp_value * 10 + (*q - '0');
+        }
+        if (exp_digits > 0) {
+            exponent += exp_negative ? -exp_value : exp_value;
+            p = q;
+        }
+    }
+
+    if (digits == 0 || digits > 18 || exponent < -MAX_EXACT_POWER_OF_10 ||
+        exponent > MAX_EXACT_POWER_OF_10 ||
+        (p < end && (unsigned)(*p - '0') < 10)) {
+        char temp[64];
+        int len = end - start;
+        char* q;
+
+        if (len >= (int)sizeof(temp)) {
+            len = sizeof(temp) - 1;
+        }
+        memcpy(temp, start, len);
+        temp[len] = 0;
+        *value = strtof(temp, &q);
+        return (q == temp) ? NULL : start + (q - temp);
+    }
+
+    double result = (double)mantissa;
+    if (exponent < 0) {
+        result /= _powersOf10[-exponent];
+    } else {
+        result *= _powersOf10[exponent];
+    }
+    *value = (float)(negative ? -result : result);
+    return p;
+}
+
+/* Parse a decimal integer from |p| up to |end|. Returns a pointer after it,
+ * or NULL if there is no number there. */
+static const char* _parseInt64(const char* p, const char* end, int64_t* value)
+{
+    uint64_t result = 0;
+    int negative = 0;
+    const char* digits;
+
+    if (p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+    for (digits = p; p < end && (unsigned)(*p - '0') < 10; p++) {
+        result = result * 10 + (*p - '0');
+    }
+    if (p == digits || p - digits > 18) {
+        return NULL;
+    }
+    *value = negative ? -(int64_t)result : (int64_t)result;
+    return p;
+}
+
+/* Parse the |len| characters of |buff| received from the emulator. On
+ * success, return the matching _sensorLines[] entry, with its values in
+ * |values| (for LINE_SENSOR) or |*time| (for syncs). Return NULL for
+ * unsupported or malformed lines.
+ */
+static const SensorLine* sensor_line_parse(const char* buff, int len,
+                                           float* values, int64_t* time)
+{
+    const char* end = buff + len;
+    const char* colon = memchr(buff, ':', len);
+    const SensorLine* line;
+    const char* p;
+    int nn;
+
+    line = _sensorLineFromName(buff, colon ? colon - buff : len);
+    if (line == NULL) {
+        return NULL;
+    }
+    if (line->kind == LINE_WAKE) {
+        return colon ? NULL : line;
+    }
+    if (colon == NULL) {
+        return NULL;
+    }
+
+    p = colon + 1;
+    if (line->kind != LINE_SENSOR) {
+        return _parseInt64(p, end, time) ? line : NULL;
+    }
+
+    for (nn = 0; nn < line->count; nn++) {
+        if (nn > 0) {
+            if (p >= end || *p != ':') {
+                return NULL;
+            }
+            p++;
+        }
+        p = _parseFloat(p, end, &values[nn]);
+        if (p == NULL) {
+            return NULL;
+        }
+    }
+    return line;
+}
+
+/** BINARY SENSOR FRAMES
+ **
+ ** After the HAL sends "protocol:binary", an emulator that supports it sends
+ ** each epoch as one message: a SensorFrameHeader followed by |count|
+ ** SensorFrameRecord, in the guest's byte order. This replaces the text
+ ** lines of the sensors and the syncs that follow them. The first byte of
+ ** a frame is 0, which never starts a text line, so an emulator that
+ ** ignores the command and keeps sending text still works, as does "wake".
+ **/
+
+#define  SENSOR_FRAME_MAGIC        "\0sf1"
+#define  SENSOR_FRAME_GUEST_TIME   (1 << 0)   /* |time| is as "guest-sync" */
+#define  SENSOR_FRAME_MAX_RECORDS  32
+
+typedef struct {
+    char      magic[4];   /* SENSOR_FRAME_MAGIC */
+    uint16_t  count;      /* number of records that follow */
+    uint16_t  flags;      /* SENSOR_FRAME_* */
+} SensorFrameHeader;
+
+typedef struct {
+    int64_t   time;       /* as "sync:", in micro-seconds */
+    float     values[3];
+    uint8_t   id;         /* sensor handle, ID_* */
+    uint8_t   reserved[3];
+} SensorFrameRecord;
+
+#define  SENSOR_FRAME_MAX_SIZE \
+    (sizeof(SensorFrameHeader) + \
+     SENSOR_FRAME_MAX_RECORDS * sizeof(SensorFrameRecord))
+
+/* Return the number of records of the frame in the |len| bytes of |buff|,
+ * and set |*flags|, or -1 if this isn't a well-formed frame. */
+static int sensor_frame_parse(const char* buff, int len, int* flags)
+{
+    SensorFrameHeader header;
+
+    if (len < (int)sizeof(header) ||
+        memcmp(buff, SENSOR_FRAME_MAGIC, sizeof(header.magic))) {
+        return -1;
+    }
+    memcpy(&header, buff, sizeof(header));
+    if (header.count > SENSOR_FRAME_MAX_RECORDS ||
+        len != (int)(sizeof(header) + header.count * sizeof(SensorFrameRecord))) {
+        return -1;
+    }
+    *flags = header.flags;
+    return header.count;
+}
+
+/* Return the _sensorLines[] entry of sensor |id|, or NULL. */
+static const SensorLine* _sensorLineFromId(int id)
+{
+    for (size_t nn = 0; nn < sizeof(_sensorLines) / sizeof(_sensorLines[0]);
+         nn++) {
+        if (_sensorLines[nn].kind == LINE_SENSOR && _sensorLines[nn].id == id) {
+            return &_sensorLines[nn];
+        }
+    }
+    return NULL;
+}
+
+/* Store the |values| of a |line| in |event|. */
+static void _sensorEventSet(sensors_event_t* event, const SensorLine* line,
+                            const float* values)
+{
+    for (int nn = 0; nn < line->count; nn++) {
+        event->data[nn] = values[nn];
+    }
+    if (line->status) {
+        /* magnetic and orientation share the sensors_vec_t layout */
+        event->magnetic.status = SENSOR_STATUS_ACCURACY_HIGH;
+    }
+    event->type = line->type;
+}
+
 /** SENSORS POLL DEVICE
  **
  ** This one is used to read sensor data from the hardware.
@@ -139,18 +450,153 @@ static int64_t now_ns(void) {
  ** emulator through the QEMUD channel.
  **/
 
+/* Events of one sensor waiting to be returned by poll(), oldest first.
+ * Sensor events are never dropped: the reader's queue is only drained into
+ * a FIFO that has room, and a full FIFO stalls the drain, counted in
+ * |stalls|, until poll() takes its events. Flush-complete events have
+ * SENSOR_FIFO_FLUSHES slots on top of the SENSOR_FIFO_SIZE sensor events.
+ *
+ * The events of a batched sensor are held until the report latency of the
+ * oldest one expires, or the FIFO reaches SENSOR_FIFO_WATERMARK, which
+ * leaves room for the events that arrive before the next poll().
+ */
+#define SENSOR_FIFO_SIZE 256
+#define SENSOR_FIFO_FLUSHES 16
+#define SENSOR_FIFO_CAPACITY (SENSOR_FIFO_SIZE + SENSOR_FIFO_FLUSHES)
+#define SENSOR_FIFO_WATERMARK (SENSOR_FIFO_SIZE * 3 / 4)
+
+/* The sensors that honor max_report_latency_ns in batch(). Wake-up sensors
+ * would need a FIFO of their own, so proximity events are never held. */
+#define BATCHED_SENSORS  (SUPPORTED_SENSORS & ~(1U << ID_PROXIMITY))
+
+typedef struct SensorFifo {
+    sensors_event_t  events[SENSOR_FIFO_CAPACITY];
+    int              head;
+    int              count;
+    int              flushes;   /* flush-complete events in |events| */
+    uint32_t         stalls;
+} SensorFifo;
+
+/* A sensor direct channel: a ring of sensors_event_t in memory shared with
+ * a client, written by the reader thread without going through poll().
+ * Each event carries the report token of its sensor in |sensor|, and a
+ * counter in |reserved0| that is written last, so that the client knows
+ * when it is complete.
+ *
+ * Only SENSOR_DIRECT_RATE_NORMAL (50 Hz) is supported, the emulator doesn't
+ * report faster than 100 Hz.
+ */
+#define MAX_DIRECT_CHANNELS 4
+#define DIRECT_NORMAL_PERIOD_NS  20000000LL
+
+#define DIRECT_SENSORS  ((1U << ID_ACCELERATION) | \
+                         (1U << ID_GYROSCOPE) | \
+                         (1U << ID_MAGNETIC_FIELD) | \
+                         (1U << ID_MAGNETIC_FIELD_UNCALIBRATED))
+
+#define SENSOR_FLAG_DIRECT \
+    (SENSOR_FLAG_DIRECT_CHANNEL_ASHMEM | \
+     (SENSOR_DIRECT_RATE_NORMAL << SENSOR_FLAG_SHIFT_DIRECT_REPORT))
+
+typedef struct SensorDirectChannel {
+    int               handle;    /* 0 if unused */
+    sensors_event_t*  events;
+    size_t            size;      /* of the mapping */
+    int               capacity;  /* number of |events| */
+    int               next;      /* index of the next event to write */
+    int32_t           counter;   /* |reserved0| of the last event */
+    uint32_t          sensors;   /* reported to this channel */
+    int64_t           nextSampleTime[MAX_NUM_SENSORS];
+} SensorDirectChannel;
+
+/* Events parsed by the reader thread, waiting for poll() to take them.
+ * There is a single producer and a single consumer: the reader thread only
+ * writes |tail| and poll() only writes |head|, so neither needs the device's
+ * lock. When it is full, the reader thread waits for poll() to take events,
+ * and the emulator's channel fills up as it did when poll() read it.
+ */
+#define SENSOR_QUEUE_SIZE 1024   /* a power of 2 */
+
+typedef struct SensorQueue {
+    sensors_event_t  events[SENSOR_QUEUE_SIZE];   /* |sensor| is the id */
+    uint32_t         head;
+    uint32_t         tail;
+} SensorQueue;
+
 typedef struct SensorDevice {
     struct sensors_poll_device_1  device;
-    sensors_event_t               sensors[MAX_NUM_SENSORS];
-    uint32_t                      pendingSensors;
+    /* Owned by the reader thread. */
+    sensors_event_t               sensors[MAX_NUM_SENSORS];  /* since last sync */
     int64_t                       timeStart;
     int64_t                       timeOffset;
-    uint32_t                      active_sensors;
+    SensorQueue                   queue;
+    /* Protected by |lock|. */
+    SensorFifo                    fifos[MAX_NUM_SENSORS];
+    int64_t                       reportLatency[MAX_NUM_SENSORS];
+    int64_t                       samplingPeriod[MAX_NUM_SENSORS];
+    int64_t                       nextSampleTime[MAX_NUM_SENSORS];
+    int                           hostDelayMs;   /* last "set-delay" sent */
+    uint32_t                      flushingSensors;   /* with |waitingFlushes| */
+    int                           waitingFlushes[MAX_NUM_SENSORS];
+    uint32_t                      flushPosition[MAX_NUM_SENSORS];   /* in |queue| */
+    uint32_t                      pendingSensors;   /* non-empty |fifos| */
+    int                           pendingEvents;
+    uint32_t                      active_sensors;   /* read by the reader */
+    int                           lastDirectChannel;   /* last handle */
+    uint32_t                      directSensors;   /* read by the reader */
+    uint32_t                      hostSensors;   /* enabled with "set:" */
     int                           fd;
-    int                           flush_count[MAX_NUM_SENSORS];
+    pthread_t                     reader;
+    int                           readerStarted;
+    int                           readerError;   /* -errno once it stopped */
+    int                           wakeReceived;   /* "wake" from the emulator */
+    int                           wakeFd;   /* interrupts a blocked poll() */
+    int                           stopFd;   /* stops the reader thread */
+    int                           spaceFd;   /* |queue| isn't full anymore */
+    int                           readerWaiting;   /* for |spaceFd| */
     pthread_mutex_t               lock;
+    /* Protected by |directLock|, which nests in |lock|. The reader thread
+     * writes the events to the channels itself. */
+    SensorDirectChannel           directChannels[MAX_DIRECT_CHANNELS];
+    pthread_mutex_t               directLock;
 } SensorDevice;
 
+static int sensor_device_start_reader_locked(SensorDevice* dev);
+static int sensor_device_send_command_locked(SensorDevice* dev,
+                                             const char* cmd);
+static int sensor_device_update_host_sensors_locked(SensorDevice* dev);
+
+/* Return whether the FIFO has no room for another sensor event. */
+static int sensor_fifo_full(const SensorFifo* fifo)
+{
+    return fifo->count - fifo->flushes >= SENSOR_FIFO_SIZE;
+}
+
+/* Append |event| to the FIFO of sensor |id|. Return 0 on success, or
+ * -ENOSPC if there is no room for it.
+ *
+ * Note: The device's lock must be acquired.
+ */
+static int sensor_device_queue_event_locked(SensorDevice* d, int id,
+                                            const sensors_event_t* event)
+{
+    SensorFifo* fifo = &d->fifos[id];
+
+    if (event->type == SENSOR_TYPE_META_DATA ?
+            fifo->flushes == SENSOR_FIFO_FLUSHES : sensor_fifo_full(fifo)) {
+        return -ENOSPC;
+    }
+
+    fifo->events[(fifo->head + fifo->count) % SENSOR_FIFO_CAPACITY] = *event;
+    fifo->count++;
+    if (event->type == SENSOR_TYPE_META_DATA) {
+        fifo->flushes++;
+    }
+    d->pendingEvents++;
+    d->pendingSensors |= 1U << id;
+    return 0;
+}
+
 /* Grab the file descriptor to the emulator's sensors service pipe.
  * This function returns a file descriptor on success, or -errno on
  * failure, and assumes the SensorDevice instance's lock is held.
@@ -179,7 +625,8 @@ typedef struct SensorDevice {
  *              for set_delay()/activate()/batch() when supporting HAL 1.3
  */
 static int sensor_device_get_fd_locked(SensorDevice* dev) {
-    /* Create connection to service on first call */
+    /* Create connection to service on first call, and the thread that
+     * reads the events from it. */
     if (dev->fd < 0) {
         dev->fd = qemud_channel_open(SENSORS_SERVICE_NAME);
         if (dev->fd < 0) {
@@ -188,6 +635,22 @@ static int sensor_device_get_fd_locked(SensorDevice* dev) {
                 strerror(-ret));
             return ret;
         }
+        int ret = sensor_device_start_reader_locked(dev);
+        if (ret < 0) {
+            close(dev->fd);
+            dev->fd = -1;
+            return ret;
+        }
+
+        /* Each connection is a new client of the emulator's service: give
+         * it the guest time, ask for binary frames, which an emulator
+         * without them ignores, and enable the sensors a previous
+         * connection had enabled. */
+        char command[64];
+        snprintf(command, sizeof command, "time:%lld", (long long)now_ns());
+        sensor_device_send_command_locked(dev, command);
+        sensor_device_send_command_locked(dev, "protocol:binary");
+        sensor_device_update_host_sensors_locked(dev);
     }
     return dev->fd;
 }
@@ -210,9 +673,79 @@ static int sensor_device_send_command_locked(SensorDevice* dev,
     return ret;
 }
 
-/* Pick up one pending sensor event. On success, this returns the sensor
- * id, and sets |*event| accordingly. On failure, i.e. if there are no
- * pending events, return -EINVAL.
+/* Set the emulator's report rate to the fastest sampling period of the
+ * active sensors, and of the direct channels, if it changed. Return 0 on
+ * success, or -errno.
+ *
+ * Note: The device's lock must be acquired.
+ */
+static int sensor_device_update_host_delay_locked(SensorDevice* dev)
+{
+    uint32_t mask = dev->active_sensors;
+    int64_t period = dev->directSensors ? DIRECT_NORMAL_PERIOD_NS : INT64_MAX;
+
+    while (mask) {
+        uint32_t i = 31 - __builtin_clz(mask);
+        mask &= ~(1U << i);
+        if (dev->samplingPeriod[i] > 0 && dev->samplingPeriod[i] < period) {
+            period = dev->samplingPeriod[i];
+        }
+    }
+    if (period == INT64_MAX) {
+        return 0;
+    }
+
+    int ms = (int)(period / 1000000);
+    if (ms == dev->hostDelayMs) {
+        return 0;
+    }
+
+    char command[64];
+    snprintf(command, sizeof command, "set-delay:%d", ms);
+
+    int ret = sensor_device_send_command_locked(dev, command);
+    if (ret < 0) {
+        E("%s: Could not send command: %s", __FUNCTION__, strerror(-ret));
+        return ret;
+    }
+    dev->hostDelayMs = ms;
+    return 0;
+}
+
+/* Enable the sensors of the poll() clients and of the direct channels in
+ * the emulator, disable the others, then update its report rate. Return 0
+ * on success, or -errno.
+ *
+ * Note: The device's lock must be acquired.
+ */
+static int sensor_device_update_host_sensors_locked(SensorDevice* dev)
+{
+    uint32_t wanted = dev->active_sensors | dev->directSensors;
+    uint32_t changed = dev->hostSensors ^ wanted;
+
+    while (changed) {
+        uint32_t i = 31 - __builtin_clz(changed);
+        changed &= ~(1U << i);
+
+        int enabled = (wanted & (1U << i)) != 0;
+        char command[64];
+        snprintf(command, sizeof command, "set:%s:%d",
+                 _sensorIdToName(i), enabled);
+
+        int ret = sensor_device_send_command_locked(dev, command);
+        if (ret < 0) {
+            E("%s: when sending command errno=%d: %s", __FUNCTION__, -ret,
+              strerror(-ret));
+            return ret;
+        }
+        dev->hostSensors ^= 1U << i;
+    }
+    return sensor_device_update_host_delay_locked(dev);
+}
+
+/* Pick up the oldest pending sensor event. On success, this returns the
+ * sensor id, and sets |*event| accordingly. On failure, i.e. if there are
+ * no pending events, return -EINVAL.
  *
  * Note: The device's lock must be acquired.
  */
@@ -220,39 +753,43 @@ static int sensor_device_pick_pending_event_locked(SensorDevice* d,
                                                    sensors_event_t*  event)
 {
     uint32_t mask = SUPPORTED_SENSORS & d->pendingSensors;
-    if (mask) {
+    int oldest = -1;
+
+    while (mask) {
         uint32_t i = 31 - __builtin_clz(mask);
-        d->pendingSensors &= ~(1U << i);
+        mask &= ~(1U << i);
+
+        const SensorFifo* fifo = &d->fifos[i];
+        if (oldest < 0 ||
+            fifo->events[fifo->head].timestamp <
+                d->fifos[oldest].events[d->fifos[oldest].head].timestamp) {
+            oldest = i;
+        }
+    }
+
+    if (oldest >= 0) {
+        SensorFifo* fifo = &d->fifos[oldest];
         // Copy the structure
-        *event = d->sensors[i];
-
-        if (d->sensors[i].type == SENSOR_TYPE_META_DATA) {
-            if (d->flush_count[i] > 0) {
-                // Another 'flush' is queued after this one.
-                // Don't clear this event; just decrement the count.
-                (d->flush_count[i])--;
-                // And re-mark it as pending
-                d->pendingSensors |= (1U << i);
-            } else {
-                // We are done flushing
-                // sensor_device_poll_event_locked() will leave
-                // the meta-data in place until we have it.
-                // Set |type| to something other than META_DATA
-                // so sensor_device_poll_event_locked() can
-                // continue.
-                d->sensors[i].type = SENSOR_TYPE_META_DATA + 1;
-            }
+        *event = fifo->events[fifo->head];
+        fifo->head = (fifo->head + 1) % SENSOR_FIFO_CAPACITY;
+        if (--fifo->count == 0) {
+            d->pendingSensors &= ~(1U << oldest);
+        }
+        d->pendingEvents--;
+
+        if (event->type == SENSOR_TYPE_META_DATA) {
+            fifo->flushes--;
         } else {
-            event->sensor = i;
+            event->sensor = oldest;
             event->version = sizeof(*event);
         }
 
         D("%s: %d [%f, %f, %f]", __FUNCTION__,
-                i,
+                oldest,
                 event->data[0],
                 event->data[1],
                 event->data[2]);
-        return i;
+        return oldest;
     }
     E("No sensor to return!!! pendingSensors=0x%08x", d->pendingSensors);
     // we may end-up in a busy loop, slow things down, just in case.
@@ -260,179 +797,400 @@ static int sensor_device_pick_pending_event_locked(SensorDevice* d,
     return -EINVAL;
 }
 
-/* Block until new sensor events are reported by the emulator, or if a
- * 'wake' command is received through the service. On succes, return 0
- * and updates the |pendingEvents| and |sensors| fields of |dev|.
- * On failure, return -errno.
+/* Return the time at which the pending events must be reported to the
+ * framework, or INT64_MAX if there are none. This is 0 if a FIFO holds an
+ * event of a sensor that is not batched or a flush-complete event, or
+ * reached its watermark.
  *
- * Note: The device lock must be acquired when calling this function, and
- *       will still be held on return. However, the function releases the
- *       lock temporarily during the blocking wait.
+ * Note: The device's lock must be acquired.
  */
-static int sensor_device_poll_event_locked(SensorDevice* dev)
+static int64_t sensor_device_report_time_locked(const SensorDevice* d)
 {
-    D("%s: dev=%p", __FUNCTION__, dev);
+    uint32_t mask = d->pendingSensors;
+    int64_t report_time = INT64_MAX;
 
-    int fd = sensor_device_get_fd_locked(dev);
-    if (fd < 0) {
-        E("%s: Could not get pipe channel: %s", __FUNCTION__, strerror(-fd));
-        return fd;
+    while (mask) {
+        uint32_t i = 31 - __builtin_clz(mask);
+        mask &= ~(1U << i);
+
+        const SensorFifo* fifo = &d->fifos[i];
+        if (d->reportLatency[i] <= 0 || fifo->flushes > 0 ||
+            fifo->count >= SENSOR_FIFO_WATERMARK) {
+            return 0;
+        }
+        int64_t t = fifo->events[fifo->head].timestamp + d->reportLatency[i];
+        if (t < report_time) {
+            report_time = t;
+        }
     }
+    return report_time;
+}
 
-    // Accumulate pending events into |events| and |new_sensors| mask
-    // until a 'sync' or 'wake' command is received. This also simplifies the
-    // code a bit.
-    uint32_t new_sensors = 0U;
-    sensors_event_t* events = dev->sensors;
+/* Make a blocked poll() take the events the reader thread pushed, and
+ * re-check whether pending events must be reported now. */
+static void sensor_device_wake(SensorDevice* dev)
+{
+    uint64_t one = 1;
+    if (write(dev->wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        E("%s: Could not wake poll(): %s", __FUNCTION__, strerror(errno));
+    }
+}
 
-    int64_t event_time = -1;
-    int ret = 0;
+/* The emulator reports all the active sensors at a single rate, set with
+ * "set-delay:<ms>". It is set to the fastest rate requested, and the events
+ * of slower sensors are decimated to their own sampling period here.
+ *
+ * Return true if an event at |t| is due for a client that wants one every
+ * |period|, and advance |*next_time|. Half a period of slack absorbs the
+ * jitter of the emulator's timer, and advancing by whole periods keeps the
+ * average rate.
+ */
+static int _sampleDue(int64_t period, int64_t* next_time, int64_t t)
+{
+    if (period <= 0) {
+        return 1;
+    }
+    if (t < *next_time - period / 2) {
+        return 0;
+    }
+    *next_time += period;
+    if (*next_time <= t) {
+        *next_time = t + period;
+    }
+    return 1;
+}
 
-    int64_t guest_event_time = -1;
-    int has_guest_event_time = 0;
+/* Write |event| of sensor |id| to the direct channels it is reported to.
+ *
+ * Note: The device's |directLock| must be acquired.
+ */
+static void sensor_device_report_direct_locked(SensorDevice* dev, int id,
+                                               const sensors_event_t* event)
+{
+    for (int nn = 0; nn < MAX_DIRECT_CHANNELS; nn++) {
+        SensorDirectChannel* channel = &dev->directChannels[nn];
 
+        if (!(channel->sensors & (1U << id)) ||
+            !_sampleDue(DIRECT_NORMAL_PERIOD_NS, &channel->nextSampleTime[id],
+                        event->timestamp)) {
+            continue;
+        }
 
-    for (;;) {
-        /* Release the lock since we're going to block on recv() */
-        pthread_mutex_unlock(&dev->lock);
+        sensors_event_t* slot = &channel->events[channel->next];
+        int32_t counter = channel->counter + 1;
+        if (counter <= 0) {
+            counter = 1;   /* 0 marks an event that was never written */
+        }
 
-        /* read the next event */
-        char buff[256];
-        int len = qemud_channel_recv(fd, buff, sizeof(buff) - 1U);
-        /* re-acquire the lock to modify the device state. */
-        pthread_mutex_lock(&dev->lock);
+        /* Invalidate the slot while it is rewritten, then publish it. */
+        __atomic_store_n(&slot->reserved0, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot->version = sizeof(*slot);
+        slot->sensor = id + 1;   /* the report token, see config_direct_report() */
+        slot->type = event->type;
+        slot->timestamp = event->timestamp;
+        memcpy(slot->data, event->data, sizeof(slot->data));
+        slot->flags = 0;
+        __atomic_store_n(&slot->reserved0, counter, __ATOMIC_RELEASE);
+
+        channel->counter = counter;
+        channel->next = (channel->next + 1) % channel->capacity;
+    }
+}
 
-        if (len < 0) {
+/* Queue the timestamped |event| of sensor |id| for poll() if it is
+ * active and due.
+ *
+ * Note: The device's lock must be acquired.
+ */
+static void sensor_device_dispatch_event_locked(SensorDevice* dev, int id,
+                                                const sensors_event_t* event)
+{
+    if ((dev->active_sensors & (1U << id)) &&
+        _sampleDue(dev->samplingPeriod[id], &dev->nextSampleTime[id],
+                   event->timestamp)) {
+        sensor_device_queue_event_locked(dev, id, event);
+    }
+}
+
+/** SENSOR READER THREAD
+ **
+ ** A thread owns the reads from the emulator's channel: it parses and
+ ** timestamps the events of each batch, writes them to the direct
+ ** channels, pushes them to |queue| and wakes poll() up. It never takes
+ ** the device's lock, so that neither the event traffic nor poll() delay
+ ** activate(), batch(), flush() and the others, which send their commands
+ ** to the channel directly.
+ **/
+
+/* Append |event| of sensor |id| to |queue|. Return 0 on success, or
+ * -ENOSPC if it is full.
+ *
+ * Note: Called from the reader thread only.
+ */
+static int sensor_queue_push(SensorQueue* queue, int id,
+                             const sensors_event_t* event)
+{
+    uint32_t tail = queue->tail;
+
+    if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) ==
+        SENSOR_QUEUE_SIZE) {
+        return -ENOSPC;
+    }
+    sensors_event_t* slot = &queue->events[tail & (SENSOR_QUEUE_SIZE - 1)];
+    *slot = *event;
+    slot->sensor = id;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Return the oldest event of |queue|, or NULL if it is empty. It stays
+ * queued until sensor_queue_pop().
+ *
+ * Note: Called from poll() only.
+ */
+static const sensors_event_t* sensor_queue_peek(SensorQueue* queue)
+{
+    uint32_t head = queue->head;
+
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &queue->events[head & (SENSOR_QUEUE_SIZE - 1)];
+}
+
+/* Remove the oldest event of |queue|, which must not be empty.
+ *
+ * Note: Called from poll() only.
+ */
+static void sensor_queue_pop(SensorQueue* queue)
+{
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Write |event| of sensor |id| to the direct channels, then push it for
+ * poll() if the sensor is active, waiting while the queue is full. Return
+ * 0 on success, or -EINTR if the reader thread must stop. */
+static int sensor_reader_push(SensorDevice* dev, int id,
+                              const sensors_event_t* event)
+{
+    /* The direct channels get the event whether or not poll() takes it. */
+    if (__atomic_load_n(&dev->directSensors, __ATOMIC_RELAXED) & (1U << id)) {
+        pthread_mutex_lock(&dev->directLock);
+        sensor_device_report_direct_locked(dev, id, event);
+        pthread_mutex_unlock(&dev->directLock);
+    }
+    if (!(__atomic_load_n(&dev->active_sensors, __ATOMIC_RELAXED) &
+          (1U << id))) {
+        return 0;
+    }
+    if (sensor_queue_push(&dev->queue, id, event) == 0) {
+        return 0;
+    }
+
+    /* Have poll() take the queued events, and signal |spaceFd| once it
+     * did. The fences pair with the one in sensor_device_drain_queue_locked()
+     * so that either it sees |readerWaiting|, or the retry sees the space. */
+    __atomic_store_n(&dev->readerWaiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    sensor_device_wake(dev);
+
+    int ret = 0;
+    while (sensor_queue_push(&dev->queue, id, event) < 0) {
+        struct pollfd pfds[2] = {
+            { .fd = dev->spaceFd, .events = POLLIN },
+            { .fd = dev->stopFd, .events = POLLIN },
+        };
+        if (poll(pfds, 2, -1) < 0 && errno != EINTR) {
             ret = -errno;
-            E("%s(fd=%d): Could not receive event data len=%d, errno=%d: %s",
-              __FUNCTION__, fd, len, errno, strerror(errno));
             break;
         }
-        buff[len] = 0;
-        D("%s(fd=%d): received [%s]", __FUNCTION__, fd, buff);
+        if (pfds[1].revents & POLLIN) {
+            ret = -EINTR;
+            break;
+        }
+        if (pfds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(dev->spaceFd, &count, sizeof(count)) < 0) {
+                D("%s: space fd: %s", __FUNCTION__, strerror(errno));
+            }
+        }
+    }
+    __atomic_store_n(&dev->readerWaiting, 0, __ATOMIC_RELAXED);
+    return ret;
+}
+
+/* Convert the |event_time| of a "sync:<time>", in micro-seconds, to the
+ * timestamp of its events. |now| is now_ns().
+ */
+static int64_t sensor_reader_event_time(SensorDevice* dev,
+                                        int64_t event_time,
+                                        int64_t now)
+{
+    int64_t t = (event_time < 0) ? 0 : event_time * 1000LL;
+
+    /* Use the time at the first "sync:" as the base for later
+     * time values.
+     * CTS tests require sensors to return an event timestamp (sync) that is
+     * strictly before the time of the event arrival. We don't actually have
+     * a time syncronization protocol here, and the only data point is the
+     * "sync:" timestamp - which is an emulator's timestamp of a clock that
+     * is synced with the guest clock, and it only the timestamp after all
+     * events were sent.
+     * To make it work, let's compare the calculated timestamp with current
+     * time and take the lower value - we don't believe in events from the
+     * future anyway.
+     */
+    if (dev->timeStart == 0) {
+        dev->timeStart  = now;
+        dev->timeOffset = dev->timeStart - t;
+    }
+    t += dev->timeOffset;
+    if (t > now) {
+        t = now;
+    }
+    return t;
+}
+
+/* Timestamp the events of |new_sensors| received before a "sync:<time>"
+ * and push them. |guest_event_time| is the time of a "guest-sync", or -1.
+ */
+static void sensor_reader_push_batch(SensorDevice* dev,
+                                     uint32_t new_sensors,
+                                     int64_t event_time,
+                                     int64_t guest_event_time)
+{
+    const int64_t t = sensor_reader_event_time(dev, event_time, now_ns());
+
+    while (new_sensors) {
+        uint32_t i = 31 - __builtin_clz(new_sensors);
+        new_sensors &= ~(1U << i);
+        dev->sensors[i].timestamp =
+                guest_event_time >= 0 ? guest_event_time : t;
+        if (sensor_reader_push(dev, i, &dev->sensors[i]) < 0) {
+            return;
+        }
+    }
+}
+
+/* Push the |count| records of a binary frame that start at |records|. */
+static void sensor_reader_push_frame(SensorDevice* dev, const char* records,
+                                     int count, int flags)
+{
+    const int64_t now = now_ns();
+
+    for (int nn = 0; nn < count; nn++) {
+        SensorFrameRecord record;
+        memcpy(&record, records + nn * sizeof(record), sizeof(record));
+
+        const SensorLine* line = _sensorLineFromId(record.id);
+        if (line == NULL) {
+            D("%s: unsupported sensor %d", __FUNCTION__, record.id);
+            continue;
+        }
+
+        sensors_event_t* event = &dev->sensors[record.id];
+        _sensorEventSet(event, line, record.values);
+        event->timestamp = (flags & SENSOR_FRAME_GUEST_TIME) ? record.time :
+                sensor_reader_event_time(dev, record.time, now);
+        if (sensor_reader_push(dev, record.id, event) < 0) {
+            return;
+        }
+    }
+}
+
+/* Wait until a message from the emulator can be read. Return 1 if there
+ * is one, 0 if the reader thread must stop, or -errno on failure. */
+static int sensor_reader_wait(SensorDevice* dev, int fd)
+{
+    struct pollfd pfds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = dev->stopFd, .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (pfds[1].revents & POLLIN) {
+            return 0;
+        }
+        return 1;
+    }
+}
 
+/* Read the messages from the emulator until sensor_device_stop_reader(),
+ * or a failure which poll() then returns. */
+static void* sensor_reader_thread(void* arg)
+{
+    SensorDevice* dev = arg;
+    const int fd = dev->fd;
 
-        /* "wake" is sent from the emulator to exit this loop. */
-        /* TODO(digit): Is it still needed? */
-        if (!strcmp((const char*)buff, "wake")) {
-            ret = 0x7FFFFFFF;
-            break;
-        }
+    D("%s: dev=%p fd=%d", __FUNCTION__, dev, fd);
 
-        float params[3];
+    // Accumulate the events of a batch into |events| and |new_sensors| mask
+    // until a 'sync' command is received.
+    uint32_t new_sensors = 0U;
+    sensors_event_t* events = dev->sensors;
 
-        // If the existing entry for this sensor is META_DATA,
-        // do not overwrite it. We can resume saving sensor
-        // values after that meta data has been received.
-
-        /* "acceleration:<x>:<y>:<z>" corresponds to an acceleration event */
-        if (sscanf(buff, "acceleration:%g:%g:%g", params+0, params+1, params+2)
-                == 3) {
-            new_sensors |= SENSORS_ACCELERATION;
-            if (events[ID_ACCELERATION].type == SENSOR_TYPE_META_DATA) continue;
-            events[ID_ACCELERATION].acceleration.x = params[0];
-            events[ID_ACCELERATION].acceleration.y = params[1];
-            events[ID_ACCELERATION].acceleration.z = params[2];
-            events[ID_ACCELERATION].type = SENSOR_TYPE_ACCELEROMETER;
-            continue;
-        }
+    int64_t event_time = -1;
+    int ret = 0;
 
-        /* "gyroscope:<x>:<y>:<z>" corresponds to a gyroscope event */
-        if (sscanf(buff, "gyroscope:%g:%g:%g", params+0, params+1, params+2)
-                == 3) {
-            new_sensors |= SENSORS_GYROSCOPE;
-            if (events[ID_GYROSCOPE].type == SENSOR_TYPE_META_DATA) continue;
-            events[ID_GYROSCOPE].gyro.x = params[0];
-            events[ID_GYROSCOPE].gyro.y = params[1];
-            events[ID_GYROSCOPE].gyro.z = params[2];
-            events[ID_GYROSCOPE].type = SENSOR_TYPE_GYROSCOPE;
-            continue;
-        }
+    int64_t guest_event_time = -1;
+    int has_guest_event_time = 0;
 
-        /* "orientation:<azimuth>:<pitch>:<roll>" is sent when orientation
-         * changes */
-        if (sscanf(buff, "orientation:%g:%g:%g", params+0, params+1, params+2)
-                == 3) {
-            new_sensors |= SENSORS_ORIENTATION;
-            if (events[ID_ORIENTATION].type == SENSOR_TYPE_META_DATA) continue;
-            events[ID_ORIENTATION].orientation.azimuth = params[0];
-            events[ID_ORIENTATION].orientation.pitch   = params[1];
-            events[ID_ORIENTATION].orientation.roll    = params[2];
-            events[ID_ORIENTATION].orientation.status  =
-                    SENSOR_STATUS_ACCURACY_HIGH;
-            events[ID_ORIENTATION].type = SENSOR_TYPE_ORIENTATION;
-            continue;
+    for (;;) {
+        /* Between batches, check whether to stop. */
+        if (new_sensors == 0U) {
+            ret = sensor_reader_wait(dev, fd);
+            if (ret <= 0) {
+                break;
+            }
         }
 
-        /* "magnetic:<x>:<y>:<z>" is sent for the params of the magnetic
-         * field */
-        if (sscanf(buff, "magnetic:%g:%g:%g", params+0, params+1, params+2)
-                == 3) {
-            new_sensors |= SENSORS_MAGNETIC_FIELD;
-            if (events[ID_MAGNETIC_FIELD].type == SENSOR_TYPE_META_DATA) continue;
-            events[ID_MAGNETIC_FIELD].magnetic.x = params[0];
-            events[ID_MAGNETIC_FIELD].magnetic.y = params[1];
-            events[ID_MAGNETIC_FIELD].magnetic.z = params[2];
-            events[ID_MAGNETIC_FIELD].magnetic.status =
-                    SENSOR_STATUS_ACCURACY_HIGH;
-            events[ID_MAGNETIC_FIELD].type = SENSOR_TYPE_MAGNETIC_FIELD;
-            continue;
+        /* read the next event, leaving room to terminate a text line
+         * as long as the largest frame */
+        char buff[SENSOR_FRAME_MAX_SIZE + 1];
+        int len = qemud_channel_recv(fd, buff, sizeof(buff) - 1U);
+        if (len < 0) {
+            ret = errno ? -errno : -EIO;
+            E("%s(fd=%d): Could not receive event data len=%d, errno=%d: %s",
+              __FUNCTION__, fd, len, errno, strerror(errno));
+            break;
         }
 
-        if (sscanf(buff, "magnetic-uncalibrated:%g:%g:%g", params+0, params+1, params+2)
-                == 3) {
-            new_sensors |= SENSORS_MAGNETIC_FIELD_UNCALIBRATED;
-            if (events[ID_MAGNETIC_FIELD_UNCALIBRATED].type == SENSOR_TYPE_META_DATA) continue;
-            events[ID_MAGNETIC_FIELD_UNCALIBRATED].magnetic.x = params[0];
-            events[ID_MAGNETIC_FIELD_UNCALIBRATED].magnetic.y = params[1];
-            events[ID_MAGNETIC_FIELD_UNCALIBRATED].magnetic.z = params[2];
-            events[ID_MAGNETIC_FIELD_UNCALIBRATED].magnetic.status =
-                    SENSOR_STATUS_ACCURACY_HIGH;
-            events[ID_MAGNETIC_FIELD_UNCALIBRATED].type = SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED;
+        int flags;
+        int records = sensor_frame_parse(buff, len, &flags);
+        if (records >= 0) {
+            D("%s(fd=%d): received frame of %d events", __FUNCTION__, fd,
+              records);
+            sensor_reader_push_frame(dev, buff + sizeof(SensorFrameHeader),
+                                     records, flags);
+            sensor_device_wake(dev);
             continue;
         }
 
-        /* "temperature:<celsius>" */
-        if (sscanf(buff, "temperature:%g", params+0) == 1) {
-            new_sensors |= SENSORS_TEMPERATURE;
-            if (events[ID_TEMPERATURE].type == SENSOR_TYPE_META_DATA) continue;
-            events[ID_TEMPERATURE].temperature = params[0];
-            events[ID_TEMPERATURE].type = SENSOR_TYPE_AMBIENT_TEMPERATURE;
-            continue;
-        }
+        buff[len] = 0;
+        D("%s(fd=%d): received [%s]", __FUNCTION__, fd, buff);
 
-        /* "proximity:<value>" */
-        if (sscanf(buff, "proximity:%g", params+0) == 1) {
-            new_sensors |= SENSORS_PROXIMITY;
-            if (events[ID_PROXIMITY].type == SENSOR_TYPE_META_DATA) continue;
-            events[ID_PROXIMITY].distance = params[0];
-            events[ID_PROXIMITY].type = SENSOR_TYPE_PROXIMITY;
-            continue;
-        }
-        /* "light:<lux>" */
-        if (sscanf(buff, "light:%g", params+0) == 1) {
-            new_sensors |= SENSORS_LIGHT;
-            if (events[ID_LIGHT].type == SENSOR_TYPE_META_DATA) continue;
-            events[ID_LIGHT].light = params[0];
-            events[ID_LIGHT].type = SENSOR_TYPE_LIGHT;
-            continue;
-        }
 
-        /* "pressure:<hpa>" */
-        if (sscanf(buff, "pressure:%g", params+0) == 1) {
-            new_sensors |= SENSORS_PRESSURE;
-            if (events[ID_PRESSURE].type == SENSOR_TYPE_META_DATA) continue;
-            events[ID_PRESSURE].pressure = params[0];
-            events[ID_PRESSURE].type = SENSOR_TYPE_PRESSURE;
+        float params[3];
+        int64_t line_time = -1;
+        const SensorLine* line = sensor_line_parse(buff, len, params,
+                                                   &line_time);
+        if (line == NULL) {
+            D("huh ? unsupported command");
             continue;
         }
 
-        /* "humidity:<percent>" */
-        if (sscanf(buff, "humidity:%g", params+0) == 1) {
-            new_sensors |= SENSORS_HUMIDITY;
-            if (events[ID_HUMIDITY].type == SENSOR_TYPE_META_DATA) continue;
-            events[ID_HUMIDITY].relative_humidity = params[0];
-            events[ID_HUMIDITY].type = SENSOR_TYPE_RELATIVE_HUMIDITY;
+        /* "wake" is sent from the emulator to exit poll(). */
+        /* TODO(digit): Is it still needed? */
+        if (line->kind == LINE_WAKE) {
+            __atomic_store_n(&dev->wakeReceived, 1, __ATOMIC_RELEASE);
+            sensor_device_wake(dev);
             continue;
         }
 
@@ -440,7 +1198,8 @@ static int sensor_device_poll_event_locked(SensorDevice* dev)
          * where 'time' is expressed in micro-seconds and corresponds
          * to the VM time when the real poll occured.
          */
-        if (sscanf(buff, "guest-sync:%lld", &guest_event_time) == 1) {
+        if (line->kind == LINE_GUEST_SYNC) {
+            guest_event_time = line_time;
             has_guest_event_time = 1;
             continue;
         }
@@ -449,52 +1208,185 @@ static int sensor_device_poll_event_locked(SensorDevice* dev)
          * where 'time' is expressed in micro-seconds and corresponds
          * to the VM time when the real poll occured.
          */
-        if (sscanf(buff, "sync:%lld", &event_time) == 1) {
-            if (new_sensors) {
-                goto out;
+        if (line->kind == LINE_SYNC) {
+            event_time = line_time;
+            if (!new_sensors) {
+                D("huh ? sync without any sensor data ?");
+                continue;
             }
-            D("huh ? sync without any sensor data ?");
+            sensor_reader_push_batch(dev, new_sensors, event_time,
+                    has_guest_event_time ? guest_event_time : -1);
+            new_sensors = 0U;
+            has_guest_event_time = 0;
+            sensor_device_wake(dev);
             continue;
         }
-        D("huh ? unsupported command");
+
+        /* "<sensor>:<value>[:<value>:<value>]" is a sensor event. */
+        new_sensors |= 1U << line->id;
+
+        _sensorEventSet(&events[line->id], line, params);
     }
-out:
-    if (new_sensors) {
-        /* update the time of each new sensor event. */
-        dev->pendingSensors |= new_sensors;
-        int64_t t = (event_time < 0) ? 0 : event_time * 1000LL;
-
-        /* Use the time at the first "sync:" as the base for later
-         * time values.
-         * CTS tests require sensors to return an event timestamp (sync) that is
-         * strictly before the time of the event arrival. We don't actually have
-         * a time syncronization protocol here, and the only data point is the
-         * "sync:" timestamp - which is an emulator's timestamp of a clock that
-         * is synced with the guest clock, and it only the timestamp after all
-         * events were sent.
-         * To make it work, let's compare the calculated timestamp with current
-         * time and take the lower value - we don't believe in events from the
-         * future anyway.
-         */
-        const int64_t now = now_ns();
 
-        if (dev->timeStart == 0) {
-            dev->timeStart  = now;
-            dev->timeOffset = dev->timeStart - t;
+    if (ret < 0) {
+        __atomic_store_n(&dev->readerError, ret, __ATOMIC_RELEASE);
+        sensor_device_wake(dev);
+    }
+    return NULL;
+}
+
+/* Start the reader thread on |dev->fd|. Return 0 on success, or -errno.
+ *
+ * Note: The device's lock must be acquired.
+ */
+static int sensor_device_start_reader_locked(SensorDevice* dev)
+{
+    int ret = pthread_create(&dev->reader, NULL, sensor_reader_thread, dev);
+    if (ret != 0) {
+        E("%s: Could not start reader thread: %s", __FUNCTION__,
+          strerror(ret));
+        return -ret;
+    }
+    dev->readerStarted = 1;
+    return 0;
+}
+
+/* Stop the reader thread, if it was started, and wait for it. */
+static void sensor_device_stop_reader(SensorDevice* dev)
+{
+    if (!dev->readerStarted) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(dev->stopFd, &one, sizeof(one)) < 0) {
+        E("%s: Could not stop reader thread: %s", __FUNCTION__,
+          strerror(errno));
+        return;
+    }
+    pthread_join(dev->reader, NULL);
+    dev->readerStarted = 0;
+}
+
+/* Close the channel after the reader thread failed, and wait for the
+ * thread, so that the next poll() or command opens a new one. Its client
+ * in the emulator starts with no sensor enabled.
+ *
+ * Note: The device's lock must be acquired.
+ */
+static void sensor_device_reset_channel_locked(SensorDevice* dev)
+{
+    if (dev->readerStarted) {
+        pthread_join(dev->reader, NULL);
+        dev->readerStarted = 0;
+    }
+    if (dev->fd >= 0) {
+        close(dev->fd);
+        dev->fd = -1;
+    }
+    dev->readerError = 0;
+    dev->hostSensors = 0U;
+    dev->hostDelayMs = -1;
+}
+
+/* Queue the flush-complete events of the flushes that wait for events the
+ * reader thread had pushed before them, once those left |queue|.
+ *
+ * Note: The device's lock must be acquired.
+ */
+static void sensor_device_complete_flushes_locked(SensorDevice* dev)
+{
+    uint32_t mask = dev->flushingSensors;
+
+    while (mask) {
+        uint32_t i = 31 - __builtin_clz(mask);
+        mask &= ~(1U << i);
+
+        if ((int32_t)(dev->flushPosition[i] - dev->queue.head) > 0) {
+            continue;
+        }
+
+        sensors_event_t meta;
+        memset(&meta, 0, sizeof(meta));
+        meta.version = META_DATA_VERSION;
+        meta.type = SENSOR_TYPE_META_DATA;
+        meta.sensor = 0;
+        meta.timestamp = 0;
+        meta.meta_data.sensor = i;
+        meta.meta_data.what = META_DATA_FLUSH_COMPLETE;
+
+        while (dev->waitingFlushes[i] > 0 &&
+               sensor_device_queue_event_locked(dev, i, &meta) == 0) {
+            dev->waitingFlushes[i]--;
+        }
+        if (dev->waitingFlushes[i] == 0) {
+            dev->flushingSensors &= ~(1U << i);
+        }
+    }
+}
+
+/* Move the events pushed by the reader thread to the FIFOs. An event
+ * whose FIFO is full stays queued, with the ones after it, so that the
+ * reader thread, and the emulator behind it, wait for poll() instead of
+ * the event being dropped.
+ *
+ * Note: The device's lock must be acquired.
+ */
+static void sensor_device_drain_queue_locked(SensorDevice* dev)
+{
+    const sensors_event_t* event;
+
+    for (;;) {
+        if (dev->flushingSensors) {
+            sensor_device_complete_flushes_locked(dev);
+        }
+        event = sensor_queue_peek(&dev->queue);
+        if (event == NULL) {
+            break;
         }
-        t += dev->timeOffset;
-        if (t > now) {
-            t = now;
+        const int id = event->sensor;
+        SensorFifo* fifo = &dev->fifos[id];
+        if ((dev->active_sensors & (1U << id)) && sensor_fifo_full(fifo)) {
+            fifo->stalls++;
+            if ((fifo->stalls & (fifo->stalls - 1)) == 0) {
+                ALOGW("%s: %s FIFO full, %u stalls", __FUNCTION__,
+                      _sensorIdToName(id), fifo->stalls);
+            }
+            break;
         }
+        sensor_device_dispatch_event_locked(dev, id, event);
+        sensor_queue_pop(&dev->queue);
+    }
 
-        while (new_sensors) {
-            uint32_t i = 31 - __builtin_clz(new_sensors);
-            new_sensors &= ~(1U << i);
-            dev->sensors[i].timestamp =
-                    has_guest_event_time ? guest_event_time : t;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&dev->readerWaiting, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        if (write(dev->spaceFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            E("%s: Could not wake reader: %s", __FUNCTION__, strerror(errno));
+        }
+    }
+}
+
+/* Wait until sensor_device_wake() is called, for no longer than
+ * |report_time|.
+ *
+ * Note: Called without the device's lock.
+ */
+static void sensor_device_wait_wake(SensorDevice* dev, int64_t report_time)
+{
+    struct pollfd pfd = { .fd = dev->wakeFd, .events = POLLIN };
+    int timeout_ms = -1;
+
+    if (report_time != INT64_MAX) {
+        int64_t delay = report_time - now_ns();
+        timeout_ms = (delay <= 0) ? 0 : (int)((delay + 999999) / 1000000);
+    }
+
+    if (poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN)) {
+        uint64_t count;
+        if (read(dev->wakeFd, &count, sizeof(count)) < 0) {
+            D("%s: wake fd: %s", __FUNCTION__, strerror(errno));
         }
     }
-    return ret;
 }
 
 /** SENSORS POLL DEVICE FUNCTIONS **/
@@ -503,10 +1395,21 @@ static int sensor_device_close(struct hw_device_t* dev0)
 {
     SensorDevice* dev = (void*)dev0;
     // Assume that there are no other threads blocked on poll()
+    sensor_device_stop_reader(dev);
     if (dev->fd >= 0) {
         close(dev->fd);
         dev->fd = -1;
     }
+    for (int nn = 0; nn < MAX_DIRECT_CHANNELS; nn++) {
+        if (dev->directChannels[nn].handle > 0) {
+            munmap(dev->directChannels[nn].events,
+                   dev->directChannels[nn].size);
+        }
+    }
+    close(dev->wakeFd);
+    close(dev->stopFd);
+    close(dev->spaceFd);
+    pthread_mutex_destroy(&dev->directLock);
     pthread_mutex_destroy(&dev->lock);
     free(dev);
     return 0;
@@ -534,20 +1437,43 @@ static int sensor_device_poll(struct sensors_poll_device_t *dev0,
 
     int result = 0;
     pthread_mutex_lock(&dev->lock);
-    if (!dev->pendingSensors) {
-        /* Block until there are pending events. Note that this releases
-         * the lock during the blocking call, then re-acquires it before
-         * returning. */
-        int ret = sensor_device_poll_event_locked(dev);
-        if (ret < 0) {
-            result = ret;
-            goto out;
+
+    /* This starts the reader thread on first call. */
+    int fd = sensor_device_get_fd_locked(dev);
+    if (fd < 0) {
+        E("%s: Could not get pipe channel: %s", __FUNCTION__, strerror(-fd));
+        result = fd;
+        goto out;
+    }
+
+    for (;;) {
+        sensor_device_drain_queue_locked(dev);
+
+        int64_t report_time = sensor_device_report_time_locked(dev);
+        if (report_time <= now_ns()) {
+            break;
         }
-        if (!dev->pendingSensors) {
-            /* 'wake' event received before any sensor data. */
-            result = -EIO;
+        if (__atomic_exchange_n(&dev->wakeReceived, 0, __ATOMIC_ACQ_REL)) {
+            if (!dev->pendingSensors) {
+                /* 'wake' event received before any sensor data. */
+                result = -EIO;
+                goto out;
+            }
+            break;
+        }
+        int error = __atomic_load_n(&dev->readerError, __ATOMIC_ACQUIRE);
+        if (error < 0) {
+            /* Report the failure once, the next call reconnects. */
+            sensor_device_reset_channel_locked(dev);
+            result = error;
             goto out;
         }
+
+        /* Block until the reader thread pushes events, or the pending
+         * ones must be reported. The lock is released meanwhile. */
+        pthread_mutex_unlock(&dev->lock);
+        sensor_device_wait_wake(dev, report_time);
+        pthread_mutex_lock(&dev->lock);
     }
     /* Now read as many pending events as needed. */
     int i;
@@ -598,20 +1524,13 @@ static int sensor_device_activate(struct sensors_poll_device_t *dev0,
 
     int ret = 0;
     if (changed) {
-        /* Send command to the emulator. */
-        char command[64];
-        snprintf(command,
-                 sizeof command,
-                 "set:%s:%d",
-                 _sensorIdToName(handle),
-                 enabled != 0);
-
-        ret = sensor_device_send_command_locked(dev, command);
+        /* Send command to the emulator, unless a direct channel already
+         * enabled the sensor there. */
+        __atomic_store_n(&dev->active_sensors, new_sensors, __ATOMIC_RELAXED);
+        dev->nextSampleTime[handle] = 0;
+        ret = sensor_device_update_host_sensors_locked(dev);
         if (ret < 0) {
-            E("%s: when sending command errno=%d: %s", __FUNCTION__, -ret,
-              strerror(-ret));
-        } else {
-            dev->active_sensors = new_sensors;
+            __atomic_store_n(&dev->active_sensors, active, __ATOMIC_RELAXED);
         }
     }
     pthread_mutex_unlock(&dev->lock);
@@ -633,55 +1552,240 @@ static int sensor_device_default_flush(
         return -EINVAL;
     }
 
+    /* The flush completes after the events already received for the
+     * sensor, including those the reader thread pushed to |queue| and
+     * a full FIFO keeps there, so it waits for them to leave it. */
     pthread_mutex_lock(&dev->lock);
-    if ((dev->pendingSensors & (1U << handle)) &&
-        dev->sensors[handle].type == SENSOR_TYPE_META_DATA)
-    {
-        // A 'flush' operation is already pending. Just increment the count.
-        (dev->flush_count[handle])++;
-    } else {
-        dev->flush_count[handle] = 0;
-        dev->sensors[handle].version = META_DATA_VERSION;
-        dev->sensors[handle].type = SENSOR_TYPE_META_DATA;
-        dev->sensors[handle].sensor = 0;
-        dev->sensors[handle].timestamp = 0;
-        dev->sensors[handle].meta_data.sensor = handle;
-        dev->sensors[handle].meta_data.what = META_DATA_FLUSH_COMPLETE;
-        dev->pendingSensors |= (1U << handle);
-    }
+    sensor_device_drain_queue_locked(dev);
+    dev->flushPosition[handle] =
+            __atomic_load_n(&dev->queue.tail, __ATOMIC_ACQUIRE);
+    dev->waitingFlushes[handle]++;
+    dev->flushingSensors |= 1U << handle;
+    sensor_device_complete_flushes_locked(dev);
     pthread_mutex_unlock(&dev->lock);
 
+    /* The batched events before it must be reported now. */
+    sensor_device_wake(dev);
     return 0;
 }
 
 static int sensor_device_set_delay(struct sensors_poll_device_t *dev0,
-                                   int handle __unused,
+                                   int handle,
                                    int64_t ns)
 {
     SensorDevice* dev = (void*)dev0;
 
-    int ms = (int)(ns / 1000000);
-    D("%s: dev=%p delay-ms=%d", __FUNCTION__, dev, ms);
+    D("%s: dev=%p handle=%s (%d) delay-ms=%d", __FUNCTION__, dev,
+        _sensorIdToName(handle), handle, (int)(ns / 1000000));
 
-    char command[64];
-    snprintf(command, sizeof command, "set-delay:%d", ms);
+    /* Sanity check */
+    if (!ID_CHECK(handle)) {
+        E("%s: bad handle ID", __FUNCTION__);
+        return -EINVAL;
+    }
 
     pthread_mutex_lock(&dev->lock);
-    int ret = sensor_device_send_command_locked(dev, command);
+    dev->samplingPeriod[handle] = ns;
+    int ret = sensor_device_update_host_delay_locked(dev);
     pthread_mutex_unlock(&dev->lock);
-    if (ret < 0) {
-        E("%s: Could not send command: %s", __FUNCTION__, strerror(-ret));
-    }
     return ret;
 }
 
 static int sensor_device_default_batch(
-     struct sensors_poll_device_1* dev,
+     struct sensors_poll_device_1* dev0,
      int sensor_handle,
      int flags,
      int64_t sampling_period_ns,
      int64_t max_report_latency_ns) {
-    return sensor_device_set_delay(dev, sensor_handle, sampling_period_ns);
+
+    SensorDevice* dev = (void*)dev0;
+
+    D("%s: handle=%s (%d) latency-ms=%d", __FUNCTION__,
+        _sensorIdToName(sensor_handle), sensor_handle,
+        (int)(max_report_latency_ns / 1000000));
+
+    /* Sanity check */
+    if (!ID_CHECK(sensor_handle)) {
+        E("%s: bad handle ID", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&dev->lock);
+    dev->reportLatency[sensor_handle] =
+            (BATCHED_SENSORS & (1U << sensor_handle)) ? max_report_latency_ns : 0;
+    pthread_mutex_unlock(&dev->lock);
+
+    /* A shorter latency may make the pending events due already. */
+    sensor_device_wake(dev);
+
+    return sensor_device_set_delay(&dev->device.v0, sensor_handle,
+                                   sampling_period_ns);
+}
+
+/* Sensor data injection isn't supported. */
+static int sensor_device_inject_sensor_data(
+        struct sensors_poll_device_1* dev0 __unused,
+        const sensors_event_t* data __unused) {
+    return -EINVAL;
+}
+
+/* Return the direct channel with |handle|, or NULL.
+ *
+ * Note: The device's lock must be acquired.
+ */
+static SensorDirectChannel* sensor_device_find_direct_channel_locked(
+        SensorDevice* dev, int handle) {
+    for (int nn = 0; nn < MAX_DIRECT_CHANNELS; nn++) {
+        if (handle > 0 && dev->directChannels[nn].handle == handle) {
+            return &dev->directChannels[nn];
+        }
+    }
+    return NULL;
+}
+
+/* Recompute the sensors reported to any direct channel, and enable or
+ * disable them in the emulator.
+ *
+ * Note: The device's lock must be acquired.
+ */
+static int sensor_device_update_direct_sensors_locked(SensorDevice* dev) {
+    uint32_t sensors = 0;
+    for (int nn = 0; nn < MAX_DIRECT_CHANNELS; nn++) {
+        sensors |= dev->directChannels[nn].sensors;
+    }
+    __atomic_store_n(&dev->directSensors, sensors, __ATOMIC_RELAXED);
+    return sensor_device_update_host_sensors_locked(dev);
+}
+
+static int sensor_device_register_direct_channel(
+        struct sensors_poll_device_1* dev0,
+        const struct sensors_direct_mem_t* mem,
+        int channel_handle) {
+
+    SensorDevice* dev = (void*)dev0;
+    SensorDirectChannel* channel;
+    int ret = 0;
+
+    D("%s: mem=%p channel=%d", __FUNCTION__, mem, channel_handle);
+
+    pthread_mutex_lock(&dev->lock);
+    if (mem == NULL) {
+        /* Unregister |channel_handle|. */
+        channel = sensor_device_find_direct_channel_locked(dev, channel_handle);
+        if (channel == NULL) {
+            ret = -EINVAL;
+            goto out;
+        }
+        pthread_mutex_lock(&dev->directLock);
+        munmap(channel->events, channel->size);
+        memset(channel, 0, sizeof(*channel));
+        pthread_mutex_unlock(&dev->directLock);
+        ret = sensor_device_update_direct_sensors_locked(dev);
+        goto out;
+    }
+
+    if (mem->type != SENSOR_DIRECT_MEM_TYPE_ASHMEM ||
+        mem->format != SENSOR_DIRECT_FMT_SENSORS_EVENT ||
+        mem->size < sizeof(sensors_event_t) ||
+        mem->handle == NULL || mem->handle->numFds < 1) {
+        E("%s: unsupported shared memory", __FUNCTION__);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    channel = NULL;
+    for (int nn = 0; nn < MAX_DIRECT_CHANNELS && channel == NULL; nn++) {
+        if (dev->directChannels[nn].handle == 0) {
+            channel = &dev->directChannels[nn];
+        }
+    }
+    if (channel == NULL) {
+        E("%s: too many direct channels", __FUNCTION__);
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* The mapping stays valid after the client closes its handle. */
+    void* events = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        mem->handle->data[0], 0);
+    if (events == MAP_FAILED) {
+        ret = -errno;
+        E("%s: Could not map shared memory: %s", __FUNCTION__,
+          strerror(errno));
+        goto out;
+    }
+
+    if (++dev->lastDirectChannel <= 0) {
+        dev->lastDirectChannel = 1;
+    }
+    pthread_mutex_lock(&dev->directLock);
+    memset(channel, 0, sizeof(*channel));
+    channel->events = events;
+    channel->size = mem->size;
+    channel->capacity = mem->size / sizeof(sensors_event_t);
+    channel->handle = dev->lastDirectChannel;
+    pthread_mutex_unlock(&dev->directLock);
+    ret = channel->handle;
+out:
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+}
+
+static int sensor_device_config_direct_report(
+        struct sensors_poll_device_1* dev0,
+        int sensor_handle,
+        int channel_handle,
+        const struct sensors_direct_cfg_t* config) {
+
+    SensorDevice* dev = (void*)dev0;
+    int rate_level = config->rate_level;
+    int ret = 0;
+
+    D("%s: handle=%d channel=%d rate=%d", __FUNCTION__, sensor_handle,
+        channel_handle, rate_level);
+
+    /* Sanity check, only stopping is allowed for all sensors at once. */
+    if (sensor_handle == -1) {
+        if (rate_level != SENSOR_DIRECT_RATE_STOP) {
+            return -EINVAL;
+        }
+    } else if (!ID_CHECK(sensor_handle) ||
+               !(DIRECT_SENSORS & (1U << sensor_handle))) {
+        E("%s: bad handle ID", __FUNCTION__);
+        return -EINVAL;
+    }
+    if (rate_level != SENSOR_DIRECT_RATE_STOP &&
+        rate_level != SENSOR_DIRECT_RATE_NORMAL) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&dev->lock);
+    SensorDirectChannel* channel =
+            sensor_device_find_direct_channel_locked(dev, channel_handle);
+    if (channel == NULL) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    uint32_t mask = (sensor_handle == -1) ? SUPPORTED_SENSORS :
+            (1U << sensor_handle);
+    pthread_mutex_lock(&dev->directLock);
+    if (rate_level == SENSOR_DIRECT_RATE_STOP) {
+        channel->sensors &= ~mask;
+    } else {
+        channel->sensors |= mask;
+        channel->nextSampleTime[sensor_handle] = 0;
+    }
+    pthread_mutex_unlock(&dev->directLock);
+
+    ret = sensor_device_update_direct_sensors_locked(dev);
+    if (ret == 0 && rate_level != SENSOR_DIRECT_RATE_STOP) {
+        /* The report token is the handle, which can be 0, plus one. */
+        ret = sensor_handle + 1;
+    }
+out:
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
 }
 
 /** MODULE REGISTRATION SUPPORT
@@ -711,11 +1815,11 @@ static const struct sensor_t sSensorListInit[] = {
           .power      = 3.0f,
           .minDelay   = 10000,
           .maxDelay   = 500 * 1000,
-          .fifoReservedEventCount = 0,
-          .fifoMaxEventCount =   0,
+          .fifoReservedEventCount = SENSOR_FIFO_SIZE,
+          .fifoMaxEventCount = SENSOR_FIFO_SIZE,
           .stringType = "android.sensor.accelerometer",
           .requiredPermission = 0,
-          .flags = SENSOR_FLAG_CONTINUOUS_MODE,
+          .flags = SENSOR_FLAG_CONTINUOUS_MODE | SENSOR_FLAG_DIRECT,
           .reserved   = {}
         },
 
@@ -729,7 +1833,10 @@ static const struct sensor_t sSensorListInit[] = {
           .power      = 3.0f,
           .minDelay   = 10000,
           .maxDelay   = 500 * 1000,
+          .fifoReservedEventCount = SENSOR_FIFO_SIZE,
+          .fifoMaxEventCount = SENSOR_FIFO_SIZE,
           .stringType = "android.sensor.gyroscope",
+          .flags = SENSOR_FLAG_CONTINUOUS_MODE | SENSOR_FLAG_DIRECT,
           .reserved   = {}
         },
 
@@ -743,11 +1850,11 @@ static const struct sensor_t sSensorListInit[] = {
           .power      = 6.7f,
           .minDelay   = 10000,
           .maxDelay   = 500 * 1000,
-          .fifoReservedEventCount = 0,
-          .fifoMaxEventCount =   0,
+          .fifoReservedEventCount = SENSOR_FIFO_SIZE,
+          .fifoMaxEventCount = SENSOR_FIFO_SIZE,
           .stringType = "android.sensor.magnetic_field",
           .requiredPermission = 0,
-          .flags = SENSOR_FLAG_CONTINUOUS_MODE,
+          .flags = SENSOR_FLAG_CONTINUOUS_MODE | SENSOR_FLAG_DIRECT,
           .reserved   = {}
         },
 
@@ -761,8 +1868,8 @@ static const struct sensor_t sSensorListInit[] = {
           .power      = 9.7f,
           .minDelay   = 10000,
           .maxDelay   = 500 * 1000,
-          .fifoReservedEventCount = 0,
-          .fifoMaxEventCount =   0,
+          .fifoReservedEventCount = SENSOR_FIFO_SIZE,
+          .fifoMaxEventCount = SENSOR_FIFO_SIZE,
           .stringType = "android.sensor.orientation",
           .requiredPermission = 0,
           .flags = SENSOR_FLAG_CONTINUOUS_MODE,
@@ -779,8 +1886,8 @@ static const struct sensor_t sSensorListInit[] = {
           .power      = 0.0f,
           .minDelay   = 10000,
           .maxDelay   = 500 * 1000,
-          .fifoReservedEventCount = 0,
-          .fifoMaxEventCount =   0,
+          .fifoReservedEventCount = SENSOR_FIFO_SIZE,
+          .fifoMaxEventCount = SENSOR_FIFO_SIZE,
           .stringType = "android.sensor.ambient_temperature",
           .requiredPermission = 0,
           .flags = SENSOR_FLAG_ON_CHANGE_MODE,
@@ -815,8 +1922,8 @@ static const struct sensor_t sSensorListInit[] = {
           .power      = 20.0f,
           .minDelay   = 10000,
           .maxDelay   = 500 * 1000,
-          .fifoReservedEventCount = 0,
-          .fifoMaxEventCount =   0,
+          .fifoReservedEventCount = SENSOR_FIFO_SIZE,
+          .fifoMaxEventCount = SENSOR_FIFO_SIZE,
           .stringType = "android.sensor.light",
           .requiredPermission = 0,
           .flags = SENSOR_FLAG_ON_CHANGE_MODE,
@@ -833,8 +1940,8 @@ static const struct sensor_t sSensorListInit[] = {
           .power      = 20.0f,
           .minDelay   = 10000,
           .maxDelay   = 500 * 1000,
-          .fifoReservedEventCount = 0,
-          .fifoMaxEventCount =   0,
+          .fifoReservedEventCount = SENSOR_FIFO_SIZE,
+          .fifoMaxEventCount = SENSOR_FIFO_SIZE,
           .stringType = "android.sensor.pressure",
           .requiredPermission = 0,
           .flags = SENSOR_FLAG_CONTINUOUS_MODE,
@@ -851,8 +1958,8 @@ static const struct sensor_t sSensorListInit[] = {
           .power      = 20.0f,
           .minDelay   = 10000,
           .maxDelay   = 500 * 1000,
-          .fifoReservedEventCount = 0,
-          .fifoMaxEventCount =   0,
+          .fifoReservedEventCount = SENSOR_FIFO_SIZE,
+          .fifoMaxEventCount = SENSOR_FIFO_SIZE,
           .stringType = "android.sensor.relative_humidity",
           .requiredPermission = 0,
           .flags = SENSOR_FLAG_ON_CHANGE_MODE,
@@ -869,7 +1976,10 @@ static const struct sensor_t sSensorListInit[] = {
           .power      = 6.7f,
           .minDelay   = 10000,
           .maxDelay   = 500 * 1000,
+          .fifoReservedEventCount = SENSOR_FIFO_SIZE,
+          .fifoMaxEventCount = SENSOR_FIFO_SIZE,
           .stringType = "android.sensor.magnetic_field_uncalibrated",
+          .flags = SENSOR_FLAG_CONTINUOUS_MODE | SENSOR_FLAG_DIRECT,
           .reserved   = {}
         },
 };
@@ -937,31 +2047,49 @@ open_sensors(const struct hw_module_t* module,
         memset(dev, 0, sizeof(*dev));
 
         dev->device.common.tag     = HARDWARE_DEVICE_TAG;
-        dev->device.common.version = SENSORS_DEVICE_API_VERSION_1_3;
+        dev->device.common.version = SENSORS_DEVICE_API_VERSION_1_4;
         dev->device.common.module  = (struct hw_module_t*) module;
         dev->device.common.close   = sensor_device_close;
         dev->device.poll           = sensor_device_poll;
         dev->device.activate       = sensor_device_activate;
         dev->device.setDelay       = sensor_device_set_delay;
 
-        // (dev->sensors[i].type == SENSOR_TYPE_META_DATA) is
-        // sticky. Don't start off with that setting.
-        for (int idx = 0; idx < MAX_NUM_SENSORS; idx++) {
-            dev->sensors[idx].type = SENSOR_TYPE_META_DATA + 1;
-            dev->flush_count[idx] = 0;
-        }
-
         // Version 1.3-specific functions
         dev->device.batch       = sensor_device_default_batch;
         dev->device.flush       = sensor_device_default_flush;
 
+        // Version 1.4-specific functions
+        dev->device.inject_sensor_data      = sensor_device_inject_sensor_data;
+        dev->device.register_direct_channel =
+                sensor_device_register_direct_channel;
+        dev->device.config_direct_report    =
+                sensor_device_config_direct_report;
+
         dev->fd = -1;
+        dev->hostDelayMs = -1;
+        dev->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        dev->stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        dev->spaceFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (dev->wakeFd < 0 || dev->stopFd < 0 || dev->spaceFd < 0) {
+            status = -errno;
+            E("%s: Could not create eventfd: %s", __FUNCTION__,
+              strerror(errno));
+            if (dev->wakeFd >= 0) {
+                close(dev->wakeFd);
+            }
+            if (dev->stopFd >= 0) {
+                close(dev->stopFd);
+            }
+            if (dev->spaceFd >= 0) {
+                close(dev->spaceFd);
+            }
+            free(dev);
+            return status;
+        }
         pthread_mutex_init(&dev->lock, NULL);
+        pthread_mutex_init(&dev->directLock, NULL);
 
-        int64_t now = now_ns();
-        char command[64];
-        sprintf(command, "time:%lld", now);
-        sensor_device_send_command_locked(dev, command);
+        sensor_device_get_fd_locked(dev);
 
         *device = &dev->device.common;
         status  = 0;
@@ -978,7 +2106,7 @@ struct sensors_module_t HAL_MODULE_INFO_SYM = {
     .common = {
         .tag = HARDWARE_MODULE_TAG,
         .version_major = 1,
-        .version_minor = 3,
+        .version_minor = 4,
         .id = SENSORS_HARDWARE_MODULE_ID,
         .name = "Goldfish SENSORS Module",
         .author = "The Android Open Source Project",
@@ -0,0 +1,499 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* This program checks how the sensors HAL hands events to poll() and to
+ * direct channels, with a socketpair standing in for the emulator's qemud
+ * channel.
+ *
+ * Usage: test-sensors-hal
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cutils/ashmem.h>
+#include <cutils/native_handle.h>
+
+#include "qemud.h"
+#undef D
+
+/* The HAL connects to this program instead of the emulator. */
+static int test_channel_open(const char* name);
+#define qemud_channel_open test_channel_open
+
+#include "sensors_qemu.c"
+
+static int s_failures;
+
+#define  EXPECT_EQ(expected, actual)                                        \
+    do {                                                                    \
+        long long  e = (expected), a = (actual);                            \
+        if (e != a) {                                                       \
+            fprintf(stderr, "%s:%d: expected %lld, got %lld\n",             \
+                    __FILE__, __LINE__, e, a);                              \
+            s_failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+/* the emulator's end of the last channel the HAL opened */
+static int s_emulator = -1;
+
+static int test_channel_open(const char* name)
+{
+    int sv[2];
+
+    (void)name;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    if (s_emulator >= 0)
+        close(s_emulator);
+    s_emulator = sv[1];
+    return sv[0];
+}
+
+static SensorDevice* open_device(void)
+{
+    struct hw_device_t* device;
+
+    if (HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+                                                 SENSORS_HARDWARE_POLL,
+                                                 &device) != 0) {
+        fprintf(stderr, "could not open the sensors device\n");
+        exit(1);
+    }
+    return (SensorDevice*)device;
+}
+
+static void close_device(SensorDevice* dev)
+{
+    dev->device.common.close(&dev->device.common);
+    close(s_emulator);
+    s_emulator = -1;
+}
+
+/* Queue an event of sensor |id| taken at |timestamp|, as the reader thread
+ * does through sensor_device_drain_queue_locked(). */
+static void put_event(SensorDevice* dev, int id, int64_t timestamp)
+{
+    sensors_event_t event;
+
+    memset(&event, 0, sizeof(event));
+    event.type = SENSOR_TYPE_ACCELEROMETER;
+    event.timestamp = timestamp;
+    pthread_mutex_lock(&dev->lock);
+    sensor_device_dispatch_event_locked(dev, id, &event);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+/* Send |message| from the emulator, as qemud_channel_send() does. */
+static void send_message(const void* message, int len)
+{
+    char header[5];
+
+    snprintf(header, sizeof(header), "%04x", len);
+    if (!WriteFully(s_emulator, header, 4) ||
+        !WriteFully(s_emulator, message, len)) {
+        fprintf(stderr, "could not send to the HAL: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/* Send |count| events of sensor |id| from the emulator in frames, the
+ * first one taken at |first| and the next ones |period| apart. */
+static void send_events(int id, int count, int64_t first, int64_t period)
+{
+    for (int nn = 0; nn < count; nn += SENSOR_FRAME_MAX_RECORDS) {
+        char frame[SENSOR_FRAME_MAX_SIZE];
+        SensorFrameHeader header = { SENSOR_FRAME_MAGIC, 0,
+                                     SENSOR_FRAME_GUEST_TIME };
+
+        for (; header.count < SENSOR_FRAME_MAX_RECORDS &&
+               nn + header.count < count; header.count++) {
+            SensorFrameRecord record = {
+                first + (nn + header.count) * period, { 0, 9.81f, 0 },
+                id, { 0 } };
+            memcpy(frame + sizeof(header) + header.count * sizeof(record),
+                   &record, sizeof(record));
+        }
+        memcpy(frame, &header, sizeof(header));
+        send_message(frame, sizeof(header) +
+                            header.count * sizeof(SensorFrameRecord));
+    }
+}
+
+/* Wait until the reader thread pushed |count| events poll() didn't take. */
+static void wait_queued(SensorDevice* dev, uint32_t count)
+{
+    while (__atomic_load_n(&dev->queue.tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&dev->queue.head, __ATOMIC_ACQUIRE) < count)
+        usleep(1000);
+}
+
+/* Move what the reader thread pushed to the FIFOs, as poll() does. */
+static void drain_queue(SensorDevice* dev)
+{
+    pthread_mutex_lock(&dev->lock);
+    sensor_device_drain_queue_locked(dev);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+static void test_fifo_full(void)
+{
+    SensorDevice* dev = open_device();
+    SensorFifo* fifo = &dev->fifos[ID_ACCELERATION];
+    sensors_event_t data[64];
+
+    dev->device.activate(&dev->device.v0, ID_ACCELERATION, 1);
+
+    send_events(ID_ACCELERATION, SENSOR_FIFO_SIZE, 1000, 1000);
+    wait_queued(dev, SENSOR_FIFO_SIZE);
+    drain_queue(dev);
+    EXPECT_EQ(SENSOR_FIFO_SIZE, fifo->count);
+    EXPECT_EQ(0, fifo->stalls);
+
+    // a full FIFO still has room for a flush-complete event
+    EXPECT_EQ(0, dev->device.flush(&dev->device, ID_ACCELERATION));
+    EXPECT_EQ(SENSOR_FIFO_SIZE + 1, fifo->count);
+
+    // but not for more events, which wait in the reader's queue without
+    // anything being dropped
+    send_events(ID_ACCELERATION, 10, 1000 + SENSOR_FIFO_SIZE * 1000, 1000);
+    wait_queued(dev, 10);
+    drain_queue(dev);
+    EXPECT_EQ(SENSOR_FIFO_SIZE + 1, fifo->count);
+    EXPECT_EQ(SENSOR_FIFO_SIZE + 1, dev->pendingEvents);
+    EXPECT_EQ(1000, fifo->events[fifo->head].timestamp);
+    EXPECT_EQ(10, dev->queue.tail - dev->queue.head);
+    EXPECT_EQ(1, fifo->stalls);
+
+    // until poll() takes some of the FIFO's
+    EXPECT_EQ(64, dev->device.poll(&dev->device.v0, data, 64));
+    EXPECT_EQ(1000, data[0].timestamp);
+    drain_queue(dev);
+    EXPECT_EQ(0, dev->queue.tail - dev->queue.head);
+    EXPECT_EQ(SENSOR_FIFO_SIZE + 1 + 10 - 64, fifo->count);
+
+    close_device(dev);
+}
+
+static void test_flush_order(void)
+{
+    SensorDevice* dev = open_device();
+    sensors_event_t data[8];
+
+    dev->device.activate(&dev->device.v0, ID_ACCELERATION, 1);
+    dev->device.activate(&dev->device.v0, ID_GYROSCOPE, 1);
+
+    put_event(dev, ID_ACCELERATION, 100);
+    put_event(dev, ID_GYROSCOPE, 200);
+    put_event(dev, ID_ACCELERATION, 300);
+    EXPECT_EQ(0, dev->device.flush(&dev->device, ID_ACCELERATION));
+    put_event(dev, ID_GYROSCOPE, 400);
+
+    // the events of all sensors by time, and the flush after the events
+    // of its sensor queued before it
+    EXPECT_EQ(5, dev->device.poll(&dev->device.v0, data, 8));
+    EXPECT_EQ(ID_ACCELERATION, data[0].sensor);
+    EXPECT_EQ(100, data[0].timestamp);
+    EXPECT_EQ(ID_GYROSCOPE, data[1].sensor);
+    EXPECT_EQ(200, data[1].timestamp);
+    EXPECT_EQ(ID_ACCELERATION, data[2].sensor);
+    EXPECT_EQ(300, data[2].timestamp);
+    EXPECT_EQ(SENSOR_TYPE_META_DATA, data[3].type);
+    EXPECT_EQ(META_DATA_FLUSH_COMPLETE, data[3].meta_data.what);
+    EXPECT_EQ(ID_ACCELERATION, data[3].meta_data.sensor);
+    EXPECT_EQ(ID_GYROSCOPE, data[4].sensor);
+    EXPECT_EQ(400, data[4].timestamp);
+
+    // a flush of an empty FIFO completes at once
+    EXPECT_EQ(0, dev->device.flush(&dev->device, ID_GYROSCOPE));
+    EXPECT_EQ(1, dev->device.poll(&dev->device.v0, data, 8));
+    EXPECT_EQ(SENSOR_TYPE_META_DATA, data[0].type);
+    EXPECT_EQ(ID_GYROSCOPE, data[0].meta_data.sensor);
+
+    close_device(dev);
+}
+
+static void test_flush_queued(void)
+{
+    SensorDevice* dev = open_device();
+    enum { EVENTS = SENSOR_FIFO_SIZE + 10 };
+    sensors_event_t data[64];
+    int received = 0, flushes = 0, after = 0;
+
+    dev->device.activate(&dev->device.v0, ID_ACCELERATION, 1);
+
+    // events the reader thread pushed before the flush, more than the
+    // FIFO holds, all come before the flush completes
+    send_events(ID_ACCELERATION, EVENTS, 1000, 1000);
+    wait_queued(dev, EVENTS);
+    EXPECT_EQ(0, dev->device.flush(&dev->device, ID_ACCELERATION));
+
+    while (flushes == 0) {
+        int ret = dev->device.poll(&dev->device.v0, data, 64);
+        if (ret <= 0)
+            break;
+        for (int nn = 0; nn < ret; nn++) {
+            if (data[nn].type == SENSOR_TYPE_META_DATA)
+                flushes++;
+            else if (flushes)
+                after++;
+            else
+                received++;
+        }
+    }
+    EXPECT_EQ(EVENTS, received);
+    EXPECT_EQ(1, flushes);
+    EXPECT_EQ(0, after);
+
+    close_device(dev);
+}
+
+static void test_report_latency(void)
+{
+    SensorDevice* dev = open_device();
+    sensors_event_t data[SENSOR_FIFO_SIZE];
+    const int64_t period = 10000000LL;
+    int64_t start, elapsed;
+
+    dev->device.batch(&dev->device, ID_ACCELERATION, 0, period, 100000000LL);
+    dev->device.activate(&dev->device.v0, ID_ACCELERATION, 1);
+
+    // held until the oldest one is 100 ms old
+    start = now_ns();
+    put_event(dev, ID_ACCELERATION, start);
+    put_event(dev, ID_ACCELERATION, start + period);
+    EXPECT_EQ(2, dev->device.poll(&dev->device.v0, data, 8));
+    elapsed = now_ns() - start;
+    EXPECT_EQ(1, elapsed >= 100000000LL && elapsed < 1000000000LL);
+
+    // or reported with the flush
+    start = now_ns();
+    put_event(dev, ID_ACCELERATION, start);
+    EXPECT_EQ(0, dev->device.flush(&dev->device, ID_ACCELERATION));
+    EXPECT_EQ(2, dev->device.poll(&dev->device.v0, data, 8));
+    EXPECT_EQ(SENSOR_TYPE_META_DATA, data[1].type);
+    EXPECT_EQ(1, now_ns() - start < 50000000LL);
+
+    // or once the FIFO reaches its watermark
+    start = now_ns();
+    for (int nn = 1; nn <= SENSOR_FIFO_WATERMARK; nn++)
+        put_event(dev, ID_ACCELERATION, start + nn * period);
+    EXPECT_EQ(SENSOR_FIFO_WATERMARK,
+              dev->device.poll(&dev->device.v0, data, SENSOR_FIFO_SIZE));
+    EXPECT_EQ(1, now_ns() - start < 50000000LL);
+
+    // and without a latency, right away
+    dev->device.batch(&dev->device, ID_ACCELERATION, 0, period, 0);
+    start = now_ns();
+    put_event(dev, ID_ACCELERATION, data[SENSOR_FIFO_WATERMARK - 1].timestamp +
+                                    period);
+    EXPECT_EQ(1, dev->device.poll(&dev->device.v0, data, 8));
+    EXPECT_EQ(1, now_ns() - start < 50000000LL);
+
+    close_device(dev);
+}
+
+static void test_sampling_periods(void)
+{
+    SensorDevice* dev = open_device();
+
+    dev->device.setDelay(&dev->device.v0, ID_ACCELERATION, 10000000LL);
+    dev->device.setDelay(&dev->device.v0, ID_LIGHT, 200000000LL);
+    dev->device.activate(&dev->device.v0, ID_ACCELERATION, 1);
+    dev->device.activate(&dev->device.v0, ID_LIGHT, 1);
+
+    // the emulator sends at the fastest rate
+    EXPECT_EQ(10, dev->hostDelayMs);
+
+    // and each sensor keeps about one event per period of its own, over
+    // a second of events every 5 ms
+    for (int nn = 0; nn < 200; nn++) {
+        put_event(dev, ID_ACCELERATION, nn * 5000000LL);
+        put_event(dev, ID_LIGHT, nn * 5000000LL);
+    }
+    int accel = dev->fifos[ID_ACCELERATION].count;
+    int light = dev->fifos[ID_LIGHT].count;
+    EXPECT_EQ(1, accel >= 100 && accel <= 101);
+    EXPECT_EQ(1, light >= 5 && light <= 6);
+
+    dev->device.activate(&dev->device.v0, ID_ACCELERATION, 0);
+    EXPECT_EQ(200, dev->hostDelayMs);
+
+    close_device(dev);
+}
+
+static void test_direct_channel(void)
+{
+    SensorDevice* dev = open_device();
+    const int capacity = 8;
+    const size_t size = capacity * sizeof(sensors_event_t);
+    const int64_t period = DIRECT_NORMAL_PERIOD_NS;
+    native_handle_t* handle = native_handle_create(1, 0);
+    sensors_direct_mem_t mem = {
+        .type = SENSOR_DIRECT_MEM_TYPE_ASHMEM,
+        .format = SENSOR_DIRECT_FMT_SENSORS_EVENT,
+        .size = size,
+        .handle = handle,
+    };
+    sensors_direct_cfg_t config = { .rate_level = SENSOR_DIRECT_RATE_NORMAL };
+
+    handle->data[0] = ashmem_create_region("test-sensors-hal", size);
+    const sensors_event_t* ring = mmap(NULL, size, PROT_READ, MAP_SHARED,
+                                       handle->data[0], 0);
+    if (handle->data[0] < 0 || ring == MAP_FAILED) {
+        fprintf(stderr, "could not create shared memory\n");
+        exit(1);
+    }
+
+    int channel = dev->device.register_direct_channel(&dev->device, &mem, -1);
+    EXPECT_EQ(1, channel > 0);
+
+    // the token is the sensor handle plus one, and only the normal rate of
+    // some sensors is supported
+    EXPECT_EQ(ID_ACCELERATION + 1,
+              dev->device.config_direct_report(&dev->device, ID_ACCELERATION,
+                                               channel, &config));
+    EXPECT_EQ(-EINVAL, dev->device.config_direct_report(&dev->device,
+                                                        ID_LIGHT, channel,
+                                                        &config));
+    config.rate_level = SENSOR_DIRECT_RATE_FAST;
+    EXPECT_EQ(-EINVAL,
+              dev->device.config_direct_report(&dev->device, ID_ACCELERATION,
+                                               channel, &config));
+
+    // the reader thread writes the events without poll(): they wrap around
+    // the ring, each with its token and counter, and aren't queued for
+    // poll() as the sensor isn't active
+    send_events(ID_ACCELERATION, capacity + 4, 0, period);
+    while (__atomic_load_n(&ring[3].reserved0, __ATOMIC_ACQUIRE) !=
+           capacity + 4)
+        usleep(1000);
+    for (int nn = 0; nn < capacity; nn++) {
+        int counter = (nn < 4) ? capacity + nn + 1 : nn + 1;
+        EXPECT_EQ(counter, ring[nn].reserved0);
+        EXPECT_EQ(ID_ACCELERATION + 1, ring[nn].sensor);
+        EXPECT_EQ(SENSOR_TYPE_ACCELEROMETER, ring[nn].type);
+        EXPECT_EQ((counter - 1) * period, ring[nn].timestamp);
+    }
+    EXPECT_EQ(0, dev->queue.tail - dev->queue.head);
+
+    // stopping the sensor stops its events, which the queued event of an
+    // active sensor shows the reader got to
+    config.rate_level = SENSOR_DIRECT_RATE_STOP;
+    EXPECT_EQ(0, dev->device.config_direct_report(&dev->device, -1, channel,
+                                                  &config));
+    dev->device.activate(&dev->device.v0, ID_LIGHT, 1);
+    send_events(ID_ACCELERATION, 1, (capacity + 4) * period, period);
+    send_events(ID_LIGHT, 1, (capacity + 4) * period, period);
+    wait_queued(dev, 1);
+    EXPECT_EQ(1, dev->queue.tail - dev->queue.head);
+    EXPECT_EQ(capacity + 1, ring[0].reserved0);
+
+    EXPECT_EQ(0, dev->device.register_direct_channel(&dev->device, NULL,
+                                                     channel));
+    EXPECT_EQ(-EINVAL, dev->device.config_direct_report(&dev->device, -1,
+                                                        channel, &config));
+
+    munmap((void*)ring, size);
+    close(handle->data[0]);
+    native_handle_delete(handle);
+    close_device(dev);
+}
+
+/* Return whether the HAL sent |command| since the last call. */
+static int received_command(const char* command)
+{
+    static char buff[4096];
+    int len = recv(s_emulator, buff, sizeof(buff) - 1, MSG_DONTWAIT);
+
+    if (len < 0)
+        return 0;
+    buff[len] = 0;
+    return strstr(buff, command) != NULL;
+}
+
+static void test_reader(void)
+{
+    SensorDevice* dev = open_device();
+    enum { EVENTS = 1500 };
+    sensors_event_t data[64];
+    int received = 0, ordered = 1;
+    int64_t last = 0;
+
+    dev->device.activate(&dev->device.v0, ID_ACCELERATION, 1);
+
+    // a burst larger than the reader's queue and the FIFO, in frames
+    send_events(ID_ACCELERATION, EVENTS, 1000, 1000);
+
+    // arrives whole and in order, the reader waiting for poll()
+    while (received < EVENTS) {
+        int ret = dev->device.poll(&dev->device.v0, data, 64);
+        if (ret <= 0)
+            break;
+        for (int nn = 0; nn < ret; nn++) {
+            ordered &= data[nn].timestamp > last;
+            last = data[nn].timestamp;
+        }
+        received += ret;
+    }
+    EXPECT_EQ(EVENTS, received);
+    EXPECT_EQ(1, ordered);
+
+    // poll() reports a lost channel once
+    close(s_emulator);
+    s_emulator = -1;
+    EXPECT_EQ(1, dev->device.poll(&dev->device.v0, data, 64) < 0);
+    EXPECT_EQ(-1, dev->fd);
+
+    // and the next command opens a new one, set up as the last one was
+    dev->device.activate(&dev->device.v0, ID_GYROSCOPE, 1);
+    EXPECT_EQ(1, s_emulator >= 0 && received_command("set:acceleration:1"));
+
+    const char* lines[] = { "acceleration:1:2:3", "sync:1000" };
+    for (int nn = 0; nn < 2; nn++)
+        send_message(lines[nn], strlen(lines[nn]));
+    EXPECT_EQ(1, dev->device.poll(&dev->device.v0, data, 64));
+    EXPECT_EQ(ID_ACCELERATION, data[0].sensor);
+    EXPECT_EQ(3, (int)data[0].acceleration.z);
+
+    close_device(dev);
+}
+
+int main(void)
+{
+    // a poll() that never returns fails the test
+    alarm(30);
+
+    test_fifo_full();
+    test_flush_order();
+    test_flush_queued();
+    test_report_latency();
+    test_sampling_periods();
+    test_direct_channel();
+    test_reader();
+
+    if (s_failures) {
+        fprintf(stderr, "%d failures\n", s_failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
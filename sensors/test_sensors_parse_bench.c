@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* This program compares the sensor event parser with the chain of sscanf()
+ * patterns it replaced, on the lines the emulator sends for accelerometer,
+ * gyroscope and magnetometer at 200 Hz plus the slower sensors, and checks
+ * that both agree.
+ *
+ * It then replays the same epochs through poll(), once as text lines and
+ * once as binary frames of the largest size, and compares the reads and
+ * time per event.
+ *
+ * Usage: test-sensors-parse-bench [iterations]
+ */
+#include "sensors_qemu.c"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define  DEFAULT_ITERATIONS  200000
+#define  REPLAY_EPOCHS       (DEFAULT_ITERATIONS / 4)
+
+static const char* const  kLines[] = {
+    "acceleration:0.123457:9.77631:0.812738",
+    "gyroscope:-0.00123:0.0402:1.5e-05",
+    "magnetic:22.5:-5.8125:-43.4375",
+    "guest-sync:1234567890123",
+    "sync:1234567890",
+    "acceleration:-0.0421875:9.80665:0.25",
+    "gyroscope:0:0:0",
+    "magnetic:22.4375:-5.875:-43.375",
+    "magnetic-uncalibrated:22.4375:-5.875:-43.375",
+    "orientation:271.5:-1.25:0.5",
+    "guest-sync:1234572890123",
+    "sync:1234572890",
+    "light:412.5",
+    "proximity:1",
+    "pressure:1013.25",
+    "temperature:21.5",
+    "humidity:43",
+    "sync:1234577890",
+};
+
+#define  NUM_LINES  (int)(sizeof(kLines) / sizeof(kLines[0]))
+
+/* The parser sensor_device_poll_event_locked() used before: returns the
+ * sensor id, -2 for a guest-sync, -3 for a sync, or -1. */
+static int parse_line_sscanf(const char* buff, float* params, int64_t* time)
+{
+    long long t;
+
+    if (sscanf(buff, "acceleration:%g:%g:%g", params+0, params+1, params+2) == 3)
+        return ID_ACCELERATION;
+    if (sscanf(buff, "gyroscope:%g:%g:%g", params+0, params+1, params+2) == 3)
+        return ID_GYROSCOPE;
+    if (sscanf(buff, "orientation:%g:%g:%g", params+0, params+1, params+2) == 3)
+        return ID_ORIENTATION;
+    if (sscanf(buff, "magnetic:%g:%g:%g", params+0, params+1, params+2) == 3)
+        return ID_MAGNETIC_FIELD;
+    if (sscanf(buff, "magnetic-uncalibrated:%g:%g:%g", params+0, params+1, params+2) == 3)
+        return ID_MAGNETIC_FIELD_UNCALIBRATED;
+    if (sscanf(buff, "temperature:%g", params+0) == 1)
+        return ID_TEMPERATURE;
+    if (sscanf(buff, "proximity:%g", params+0) == 1)
+        return ID_PROXIMITY;
+    if (sscanf(buff, "light:%g", params+0) == 1)
+        return ID_LIGHT;
+    if (sscanf(buff, "pressure:%g", params+0) == 1)
+        return ID_PRESSURE;
+    if (sscanf(buff, "humidity:%g", params+0) == 1)
+        return ID_HUMIDITY;
+    if (sscanf(buff, "guest-sync:%lld", &t) == 1) {
+        *time = t;
+        return -2;
+    }
+    if (sscanf(buff, "sync:%lld", &t) == 1) {
+        *time = t;
+        return -3;
+    }
+    return -1;
+}
+
+static int parse_line(const char* buff, int len, float* params, int64_t* time)
+{
+    const SensorLine* line = sensor_line_parse(buff, len, params, time);
+
+    if (line == NULL)
+        return -1;
+    switch (line->kind) {
+        case LINE_GUEST_SYNC: return -2;
+        case LINE_SYNC:       return -3;
+        case LINE_SENSOR:     return line->id;
+    }
+    return -1;
+}
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check_lines(void)
+{
+    int failures = 0;
+
+    for (int nn = 0; nn < NUM_LINES; nn++) {
+        float expected[3] = { 0 }, actual[3] = { 0 };
+        int64_t expected_time = 0, actual_time = 0;
+        int expected_id = parse_line_sscanf(kLines[nn], expected, &expected_time);
+        int actual_id = parse_line(kLines[nn], strlen(kLines[nn]), actual,
+                                   &actual_time);
+
+        if (expected_id != actual_id || expected_time != actual_time ||
+            memcmp(expected, actual, sizeof(expected))) {
+            fprintf(stderr, "mismatch on '%s': %d [%g %g %g] %lld, "
+                    "expected %d [%g %g %g] %lld\n", kLines[nn],
+                    actual_id, actual[0], actual[1], actual[2],
+                    (long long)actual_time,
+                    expected_id, expected[0], expected[1], expected[2],
+                    (long long)expected_time);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static void put_message(FILE* f, const void* msg, int len)
+{
+    fprintf(f, "%04x", len);
+    fwrite(msg, 1, len, f);
+}
+
+/* Send the records of |frame| as one message, and start a new frame. */
+static void put_frame(FILE* f, char* frame, SensorFrameHeader* header)
+{
+    memcpy(frame, header, sizeof(*header));
+    put_message(f, frame,
+                sizeof(*header) + header->count * sizeof(SensorFrameRecord));
+    header->count = 0;
+}
+
+/* Write |epochs| epochs of the sensors of kLines[], as text lines or as
+ * frames, and return the number of events. Frames are filled up to
+ * SENSOR_FRAME_MAX_RECORDS across epochs, so all but the last one have
+ * the largest size the emulator may send. */
+static int write_epochs(FILE* f, int epochs, int binary)
+{
+    char frame[SENSOR_FRAME_MAX_SIZE];
+    SensorFrameHeader header = { SENSOR_FRAME_MAGIC, 0, 0 };
+    int events = 0;
+
+    for (int it = 0; it < epochs; it++) {
+        int64_t sync_time = (int64_t)it * 5000;
+
+        for (int nn = 0; nn < NUM_LINES; nn++) {
+            SensorFrameRecord record = { sync_time, { 0 }, 0, { 0 } };
+            int64_t time;
+            int id = parse_line(kLines[nn], strlen(kLines[nn]), record.values,
+                                &time);
+
+            if (id < 0) {
+                if (id == -3 && !binary) {
+                    char line[64];
+                    int len = snprintf(line, sizeof(line), "sync:%lld",
+                                       (long long)sync_time);
+                    put_message(f, line, len);
+                }
+                continue;
+            }
+            events++;
+            if (!binary) {
+                put_message(f, kLines[nn], strlen(kLines[nn]));
+                continue;
+            }
+            record.id = id;
+            memcpy(frame + sizeof(header) + header.count * sizeof(record),
+                   &record, sizeof(record));
+            if (++header.count == SENSOR_FRAME_MAX_RECORDS)
+                put_frame(f, frame, &header);
+        }
+    }
+    if (header.count > 0)
+        put_frame(f, frame, &header);
+    fflush(f);
+    rewind(f);
+    return events;
+}
+
+/* Poll all the events of |binary| or text epochs, return the seconds it
+ * took and set |*messages| to the number of qemud messages. */
+static double replay_epochs(int epochs, int binary, int* messages, int* events)
+{
+    static SensorDevice dev;
+    sensors_event_t data[64];
+    FILE* f = tmpfile();
+    double start, secs;
+    int received = 0;
+
+    memset(&dev, 0, sizeof(dev));
+    pthread_mutex_init(&dev.lock, NULL);
+    dev.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    dev.stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    dev.spaceFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    dev.hostDelayMs = -1;
+    dev.active_sensors = SUPPORTED_SENSORS;
+
+    *events = write_epochs(f, epochs, binary);
+    *messages = 0;
+    for (int c; (c = getc(f)) != EOF; ) {
+        char size[5] = { (char)c, 0 };
+        unsigned len;
+        if (fread(size + 1, 1, 3, f) != 3 || sscanf(size, "%04x", &len) != 1)
+            break;
+        fseek(f, len, SEEK_CUR);
+        (*messages)++;
+    }
+    rewind(f);
+
+    /* what sensor_device_get_fd_locked() does, with the file */
+    start = now_secs();
+    dev.fd = fileno(f);
+    if (sensor_device_start_reader_locked(&dev) < 0)
+        return -1;
+    while (received < *events) {
+        int ret = sensor_device_poll(&dev.device.v0, data, 64);
+        if (ret <= 0)
+            break;
+        received += ret;
+    }
+    secs = now_secs() - start;
+
+    sensor_device_stop_reader(&dev);
+    fclose(f);
+    close(dev.wakeFd);
+    close(dev.stopFd);
+    close(dev.spaceFd);
+    if (received != *events) {
+        fprintf(stderr, "%s replay: %d events, expected %d\n",
+                binary ? "binary" : "text", received, *events);
+        return -1;
+    }
+    return secs;
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = (argc > 1) ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    int lengths[NUM_LINES];
+    float params[3];
+    int64_t time;
+    double start, sscanf_secs, parse_secs;
+    long lines = (long)iterations * NUM_LINES;
+    int sum = 0;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    if (check_lines() != 0)
+        return 1;
+
+    for (int nn = 0; nn < NUM_LINES; nn++)
+        lengths[nn] = strlen(kLines[nn]);
+
+    start = now_secs();
+    for (int it = 0; it < iterations; it++) {
+        for (int nn = 0; nn < NUM_LINES; nn++)
+            sum += parse_line_sscanf(kLines[nn], params, &time);
+    }
+    sscanf_secs = now_secs() - start;
+
+    start = now_secs();
+    for (int it = 0; it < iterations; it++) {
+        for (int nn = 0; nn < NUM_LINES; nn++)
+            sum += parse_line(kLines[nn], lengths[nn], params, &time);
+    }
+    parse_secs = now_secs() - start;
+
+    printf("sscanf chain: %ld lines in %.3f s, %.0f lines/s\n",
+           lines, sscanf_secs, lines / sscanf_secs);
+    printf("prefix parser: %ld lines in %.3f s, %.0f lines/s (%.1fx)\n",
+           lines, parse_secs, lines / parse_secs, sscanf_secs / parse_secs);
+
+    int text_messages, binary_messages, events;
+    double text_secs = replay_epochs(REPLAY_EPOCHS, 0, &text_messages, &events);
+    double binary_secs = replay_epochs(REPLAY_EPOCHS, 1, &binary_messages,
+                                       &events);
+    if (text_secs < 0 || binary_secs < 0)
+        return 1;
+
+    /* qemud_channel_recv() reads the size, then the payload */
+    printf("text replay: %d events, %.2f reads and %.0f ns per event\n",
+           events, 2.0 * text_messages / events, text_secs * 1e9 / events);
+    printf("binary replay: %d events, %.2f reads and %.0f ns per event "
+           "(%.1fx)\n", events, 2.0 * binary_messages / events,
+           binary_secs * 1e9 / events, text_secs / binary_secs);
+    return sum == 0x7FFFFFFF;   /* keep the loops */
+}
@@ -0,0 +1,26 @@
+# Build sensors tests, included from main Android.mk
+
+# Compares the sensor event parser with the sscanf() chain it replaced, and
+# the text protocol with binary frames.
+#
+include $(CLEAR_VARS)
+LOCAL_MODULE := test-sensors-parse-bench
+LOCAL_SRC_FILES := test_sensors_parse_bench.c
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_HEADER_LIBRARIES := libhardware_headers
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
+
+# Checks the reader thread, FIFOs, batching and sampling periods behind
+# poll(), and direct channels, with a socketpair in place of the qemud
+# channel.
+#
+include $(CLEAR_VARS)
+LOCAL_MODULE := test-sensors-hal
+LOCAL_SRC_FILES := test_sensors_hal.c
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_HEADER_LIBRARIES := libhardware_headers
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
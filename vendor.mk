@@ -42,6 +42,8 @@ PRODUCT_PACKAGES += \
     lights.goldfish \
     gps.goldfish \
     gps.ranchu \
+    flp.goldfish \
+    flp.ranchu \
     fingerprint.goldfish \
     sensors.goldfish \
     audio.primary.goldfish \